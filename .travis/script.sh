@@ -5,6 +5,7 @@ PROJECTNAME=propellermanager-$TRAVIS_TAG-$TRAVIS_OS_NAME
 
 qmake PREFIX=`pwd`/$PROJECTNAME -r
 make -j4
+make check
 make install
 
 tar cvzf $PROJECTNAME.tgz $PROJECTNAME
@@ -11,16 +11,21 @@
 #include <PropellerManager>
 #include <PropellerSession>
 #include <PropellerLoader>
+#include <PropellerTask>
 #include <PropellerTerminal>
 #include <PropellerImage>
+#include <PropellerProtocol>
 
 #ifndef VERSION
 #define VERSION "0.0.0"
 #endif
 
 PropellerImage load_image(QCommandLineParser &parser);
+PropellerImage prepare_image(QCommandLineParser &parser);
 void open_loader(QCommandLineParser &parser, QStringList devices);
+void gang_loader(QCommandLineParser &parser, QStringList devices);
 void info(PropellerImage image);
+void verify(PropellerImage image, bool write);
 void list();
 void error(const QString & text);
 void message(const QString & text);
@@ -32,12 +37,14 @@ QStringList devices = manager.listPorts();
 
 QCommandLineOption argList      (QStringList() << "l" << "list",    QObject::tr("List available devices"));
 QCommandLineOption argWrite     (QStringList() << "w" << "write",   QObject::tr("Write program to EEPROM"));
-QCommandLineOption argDevice    (QStringList() << "d" << "device",  QObject::tr("Device to program (default: first system device)"), "DEV");
+QCommandLineOption argDevice    (QStringList() << "d" << "device",  QObject::tr("Device to program (default: first system device); repeat to program several at once"), "DEV");
+QCommandLineOption argAll       (QStringList() << "a" << "all",     QObject::tr("Program every available device at once"));
 QCommandLineOption argBaud      (QStringList() << "b" << "baud",    QObject::tr("Baud rate for terminal (default: 115200)"), "BAUD");
 QCommandLineOption argPin       (QStringList() << "p" << "pin",     QObject::tr("Pin for GPIO reset"), "PIN");
 QCommandLineOption argTerm      (QStringList() << "t" << "terminal",QObject::tr("Drop into terminal after download"));
 QCommandLineOption argIdentify  (QStringList() << "i" << "identify",QObject::tr("Identify device connected at port"));
 QCommandLineOption argInfo      (QStringList() << "image",          QObject::tr("Print info about downloadable image"));
+QCommandLineOption argVerify    (QStringList() << "verify",         QObject::tr("Verify encoding of image without downloading"));
 QCommandLineOption argClkMode   (QStringList() << "clkmode",        QObject::tr("Change clock mode before download"), "MODE");
 QCommandLineOption argClkFreq   (QStringList() << "clkfreq",        QObject::tr("Change clock frequency before download"), "FREQ");
 
@@ -60,11 +67,13 @@ int main(int argc, char *argv[])
     parser.addOption(argList);
     parser.addOption(argWrite);
     parser.addOption(argDevice);
+    parser.addOption(argAll);
     parser.addOption(argBaud);
     parser.addOption(argPin);
     parser.addOption(argTerm);
     parser.addOption(argIdentify);
     parser.addOption(argInfo);
+    parser.addOption(argVerify);
     parser.addOption(argClkMode);
     parser.addOption(argClkFreq);
 
@@ -97,17 +106,31 @@ int main(int argc, char *argv[])
         if (! devices.length() > 0)
             error("No devices attached!");
 
-        foreach (QString d, devices)
-        {
-            PropellerLoader loader(&manager, d);
-            printf("%s: %s\n", qPrintable(d), qPrintable(loader.versionString(loader.version())));
-            fflush(stdout);
-        }
+        // print each port as soon as it resolves
+        QObject::connect(&manager, &PropellerManager::portFinished,
+                [](const PropellerResult & result)
+                {
+                    printf("%s: %s\n", qPrintable(result.portName),
+                            qPrintable(PropellerLoader::versionStrings().value(result.version)));
+                    fflush(stdout);
+                });
+
+        PropellerTask * scan = manager.identifyAll(devices);
+        scan->waitForFinished();
+        delete scan;
     }
     else if (parser.isSet(argInfo))
     {
         info(load_image(parser));
     }
+    else if (parser.isSet(argVerify))
+    {
+        verify(load_image(parser), parser.isSet(argWrite));
+    }
+    else if (parser.isSet(argAll) || parser.values(argDevice).size() > 1)
+    {
+        gang_loader(parser, devices);
+    }
     else
     {
         open_loader(parser, devices);
@@ -152,35 +175,14 @@ void open_loader(QCommandLineParser &parser, QStringList devices)
     }
 
     PropellerLoader loader(&manager, device);
-    PropellerImage image = load_image(parser);
-
-    if (parser.isSet(argClkFreq))
-    {
-        bool ok;
-        int freq = parser.value(argClkFreq).toInt(&ok);
-        if (!ok)
-            error("Invalid clock frequency: "+parser.value(argClkFreq));
-
-        image.setClockFrequency(freq);
-    }
-
-    if (parser.isSet(argClkMode))
-    {
-        bool ok;
-        int mode = parser.value(argClkMode).toUInt(&ok, 16);
-        if (!image.setClockMode(mode) || !ok)
-            error("Clock mode setting "+QString::number(mode, 16)+"is invalid!");
-    }
-
-    if (!image.isValid())
-        error("Image is invalid!");
-
+    PropellerImage image = prepare_image(parser);
 
     PropellerTerminal terminal(&manager, device, baudrate);
 
     QObject::connect (&loader, SIGNAL(statusChanged(const QString &)),
                       &loader, SLOT(message(const QString &)));
 
+
     if (!loader.upload(image, parser.isSet(argWrite), true, true))
         exit(1);
 
@@ -191,6 +193,60 @@ void open_loader(QCommandLineParser &parser, QStringList devices)
         terminal.exec();
 }
 
+void gang_loader(QCommandLineParser &parser, QStringList devices)
+{
+    QStringList ports = devices;
+    if (!parser.isSet(argAll))
+    {
+        ports = parser.values(argDevice);
+        foreach (QString port, ports)
+        {
+            if (!devices.contains(port))
+                error("Device does not exist: "+port);
+        }
+    }
+
+    if (ports.isEmpty())
+        error("No device available for download!");
+
+    if (parser.isSet(argTerm))
+        error("Terminal can only be used with a single device");
+
+    if (parser.positionalArguments().isEmpty())
+        error("Must provide name of binary");
+
+    PropellerImage image = prepare_image(parser);
+
+    message(QString("Programming %1 devices...").arg(ports.size()));
+
+    PropellerTask * gang = manager.uploadAll(image, ports, parser.isSet(argWrite));
+    gang->waitForFinished();
+
+    int failed = 0;
+    qint64 slowest = 0;
+    foreach (PropellerResult result, gang->results())
+    {
+        printf("%s: %s (%.1f ms)\n", qPrintable(result.portName),
+                result.success() ? "OK" : qPrintable(result.errorString),
+                result.report.duration() / 1000.0);
+
+        slowest = qMax(slowest, result.report.duration());
+        if (!result.success())
+            failed++;
+    }
+    fflush(stdout);
+
+    delete gang;
+
+    message(QString("%1 of %2 devices programmed; slowest took %3 ms")
+            .arg(ports.size() - failed)
+            .arg(ports.size())
+            .arg(slowest / 1000.0, 0, 'f', 1));
+
+    if (failed)
+        exit(1);
+}
+
 void list()
 {
     for (int i = 0; i < devices.size(); i++)
@@ -214,6 +270,26 @@ void info(PropellerImage image)
         printf(" Clock frequency: %i\n",image.clockFrequency());
 }
 
+void verify(PropellerImage image, bool write)
+{
+    PropellerProtocol protocol;
+    QList<int> mismatches;
+
+    Command::Command command = write ? Command::WriteRun : Command::Run;
+
+    if (protocol.verifyDownload(image.data(), command, &mismatches))
+    {
+        printf("Verified %u bytes\n", image.imageSize());
+        return;
+    }
+
+    for (int i = 0; i < mismatches.size() && i < 16; i++)
+        printf("Mismatch at %04X\n", mismatches[i]);
+
+    error(QString("Encoded image does not match (%1 bytes differ)")
+            .arg(mismatches.size()));
+}
+
 PropellerImage load_image(QCommandLineParser &parser)
 {
     QString filename = parser.positionalArguments()[0];
@@ -234,6 +310,34 @@ PropellerImage load_image(QCommandLineParser &parser)
     return PropellerImage(file.readAll(),filename);
 }
 
+PropellerImage prepare_image(QCommandLineParser &parser)
+{
+    PropellerImage image = load_image(parser);
+
+    if (parser.isSet(argClkFreq))
+    {
+        bool ok;
+        int freq = parser.value(argClkFreq).toInt(&ok);
+        if (!ok)
+            error("Invalid clock frequency: "+parser.value(argClkFreq));
+
+        image.setClockFrequency(freq);
+    }
+
+    if (parser.isSet(argClkMode))
+    {
+        bool ok;
+        int mode = parser.value(argClkMode).toUInt(&ok, 16);
+        if (!image.setClockMode(mode) || !ok)
+            error("Clock mode setting "+QString::number(mode, 16)+"is invalid!");
+    }
+
+    if (!image.isValid())
+        error("Image is invalid!");
+
+    return image;
+}
+
 void message(const QString & text)
 {
     fprintf(stderr, "%s\n", qPrintable(text));
@@ -0,0 +1,11 @@
+include(../common.pri)
+include(../include.pri)
+
+TEMPLATE = app
+TARGET = propman-bench
+DESTDIR = $$TOP_PWD/bin/
+
+CONFIG += console
+
+SOURCES += \
+    main.cpp
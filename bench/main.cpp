@@ -0,0 +1,237 @@
+#include <QCoreApplication>
+#include <QDirIterator>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <PropellerImage>
+#include <PropellerProtocol>
+#include <PropellerManager>
+#include <PropellerLoader>
+#include <PayloadAnalyzer>
+
+/*
+    Microbenchmarks for the protocol and image hot paths.
+
+    Usage: propman-bench [DIR|FILE...]
+
+    Every benchmark runs over each image found (by default, recursively
+    under test/images) and reports the time per call, time per image
+    byte, and heap allocations per call. The setup cost of a loader,
+    created afresh or borrowed from PropellerManager's pool, is measured
+    once up front.
+
+    Allocations are counted by interposing malloc, which is only
+    possible with glibc; elsewhere they are reported as n/a.
+*/
+
+#ifdef __GLIBC__
+
+extern "C" void * __libc_malloc(size_t size);
+extern "C" void * __libc_calloc(size_t count, size_t size);
+extern "C" void * __libc_realloc(void * ptr, size_t size);
+
+static quint64 allocations = 0;
+
+extern "C" void * malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+extern "C" void * calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+extern "C" void * realloc(void * ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+static const bool counting = true;
+
+#else
+
+static quint64 allocations = 0;
+static const bool counting = false;
+
+#endif
+
+struct Result
+{
+    double ns;
+    double allocs;
+};
+
+// Run f repeatedly for roughly 100 ms after a short warmup.
+template <typename F>
+Result measure(F f)
+{
+    for (int i = 0; i < 3; i++)
+        f();
+
+    QElapsedTimer timer;
+    qint64 iterations = 0;
+    quint64 start = allocations;
+
+    timer.start();
+    do
+    {
+        for (int i = 0; i < 16; i++)
+            f();
+        iterations += 16;
+    }
+    while (timer.nsecsElapsed() < 100000000);
+
+    qint64 elapsed = timer.nsecsElapsed();
+
+    Result r;
+    r.ns = (double) elapsed / iterations;
+    r.allocs = (double) (allocations - start) / iterations;
+    return r;
+}
+
+void report(const QString & name, int bytes, Result r)
+{
+    QString allocs = counting ? QString::number(r.allocs, 'f', 2) : QString("n/a");
+
+    printf("    %-24s %12.1f ns %10.3f ns/byte %10s allocs\n",
+            qPrintable(name), r.ns, bytes ? r.ns / bytes : 0.0, qPrintable(allocs));
+    fflush(stdout);
+}
+
+volatile int sink;
+
+void bench(const QString & filename, const QByteArray & data)
+{
+    PropellerProtocol protocol;
+    PropellerImage image(data, filename);
+
+    printf("%s (%d bytes, %s, %d to send)\n", qPrintable(filename), data.size(),
+            qPrintable(image.imageTypeText()),
+            PM::PayloadAnalyzer::minimize(image).size());
+
+    report("encodeData", data.size(), measure([&]() {
+        sink = PropellerProtocol::encodeData(data).size();
+    }));
+
+    report("encodeDataReference", data.size(), measure([&]() {
+        sink = PropellerProtocol::encodeDataReference(data).size();
+    }));
+
+    report("encodedSize", data.size(), measure([&]() {
+        sink = PropellerProtocol::encodedSize(data);
+    }));
+
+    QByteArray encoded = PropellerProtocol::encodeData(data);
+    report("decodeData", data.size(), measure([&]() {
+        sink = PropellerProtocol::decodeData(encoded, data.size()).size();
+    }));
+
+    report("encodeLong", 4, measure([&]() {
+        sink = PropellerProtocol::encodeLong(data.size() / 4).size();
+    }));
+
+    report("buildRequest", 0, measure([&]() {
+        sink = protocol.buildRequest(Command::WriteRun).size();
+    }));
+
+    report("buildDownload", data.size(), measure([&]() {
+        sink = protocol.buildDownload(data, Command::WriteRun).size();
+    }));
+
+    report("PropellerImage", data.size(), measure([&]() {
+        PropellerImage constructed(data, filename);
+        sink = constructed.imageSize();
+    }));
+
+    report("checksum", data.size(), measure([&]() {
+        sink = image.checksum();
+    }));
+
+    report("imageType", data.size(), measure([&]() {
+        sink = image.imageType();
+    }));
+
+    report("PayloadAnalyzer", data.size(), measure([&]() {
+        sink = PM::PayloadAnalyzer::minimize(image).size();
+    }));
+
+    printf("\n");
+}
+
+void benchLoader()
+{
+    PropellerManager manager;
+    QString port = "propman-bench";
+
+    printf("PropellerLoader setup (port %s)\n", qPrintable(port));
+
+    report("construct+destroy", 0, measure([&]() {
+        PropellerLoader loader(&manager, port);
+        sink = loader.priority();
+    }));
+
+    report("acquire+release", 0, measure([&]() {
+        PropellerLoader * loader = manager.acquireLoader(port);
+        sink = loader->priority();
+        manager.releaseLoader(loader);
+    }));
+
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QStringList paths = app.arguments().mid(1);
+    if (paths.isEmpty())
+        paths.append("test/images");
+
+    QStringList filenames;
+    foreach (QString path, paths)
+    {
+        if (QFileInfo(path).isDir())
+        {
+            QDirIterator it(path, QStringList() << "*.binary" << "*.eeprom",
+                            QDir::Files, QDirIterator::Subdirectories);
+            while (it.hasNext())
+                filenames.append(it.next());
+        }
+        else
+        {
+            filenames.append(path);
+        }
+    }
+
+    if (filenames.isEmpty())
+    {
+        fprintf(stderr, "No images found\n");
+        return 1;
+    }
+
+    filenames.sort();
+
+    benchLoader();
+
+    foreach (QString filename, filenames)
+    {
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            fprintf(stderr, "Couldn't open %s\n", qPrintable(filename));
+            continue;
+        }
+
+        bench(filename, file.readAll());
+    }
+
+    return 0;
+}
@@ -1,7 +1,8 @@
-QT += serialport
+QT += serialport network
 QT -= gui
 
 CONFIG -= debug_and_release app_bundle
+CONFIG += c++14
 
 VERSION = $$(VERSION)
 isEmpty(VERSION) {
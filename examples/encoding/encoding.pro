@@ -0,0 +1,6 @@
+include(../examples.pri)
+
+TARGET = encoding
+
+SOURCES += \
+    main.cpp
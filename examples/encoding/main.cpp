@@ -0,0 +1,61 @@
+#include <PropellerProtocol>
+
+#include <QDir>
+#include <QFile>
+#include <QElapsedTimer>
+#include <stdio.h>
+
+int main(int argc, char *argv[])
+{
+    QStringList filenames;
+    for (int i = 1; i < argc; i++)
+        filenames.append(argv[i]);
+
+    if (filenames.isEmpty())
+    {
+        QDir dir("../../test/images/ls");
+        foreach (QString f, dir.entryList(QStringList() << "*.eeprom", QDir::Files))
+            filenames.append(dir.filePath(f));
+    }
+
+    const int iterations = 100;
+    int failures = 0;
+
+    foreach (QString filename, filenames)
+    {
+        QFile file(filename);
+        if (!file.open(QIODevice::ReadOnly))
+        {
+            printf("%s: couldn't open file\n", qPrintable(filename));
+            failures++;
+            continue;
+        }
+
+        QByteArray image = file.readAll();
+        QByteArray reference, encoded;
+        QElapsedTimer timer;
+
+        timer.start();
+        for (int i = 0; i < iterations; i++)
+            reference = PropellerProtocol::encodeDataReference(image);
+        qint64 reference_ns = timer.nsecsElapsed() / iterations;
+
+        timer.start();
+        for (int i = 0; i < iterations; i++)
+            encoded = PropellerProtocol::encodeData(image);
+        qint64 encoded_ns = timer.nsecsElapsed() / iterations;
+
+        bool match = (encoded == reference);
+        if (!match)
+            failures++;
+
+        printf("%s: %d -> %d bytes (%s)\n", qPrintable(filename),
+                image.size(), encoded.size(), match ? "MATCH" : "MISMATCH");
+        printf("    reference: %8lld ns (%.2f MB/s)\n", reference_ns,
+                image.size() * 1000.0 / reference_ns);
+        printf("        table: %8lld ns (%.2f MB/s)\n", encoded_ns,
+                image.size() * 1000.0 / encoded_ns);
+    }
+
+    return failures ? 1 : 0;
+}
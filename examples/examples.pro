@@ -1,6 +1,8 @@
 TEMPLATE = subdirs
 SUBDIRS = \
     download \
+    encoding \
     identify \
     imageinfo \
     terminal \
+    xbee \
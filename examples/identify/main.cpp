@@ -3,17 +3,21 @@
 
 #include <PropellerManager>
 #include <PropellerLoader>
+#include <PropellerTask>
 
 int main(int argc, char *argv[])
 {
     QCoreApplication app(argc, argv);
 
     PropellerManager manager;
-    foreach (QString d, manager.listPorts())
-    {
-        PropellerLoader loader(&manager, d);
-        qDebug() << d << loader.version();
-    }
 
+    // every port is reset and queried at once
+    PropellerTask * scan = manager.identifyAll(manager.listPorts());
+    scan->waitForFinished();
+
+    foreach (PropellerResult result, scan->results())
+        qDebug() << result.portName << result.version;
+
+    delete scan;
     return 0;
 }
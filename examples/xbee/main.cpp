@@ -0,0 +1,76 @@
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QDebug>
+#include <QFile>
+
+#include <PropellerManager>
+#include <PropellerLoader>
+#include <PropellerImage>
+
+#include "xbeeemulator.h"
+
+/*
+    Emulates an XBee Wi-Fi module with a Propeller attached on a local
+    address, then downloads an image to it through PropellerManager and
+    reports how long it took.
+
+    xbee [--latency ms] [--drop probability] [--serve] image [address]
+*/
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption("latency", "Delay replies by <ms>.", "ms", "0"));
+    parser.addOption(QCommandLineOption("drop", "Drop serial datagrams with <probability>.", "probability", "0"));
+    parser.addOption(QCommandLineOption("serve", "Only run the emulator."));
+    parser.addPositionalArgument("image", "Propeller image to download.");
+    parser.addPositionalArgument("address", "Address to emulate the XBee on (default 127.0.0.2).");
+    parser.process(app);
+
+    QStringList args = parser.positionalArguments();
+    QString address = args.size() > 1 ? args[1] : "127.0.0.2";
+
+    XBeeEmulator xbee;
+    xbee.setLatency(parser.value("latency").toInt());
+    xbee.setDropRate(parser.value("drop").toDouble());
+
+    if (!xbee.listen(QHostAddress(address)))
+    {
+        qDebug() << "Couldn't listen on" << address;
+        return 1;
+    }
+
+    if (parser.isSet("serve"))
+        return app.exec();
+
+    if (args.isEmpty())
+        parser.showHelp(1);
+
+    QFile file(args[0]);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        qDebug() << "Couldn't open file";
+        return 1;
+    }
+
+    PropellerImage image = PropellerImage(file.readAll());
+
+    PropellerManager manager;
+    PropellerLoader loader(&manager, address);
+
+    QElapsedTimer timer;
+    timer.start();
+
+    if (!loader.upload(image, false, true, true))
+        return 1;
+
+    qDebug() << "Downloaded in" << timer.elapsed() << "ms at"
+             << loader.highSpeedBaudRate() << "baud,"
+             << xbee.dropped() << "datagrams dropped";
+
+    return xbee.state() == XBeeEmulator::Running ? 0 : 1;
+}
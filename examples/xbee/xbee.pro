@@ -0,0 +1,8 @@
+include(../examples.pri)
+
+TEMPLATE = app
+TARGET = xbee
+INCLUDEPATH += .
+
+HEADERS += xbeeemulator.h
+SOURCES += main.cpp xbeeemulator.cpp
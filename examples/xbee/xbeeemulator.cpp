@@ -0,0 +1,386 @@
+#include "xbeeemulator.h"
+
+#include <QDebug>
+#include <QtEndian>
+
+#include <MiniLoader>
+#include <XBeeDevice>
+
+namespace
+{
+    const int header_size = 8;
+    const int eop_microseconds = 1000;
+
+    // the boot loader's version, as reported after the handshake reply
+    const char version[] = "\xcf\xce\xce\xce";
+
+    // the call frames inserted by the miniloader's RAM verification
+    const quint32 callframe_checksum = 2 * (0xff + 0xff + 0xf9 + 0xff);
+}
+
+XBeeEmulator::XBeeEmulator(QObject * parent)
+    : QObject(parent)
+{
+    _latency = 0;
+    _drop = 0;
+    _dropped = 0;
+
+    _state = Reset;
+    _handshaken = false;
+    _acks = 0;
+    _expected = 0;
+    _last_longs = 0;
+    _address = 0;
+    _uart_idle = 0;
+
+    _values["BD"] = 115200;
+    _values["DE"] = PM::XBeeDevice::serial_port;
+
+    _eop.setSingleShot(true);
+    _clock.start();
+
+    connect(&_app,      SIGNAL(readyRead()),    this,   SLOT(readCommand()));
+    connect(&_serial,   SIGNAL(readyRead()),    this,   SLOT(readSerial()));
+    connect(&_eop,      SIGNAL(timeout()),      this,   SLOT(endOfPacket()));
+}
+
+XBeeEmulator::~XBeeEmulator()
+{
+    disconnect(&_app,      SIGNAL(readyRead()),    this,   SLOT(readCommand()));
+    disconnect(&_serial,   SIGNAL(readyRead()),    this,   SLOT(readSerial()));
+    disconnect(&_eop,      SIGNAL(timeout()),      this,   SLOT(endOfPacket()));
+}
+
+/**
+  Serve the XBee's application and serial ports on address.
+  */
+
+bool XBeeEmulator::listen(const QHostAddress & address)
+{
+    return _app.bind(address, PM::XBeeDevice::application_port)
+        && _serial.bind(address, PM::XBeeDevice::serial_port);
+}
+
+/**
+  Delay every datagram sent by the emulator by milliseconds.
+  */
+
+void XBeeEmulator::setLatency(int milliseconds)
+{
+    _latency = milliseconds;
+}
+
+/**
+  Drop serial datagrams in either direction with the given probability.
+  AT commands are never dropped, so only the recovery of the download
+  itself is exercised.
+  */
+
+void XBeeEmulator::setDropRate(double probability)
+{
+    _drop = probability;
+}
+
+int XBeeEmulator::dropped()
+{
+    return _dropped;
+}
+
+XBeeEmulator::State XBeeEmulator::state()
+{
+    return _state;
+}
+
+bool XBeeEmulator::lose()
+{
+    if (_drop <= 0 || (double) qrand() / RAND_MAX >= _drop)
+        return false;
+
+    _dropped++;
+    return true;
+}
+
+QByteArray XBeeEmulator::packLong(qint32 value)
+{
+    return PropellerProtocol::packLong((quint32) value);
+}
+
+qint32 XBeeEmulator::readLong(const QByteArray & data, int offset)
+{
+    if (data.size() < offset + 4)
+        return 0x7fffffff;
+
+    return qFromLittleEndian<qint32>((const uchar *) data.constData() + offset);
+}
+
+void XBeeEmulator::send(QUdpSocket * socket, const QByteArray & data,
+                        const QHostAddress & address, quint16 port)
+{
+    if (!_latency)
+    {
+        socket->writeDatagram(data, address, port);
+        return;
+    }
+
+    Datagram d;
+    d.socket = socket;
+    d.data = data;
+    d.address = address;
+    d.port = port;
+    _delayed.append(d);
+
+    QTimer::singleShot(_latency, this, SLOT(flushDelayed()));
+}
+
+void XBeeEmulator::flushDelayed()
+{
+    if (_delayed.isEmpty())
+        return;
+
+    Datagram d = _delayed.takeFirst();
+    d.socket->writeDatagram(d.data, d.address, d.port);
+}
+
+void XBeeEmulator::sendSerial(const QByteArray & data)
+{
+    if (lose())
+        return;
+
+    send(&_serial, data, QHostAddress(_values.value("DL")), _values.value("DE"));
+}
+
+void XBeeEmulator::readCommand()
+{
+    while (_app.hasPendingDatagrams())
+    {
+        QByteArray request;
+        QHostAddress sender;
+        quint16 port;
+        request.resize(_app.pendingDatagramSize());
+        _app.readDatagram(request.data(), request.size(), &sender, &port);
+
+        if (request.size() < header_size + 4 || request[6] != 0x02)
+            continue;
+
+        QByteArray at = request.mid(header_size + 2, 2);
+        QByteArray parameter = request.mid(header_size + 4);
+
+        QByteArray response = request.left(header_size);
+        response[6] = (char) 0x82;
+        response.append(request[header_size]);
+        response.append(at);
+        response.append((char) 0);
+
+        if (parameter.isEmpty())
+        {
+            response.append(packLong(_values.value(at)));
+        }
+        else
+        {
+            quint32 value = 0;
+            foreach (char c, parameter)
+                value = value << 8 | (quint8) c;
+            _values[at] = value;
+
+            if (at == "D" + QByteArray::number(PM::XBeeDevice::default_reset_pin))
+            {
+                if (value == 4)
+                {
+                    _state = Reset;
+                    _eop.stop();
+                }
+                else if (value == 5 && _state == Reset)
+                {
+                    _state = Boot;
+                    _stream.clear();
+                    _handshaken = false;
+                }
+            }
+        }
+
+        send(&_app, response, sender, port);
+    }
+}
+
+void XBeeEmulator::readSerial()
+{
+    while (_serial.hasPendingDatagrams())
+    {
+        QByteArray data;
+        data.resize(_serial.pendingDatagramSize());
+        _serial.readDatagram(data.data(), data.size());
+
+        if (lose())
+            continue;
+
+        switch (_state)
+        {
+            case Boot:          boot(data);         break;
+            case Acknowledge:   acknowledge(data);  break;
+            case MiniLoader:    receive(data);      break;
+            default:                                break;
+        }
+    }
+}
+
+/**
+  Receive the boot loader's download. The handshake is answered once
+  the request has arrived, and the download is complete once it decodes,
+  less any calibration bytes already sent to poll for its acknowledgement.
+  */
+
+void XBeeEmulator::boot(const QByteArray & data)
+{
+    _stream.append(data);
+
+    QByteArray request = _protocol.request();
+    if (!_handshaken)
+    {
+        if (_stream.size() <= request.size())
+            return;
+
+        if (!_stream.startsWith(request))
+        {
+            _state = Reset;
+            return;
+        }
+
+        _handshaken = true;
+        sendSerial(_protocol.reply() + QByteArray(version, 4));
+    }
+
+    int polls = 0;
+    while (polls < _stream.size() && (quint8) _stream[_stream.size() - 1 - polls] == 0xf9)
+        polls++;
+
+    Command::Command command;
+    QByteArray image;
+    if (!_protocol.decodeDownload(_stream.left(_stream.size() - polls), &command, &image))
+        return;
+
+    _stream.clear();
+
+    if (command == Command::Shutdown)
+    {
+        _state = Reset;
+        return;
+    }
+
+    _loaded = PropellerImage(image);
+    _acks = (command == Command::Run) ? 1 : 3;
+    _state = Acknowledge;
+
+    if (polls)
+        acknowledge(QByteArray(polls, (char) 0xf9));
+}
+
+/**
+  Acknowledge each stage of the download as it is polled for, then run
+  the image.
+  */
+
+void XBeeEmulator::acknowledge(const QByteArray & data)
+{
+    if (!data.contains((char) 0xf9))
+        return;
+
+    QByteArray reply(1, (char) 0xfe);
+
+    if (--_acks)
+    {
+        sendSerial(reply);
+        return;
+    }
+
+    if (!PM::MiniLoader::isLoader(_loaded))
+    {
+        sendSerial(reply);
+        _state = Running;
+        emit launched(_loaded);
+        return;
+    }
+
+    _expected = PM::MiniLoader::hostValue(_loaded, PM::MiniLoader::ExpectedID);
+    _last_longs = PM::MiniLoader::hostValue(_loaded, PM::MiniLoader::LastLongs);
+    _ram = QByteArray(0x8000, 0);
+    _address = 0;
+    _stream.clear();
+    _uart_idle = 0;
+    _state = MiniLoader;
+
+    sendSerial(reply + packLong(_expected));
+}
+
+/**
+  Receive miniloader packets. The UART delivers each datagram at the
+  baud rate, and the packets end once it has been idle for a while.
+  */
+
+void XBeeEmulator::receive(const QByteArray & data)
+{
+    qint64 now = _clock.nsecsElapsed() / 1000;
+    quint32 baud = qMax<quint32>(_values.value("BD"), 1200);
+
+    _uart_idle = qMax(_uart_idle, now) + (qint64) data.size() * 10 * 1000000 / baud;
+    _stream.append(data);
+
+    _eop.start((_uart_idle - now + eop_microseconds + 999) / 1000);
+}
+
+/**
+  Process the packets received since the last reply, as the miniloader
+  does: image packets must each be complete and carry the expected ID;
+  everything from the first bad one on is dropped, and the ID still
+  needed is sent back. Packets with IDs of 0 and below verify RAM and
+  launch the image.
+  */
+
+void XBeeEmulator::endOfPacket()
+{
+    QByteArray stream = _stream;
+    _stream.clear();
+
+    int offset = 0;
+    while (_expected > 0 && stream.size() - offset >= 4)
+    {
+        qint32 id = readLong(stream, offset);
+        int size = (id == 1) ? _last_longs * 4 : PM::MiniLoader::max_payload - 4;
+
+        if (id != _expected || stream.size() - offset - 4 < size)
+            break;
+
+        _ram.replace(_address, size, stream.mid(offset + 4, size));
+        _address += size;
+        offset += 4 + size;
+        _expected--;
+    }
+
+    if (_expected > 0 || offset == stream.size()
+            || readLong(stream, offset) != _expected)
+    {
+        sendSerial(packLong(_expected));
+        return;
+    }
+
+    switch (_expected)
+    {
+        case 0:
+        {
+            quint32 checksum = callframe_checksum;
+            for (int i = 0; i < _address; i++)
+                checksum += (quint8) _ram[i];
+
+            _expected = -1;
+            sendSerial(packLong(-(qint32) checksum));
+            break;
+        }
+        case -1:
+            _expected = -2;
+            sendSerial(packLong(_expected));
+            break;
+        default:
+            _state = Running;
+            emit launched(PropellerImage(_ram.left(_address)));
+            break;
+    }
+}
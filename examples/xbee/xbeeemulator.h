@@ -0,0 +1,106 @@
+#pragma once
+
+#include <QObject>
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QHash>
+#include <QList>
+
+#include <PropellerProtocol>
+#include <PropellerImage>
+
+/**
+  The XBeeEmulator class stands in for an XBee Wi-Fi module with a
+  Propeller attached, so XBee downloads can be exercised on one machine.
+
+  It answers remote AT commands on the application port, and passes
+  serial data between the serial port and an emulated Propeller. The
+  Propeller runs the boot loader's download protocol and, when it is
+  sent the miniloader, its packet protocol, with the end of a packet
+  detected by the UART going idle as on real hardware.
+
+  Datagrams can be dropped at random and replies delayed to model a
+  lossy, slow network.
+  */
+
+class XBeeEmulator : public QObject
+{
+    Q_OBJECT
+
+public:
+    enum State
+    {
+        Reset,
+        Boot,
+        Acknowledge,
+        MiniLoader,
+        Running
+    };
+
+private:
+    struct Datagram
+    {
+        QUdpSocket * socket;
+        QByteArray data;
+        QHostAddress address;
+        quint16 port;
+    };
+
+    QUdpSocket _app;
+    QUdpSocket _serial;
+    QHash<QByteArray, quint32> _values;
+
+    QList<Datagram> _delayed;
+    int _latency;
+    double _drop;
+    int _dropped;
+
+    PropellerProtocol _protocol;
+    State _state;
+    QByteArray _stream;
+    bool _handshaken;
+    int _acks;
+
+    QByteArray _ram;
+    PropellerImage _loaded;
+    qint32 _expected;
+    int _last_longs;
+    int _address;
+    QTimer _eop;
+    QElapsedTimer _clock;
+    qint64 _uart_idle;
+
+    bool lose();
+    void send(QUdpSocket * socket, const QByteArray & data,
+              const QHostAddress & address, quint16 port);
+    void sendSerial(const QByteArray & data);
+    QByteArray packLong(qint32 value);
+    qint32 readLong(const QByteArray & data, int offset);
+
+    void boot(const QByteArray & data);
+    void acknowledge(const QByteArray & data);
+    void receive(const QByteArray & data);
+
+private slots:
+    void readCommand();
+    void readSerial();
+    void endOfPacket();
+    void flushDelayed();
+
+signals:
+    void launched(PropellerImage image);
+
+public:
+    XBeeEmulator(QObject * parent = 0);
+    ~XBeeEmulator();
+
+    bool listen(const QHostAddress & address);
+
+    void setLatency(int milliseconds);
+    void setDropRate(double probability);
+    int dropped();
+
+    State state();
+};
@@ -1,4 +1,4 @@
-QT += serialport
+QT += serialport network
 
 TOP_PWD = $$PWD
 
@@ -4,9 +4,13 @@ TEMPLATE = subdirs
 SUBDIRS = \
     src \
     app \
+    bench \
+    test \
     include \
 
 app.depends = src
+bench.depends = src
+test.depends = src
 
 docs.commands = cd doc && bash process.sh
 QMAKE_EXTRA_TARGETS += docs
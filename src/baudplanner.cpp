@@ -0,0 +1,275 @@
+#include "baudplanner.h"
+
+#include <math.h>
+
+namespace PM
+{
+    BaudPlanner::BaudPlanner()
+    {
+        _rates  << 3000000 << 2000000 << 1500000 << 1000000
+                << 921600  << 500000  << 460800  << 230400 << 115200;
+
+        _maximum_rate = 0;
+        _tolerance = 0.25;
+        _failure_timeout = 10 * 60 * 1000;
+    }
+
+    BaudPlanner::~BaudPlanner()
+    {
+    }
+
+    BaudPlanner::Plan::Plan()
+    {
+        clockFrequency = 0;
+        initialBaudRate = 0;
+        finalBaudRate = 0;
+        actualBaudRate = 0;
+        initialBitTime = 0;
+        finalBitTime = 0;
+        bitTime1_5 = 0;
+        failsafe = 0;
+        endOfPacket = 0;
+        error = HUGE_VAL;
+    }
+
+    bool BaudPlanner::Plan::isValid() const
+    {
+        return finalBaudRate != 0;
+    }
+
+    /**
+      Return the rate model of the serial adapter with the given USB
+      vendor identifier. Unknown adapters are assumed to produce standard
+      rates exactly, up to 921600 baud.
+      */
+
+    BaudPlanner::Adapter BaudPlanner::adapter(quint16 vendorIdentifier)
+    {
+        Adapter a;
+
+        switch (vendorIdentifier)
+        {
+            case 0x0403:
+                a.name = "FTDI";
+                a.baseClock = 3000000;
+                a.fractionSteps = 8;
+                a.maximumRate = 3000000;
+                break;
+            case 0x10c4:
+                a.name = "CP210x";
+                a.baseClock = 0;
+                a.fractionSteps = 1;
+                a.maximumRate = 921600;
+                break;
+            default:
+                a.name = "Generic";
+                a.baseClock = 0;
+                a.fractionSteps = 1;
+                a.maximumRate = 921600;
+                break;
+        }
+
+        return a;
+    }
+
+    /**
+      Return the rate adapter actually produces when baudRate is requested.
+      */
+
+    double BaudPlanner::actualRate(const Adapter & adapter, quint32 baudRate)
+    {
+        if (!adapter.baseClock || !baudRate)
+            return baudRate;
+
+        double divisor = floor((double) adapter.baseClock / baudRate
+                               * adapter.fractionSteps + 0.5) / adapter.fractionSteps;
+
+        return adapter.baseClock / qMax(divisor, 1.0);
+    }
+
+    /**
+      Evaluate downloading at baudRate through adapter to a Propeller
+      running at clockFrequency.
+
+      The miniloader's bit period is rounded to the rate the adapter
+      actually produces, and the error is the worst sampling offset in
+      bit periods: the drift accumulated by the end of a character plus
+      the start bit polling jitter. The miniloader also spends up to
+      byte_overhead_cycles storing each long to RAM, which must fit
+      before the next start bit.
+
+      \return The plan; it is invalid if the error exceeds tolerance().
+      */
+
+    BaudPlanner::Plan BaudPlanner::evaluate(quint32 clockFrequency, quint32 baudRate,
+                                            const Adapter & adapter, quint32 initialBaudRate)
+    {
+        Plan p;
+
+        p.clockFrequency = clockFrequency;
+        p.initialBaudRate = initialBaudRate;
+        p.actualBaudRate = actualRate(adapter, baudRate);
+
+        if (!clockFrequency || !baudRate || !initialBaudRate
+                || baudRate > adapter.maximumRate
+                || (_maximum_rate && baudRate > _maximum_rate))
+            return p;
+
+        double line = clockFrequency / p.actualBaudRate;
+        quint32 period = (quint32) floor(line + 0.5);
+
+        if (1.5 * line < byte_overhead_cycles
+                || 1.5 * line < max_rx_sense_error)
+            return p;
+
+        p.error = (9.5 * fabs(period - line) + rxwait_cycles) / line;
+        if (p.error > _tolerance)
+            return p;
+
+        p.finalBaudRate = baudRate;
+        p.initialBitTime = (clockFrequency + initialBaudRate / 2) / initialBaudRate;
+        p.finalBitTime = period;
+        p.bitTime1_5 = (quint32) floor(1.5 * line + 0.5) - max_rx_sense_error;
+        p.failsafe = 2 * clockFrequency / rxwait_cycles;
+
+        // two bytes worth of RxWait loop iterations
+        p.endOfPacket = (quint32) ceil(2 * 10 * line / rxwait_cycles);
+
+        return p;
+    }
+
+    /**
+      Return the plan for the fastest candidate rate that is within
+      tolerance and not currently excluded on portname, or an invalid plan
+      if there is none.
+      */
+
+    BaudPlanner::Plan BaudPlanner::plan(const QString & portname, quint32 clockFrequency,
+                                        const Adapter & adapter, quint32 initialBaudRate)
+    {
+        QHash<quint32, Failures> failures = _history.value(portname).failures;
+
+        Plan best = evaluate(clockFrequency, 0, adapter, initialBaudRate);
+
+        foreach (quint32 rate, _rates)
+        {
+            if (isExcluded(failures.value(rate)) || rate <= best.finalBaudRate)
+                continue;
+
+            Plan p = evaluate(clockFrequency, rate, adapter, initialBaudRate);
+            if (p.isValid())
+                best = p;
+        }
+
+        return best;
+    }
+
+    void BaudPlanner::recordSuccess(const QString & portname, quint32 baudRate)
+    {
+        History & h = _history[portname];
+        h.confirmed = qMax(h.confirmed, baudRate);
+        h.failures.remove(baudRate);
+    }
+
+    /**
+      Record that a download at baudRate failed on portname. Once it has
+      failed failure_limit times in a row, the rate is not planned for
+      that port for failureTimeout() ms, or until forget() is called.
+      */
+
+    void BaudPlanner::recordFailure(const QString & portname, quint32 baudRate)
+    {
+        History & h = _history[portname];
+        Failures & f = h.failures[baudRate];
+        f.count++;
+        f.last.start();
+
+        if (h.confirmed == baudRate && isExcluded(f))
+            h.confirmed = 0;
+    }
+
+    /**
+      Return true if baudRate is currently skipped on portname because
+      of recent failures.
+      */
+
+    bool BaudPlanner::isExcluded(const QString & portname, quint32 baudRate)
+    {
+        return isExcluded(_history.value(portname).failures.value(baudRate));
+    }
+
+    bool BaudPlanner::isExcluded(const Failures & failures)
+    {
+        return failures.count >= failure_limit
+            && !failures.last.hasExpired(_failure_timeout);
+    }
+
+    /**
+      Return the fastest rate that completed a download on portname,
+      or 0 if none has.
+      */
+
+    quint32 BaudPlanner::confirmedRate(const QString & portname)
+    {
+        return _history.value(portname).confirmed;
+    }
+
+    void BaudPlanner::forget(const QString & portname)
+    {
+        _history.remove(portname);
+    }
+
+    QList<quint32> BaudPlanner::candidateRates()
+    {
+        return _rates;
+    }
+
+    void BaudPlanner::setCandidateRates(const QList<quint32> & rates)
+    {
+        _rates = rates;
+    }
+
+    quint32 BaudPlanner::maximumRate()
+    {
+        return _maximum_rate;
+    }
+
+    /**
+      Limit planned rates to baudRate, or remove the limit with 0.
+      */
+
+    void BaudPlanner::setMaximumRate(quint32 baudRate)
+    {
+        _maximum_rate = baudRate;
+    }
+
+    double BaudPlanner::tolerance()
+    {
+        return _tolerance;
+    }
+
+    /**
+      Set the largest acceptable sampling error, in bit periods.
+      The default is 0.25.
+      */
+
+    void BaudPlanner::setTolerance(double bits)
+    {
+        _tolerance = bits;
+    }
+
+    int BaudPlanner::failureTimeout()
+    {
+        return _failure_timeout;
+    }
+
+    /**
+      Set how long a rate that keeps failing is skipped, in ms.
+      The default is ten minutes.
+      */
+
+    void BaudPlanner::setFailureTimeout(int msecs)
+    {
+        _failure_timeout = msecs;
+    }
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+namespace PM
+{
+    /**
+      @class BaudPlanner
+
+      The BaudPlanner class chooses the final baud rate of high-speed
+      downloads and derives the miniloader's timing values from it.
+
+      Neither end of the link hits a requested rate exactly. The serial
+      adapter divides its own reference clock, and the miniloader times
+      bits in whole system clock cycles, so the actual bit periods on each
+      side drift apart over the length of a character. The planner models
+      both, and picks the fastest rate whose drift, plus the miniloader's
+      start bit polling jitter, stays within a fraction of a bit period.
+
+      Rates are remembered per port. A rate that failed failure_limit
+      times in a row is skipped on that port for failureTimeout() ms, after
+      which it is tried again; a single further failure skips it again.
+      The fastest rate that worked is reported by confirmedRate().
+      */
+
+    class BaudPlanner
+    {
+    public:
+        struct Adapter
+        {
+            QString name;
+            quint32 baseClock;      ///< Reference clock, or 0 if rates are exact
+            int     fractionSteps;  ///< Divisor steps per whole divisor
+            quint32 maximumRate;
+        };
+
+        struct Plan
+        {
+            quint32 clockFrequency;
+            quint32 initialBaudRate;
+            quint32 finalBaudRate;
+            double  actualBaudRate;
+
+            quint32 initialBitTime;
+            quint32 finalBitTime;
+            quint32 bitTime1_5;
+            quint32 failsafe;
+            quint32 endOfPacket;
+
+            double  error;          ///< Worst sampling error, in bit periods
+
+            Plan();
+            bool isValid() const;
+        };
+
+        static const int max_rx_sense_error = 23;
+        static const int rxwait_cycles = 3 * 4;
+        static const int byte_overhead_cycles = 107;
+        static const int failure_limit = 2;
+
+    private:
+        struct Failures
+        {
+            int count;
+            QElapsedTimer last;
+
+            Failures() : count(0) {}
+        };
+
+        struct History
+        {
+            quint32 confirmed;
+            QHash<quint32, Failures> failures;
+
+            History() : confirmed(0) {}
+        };
+
+        bool isExcluded(const Failures & failures);
+
+        QList<quint32> _rates;
+        QHash<QString, History> _history;
+        quint32 _maximum_rate;
+        double _tolerance;
+        int _failure_timeout;
+
+    public:
+        BaudPlanner();
+        ~BaudPlanner();
+
+        static Adapter adapter(quint16 vendorIdentifier);
+        static double actualRate(const Adapter & adapter, quint32 baudRate);
+
+        Plan evaluate(quint32 clockFrequency, quint32 baudRate,
+                      const Adapter & adapter, quint32 initialBaudRate = 115200);
+
+        Plan plan(const QString & portname, quint32 clockFrequency,
+                  const Adapter & adapter, quint32 initialBaudRate = 115200);
+
+        void recordSuccess(const QString & portname, quint32 baudRate);
+        void recordFailure(const QString & portname, quint32 baudRate);
+        bool isExcluded(const QString & portname, quint32 baudRate);
+        quint32 confirmedRate(const QString & portname);
+        void forget(const QString & portname);
+
+        QList<quint32> candidateRates();
+        void setCandidateRates(const QList<quint32> & rates);
+
+        quint32 maximumRate();
+        void setMaximumRate(quint32 baudRate);
+
+        double tolerance();
+        void setTolerance(double bits);
+
+        int failureTimeout();
+        void setFailureTimeout(int msecs);
+    };
+}
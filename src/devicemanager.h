@@ -4,12 +4,13 @@
 
 #include "template/manager.h"
 #include "propellerdevice.h"
+#include "xbeedevice.h"
 
 namespace PM
 {
 
     class DeviceManager 
-        : public Manager<QString, PropellerDevice *>
+        : public Manager<QString, Device *>
     {
     
     public:
@@ -25,11 +26,14 @@ namespace PM
             }
         }
     
-        PropellerDevice * interface(QString key)
+        Device * interface(QString key)
         {
             if (exists(key)) return _interfaces[key];
     
-            _interfaces[key] = new PropellerDevice(key);
+            if (XBeeDevice::isXBee(key))
+                _interfaces[key] = new XBeeDevice(key);
+            else
+                _interfaces[key] = new PropellerDevice(key);
     
             return _interfaces[key];
         }
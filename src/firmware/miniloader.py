@@ -0,0 +1,434 @@
+#!/usr/bin/env python3
+"""
+Generate the miniloader arrays in src/miniloader.cpp from miniloader.spin.
+
+openspin builds miniloader.spin as a single image, but PropellerManager
+needs its parts separately: the core, each "Finalization" packet and the
+EEPROM driver.  Given the image openspin built (spin.pro builds it as
+miniloader.binary), this script splits its DAT block at the packet
+markers, which are dropped, and prints each part as a C array.
+
+    python3 miniloader.py miniloader.binary
+        print the arrays
+    python3 miniloader.py --check ../miniloader.cpp miniloader.binary
+        compare them with the source
+
+The script also carries a small assembler for the subset of PASM that
+miniloader.spin uses.  It supplies the offsets the host patches
+(core_hostvalues, the HostValue enum in miniloader.h, the PACKET4
+fields, driver_origin), and its output must agree with openspin's.
+Without an image, the arrays come from the assembler alone.  The check
+exits with status 1 on any difference.
+"""
+
+import os
+import re
+import struct
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+#   name: (opcode, z, c, r, immediate forced)
+OPS = {
+    'wrbyte': (0, 0, 0, 0, 0),  'rdbyte': (0, 0, 0, 1, 0),
+    'wrword': (1, 0, 0, 0, 0),  'rdword': (1, 0, 0, 1, 0),
+    'wrlong': (2, 0, 0, 0, 0),  'rdlong': (2, 0, 0, 1, 0),
+    'clkset': (3, 0, 0, 0, 1),  'coginit': (3, 0, 0, 0, 1),
+    'ror':    (8, 0, 0, 1, 0),  'rol':    (9, 0, 0, 1, 0),
+    'shr':   (10, 0, 0, 1, 0),  'shl':   (11, 0, 0, 1, 0),
+    'rcr':   (12, 0, 0, 1, 0),  'rcl':   (13, 0, 0, 1, 0),
+    'sar':   (14, 0, 0, 1, 0),
+    'min':   (18, 0, 0, 1, 0),  'max':   (19, 0, 0, 1, 0),
+    'movs':  (20, 0, 0, 1, 0),  'movd':  (21, 0, 0, 1, 0),
+    'movi':  (22, 0, 0, 1, 0),
+    'jmp':   (23, 0, 0, 0, 0),  'call':  (23, 0, 0, 1, 1),
+    'ret':   (23, 0, 0, 0, 1),
+    'and':   (24, 0, 0, 1, 0),  'test':  (24, 0, 0, 0, 0),
+    'andn':  (25, 0, 0, 1, 0),  'or':    (26, 0, 0, 1, 0),
+    'xor':   (27, 0, 0, 1, 0),
+    'muxc':  (28, 0, 0, 1, 0),  'muxnc': (29, 0, 0, 1, 0),
+    'muxz':  (30, 0, 0, 1, 0),  'muxnz': (31, 0, 0, 1, 0),
+    'add':   (32, 0, 0, 1, 0),  'sub':   (33, 0, 0, 1, 0),
+    'cmp':   (33, 0, 0, 0, 0),
+    'mov':   (40, 0, 0, 1, 0),  'neg':   (41, 0, 0, 1, 0),
+    'cmps':  (48, 0, 0, 0, 0),
+    'adds':  (52, 0, 0, 1, 0),  'subs':  (53, 0, 0, 1, 0),
+    'djnz':  (57, 0, 0, 1, 0),  'tjnz':  (58, 0, 0, 0, 0),
+    'tjz':   (59, 0, 0, 0, 0),
+    'waitcnt': (62, 0, 0, 1, 0),
+}
+
+HUBOPS = {'clkset': 0, 'coginit': 2}
+
+CONDS = {
+    'if_never': 0, 'if_nc_and_nz': 1, 'if_a': 1, 'if_nc_and_z': 2,
+    'if_nc': 3, 'if_ae': 3, 'if_c_and_nz': 4, 'if_nz': 5, 'if_ne': 5,
+    'if_c_ne_z': 6, 'if_nc_or_nz': 7, 'if_c_and_z': 8, 'if_c_eq_z': 9,
+    'if_z': 10, 'if_e': 10, 'if_nc_or_z': 11, 'if_c': 12, 'if_b': 12,
+    'if_c_or_nz': 13, 'if_c_or_z': 14, 'if_z_or_c': 14, 'if_be': 14,
+    'if_always': 15,
+}
+
+REGISTERS = {
+    'par': 0x1F0, 'cnt': 0x1F1, 'ina': 0x1F2, 'inb': 0x1F3,
+    'outa': 0x1F4, 'outb': 0x1F5, 'dira': 0x1F6, 'dirb': 0x1F7,
+}
+
+DIRECTIVES = ('org', 'res', 'long', 'fit')
+
+#   miniloader.h HostValue names and the core labels they patch
+HOSTVALUES = [
+    ('IBitTime', 'ibittime'),
+    ('FBitTime', 'fbittime'),
+    ('BitTime1_5', 'bittime1_5'),
+    ('Failsafe', 'failsafe'),
+    ('EndOfPacket', 'endofpacket'),
+    ('ExpectedID', 'expectedid'),
+    ('LastLongs', 'lastlongs'),
+]
+
+#   array names in src/miniloader.cpp, in the order of the DAT sections
+SECTIONS = ['core', 'verify_ram', 'launch_start', 'launch_final',
+            'load_driver', 'sync_eeprom', 'eeprom_driver']
+
+
+def strip_comments(text):
+    text = re.sub(r'\{\{.*?\}\}', '', text, flags=re.S)
+    text = re.sub(r'\{[^{}]*\}', '', text)
+    return '\n'.join(l.split("'")[0].rstrip() for l in text.split('\n'))
+
+
+def evaluate(expr, symbols):
+    """Evaluate a Spin constant expression with the given symbols."""
+
+    def number(m):
+        t = m.group(0).replace('_', '')
+        if t.startswith('$'):
+            return str(int(t[1:], 16))
+        if t.startswith('%'):
+            return str(int(t[1:], 2))
+        return t
+
+    def name(m):
+        n = m.group(0)
+        if n == 'int':
+            return n
+        return str(symbols[n.lower()])
+
+    e = re.sub(r'\$[0-9A-Fa-f_]+|%[01_]+|\b\d[\d_]*(\.\d+)?', number, expr.strip())
+    e = re.sub(r'\|<\s*(\w+)', r'(1<<\1)', e)
+    e = re.sub(r'(\w+)\s*<<\s*(\w+)', r'(\1<<\2)', e)
+    e = e.replace('TRUNC', 'int')
+    e = re.sub(r'[:A-Za-z_][\w:]*', name, e)
+    if '.' not in e:
+        e = e.replace('/', '//')
+    return int(eval(e, {'__builtins__': {}, 'int': int}))
+
+
+def constants(text):
+    """Return the CON constants and the enumerated markers with their values."""
+
+    con = text[text.index('CON') + 3:text.index('\nPUB')]
+    values = {}
+    markers = {}
+    for line in con.split('\n'):
+        line = line.strip()
+        if line.startswith('#'):
+            names = line.split(',')
+            first = evaluate(names[0][1:], values)
+            for i, n in enumerate(names[1:]):
+                markers[n.strip().lower()] = first + i
+        elif '=' in line:
+            name, value = line.split('=', 1)
+            try:
+                values[name.strip().lower()] = evaluate(value, values)
+            except (KeyError, SyntaxError):
+                pass
+    return values, markers
+
+
+def parse(line):
+    toks = line.split()
+    label = cond = None
+    first = toks[0].lower()
+    if first not in CONDS and first not in OPS and first not in DIRECTIVES:
+        label = toks.pop(0)
+    if toks and toks[0].lower() in CONDS:
+        cond = toks.pop(0).lower()
+    if not toks:
+        return label, cond, None, ''
+    return label, cond, toks.pop(0).lower(), ' '.join(toks)
+
+
+def encode(op, cond, rest, resolve):
+    opcode, z, c, r, i = OPS[op]
+    effects = re.findall(r'\b(wz|wc|wr|nr)\b', rest)
+    rest = re.sub(r'\b(wz|wc|wr|nr)\b', '', rest).strip().rstrip(',').strip()
+    args = [a.strip() for a in rest.split(',')] if rest else []
+
+    d = s = 0
+    if op == 'jmp':
+        if args[0].startswith('#'):
+            i = 1
+        s = resolve(args[0].lstrip('#'))
+    elif op == 'call':
+        name = args[0].lstrip('#')
+        d = resolve(name + '_ret')
+        s = resolve(name)
+    elif op == 'ret':
+        pass
+    elif op in HUBOPS:
+        d = resolve(args[0])
+        s = HUBOPS[op]
+    else:
+        d = resolve(args[0])
+        if args[1].startswith('#'):
+            i = 1
+        s = resolve(args[1].lstrip('#'))
+
+    for e in effects:
+        z = 1 if e == 'wz' else z
+        c = 1 if e == 'wc' else c
+        r = {'wr': 1, 'nr': 0}.get(e, r)
+
+    if not (0 <= d < 512 and 0 <= s < 512):
+        raise ValueError('register out of range: %s %s' % (op, rest))
+
+    return ((opcode << 26) | (z << 25) | (c << 24) | (r << 23) | (i << 22)
+            | (CONDS.get(cond, 15) << 18) | (d << 9) | s)
+
+
+def assemble(path):
+    """
+    Assemble the DAT block of path, returning a list of sections, one per
+    org, and the symbols, CON constants included.  Packet markers take a
+    register, as in openspin, but are not emitted; the one heading each
+    executable packet sits where the packet ID lands.
+    """
+
+    text = strip_comments(open(path).read())
+    values, markers = constants(text)
+    dat = text[text.index('\nDAT') + 4:]
+    lines = [l for l in dat.split('\n') if l.strip()]
+
+    symbols = {}
+    for final in (False, True):
+        sections = []
+        section = None
+        address = 0
+        scope = ''
+        for line in lines:
+            label, cond, op, rest = parse(line)
+            if label:
+                if label.startswith(':'):
+                    key = (scope + label).lower()
+                else:
+                    scope = label
+                    key = label.lower()
+                if not final:
+                    symbols[key] = address
+            if op is None:
+                continue
+
+            table = dict(values, **symbols)
+
+            def resolve(a):
+                a = re.sub(r'(?<!\w)(:\w+)', lambda m: scope + m.group(1), a)
+                return evaluate(a, dict(table, **REGISTERS))
+
+            if op == 'org':
+                address = evaluate(rest, table) if rest else 0
+                section = {'org': address, 'words': []}
+                sections.append(section)
+            elif op == 'fit':
+                if address > evaluate(rest, table):
+                    raise ValueError('fit %s exceeded at $%X' % (rest, address))
+            elif op == 'res':
+                address += evaluate(rest, table)
+            elif op == 'long' and rest.strip().lower() in markers:
+                address += 1
+            elif op == 'long':
+                word = evaluate(rest, table) if final else 0
+                section['words'].append(word & 0xFFFFFFFF)
+                address += 1
+            else:
+                word = encode(op, cond, rest, resolve) if final else 0
+                section['words'].append(word)
+                address += 1
+
+    return sections, dict(values, **symbols)
+
+
+def core_image(words, clkfreq=80000000, clkmode=0x6F):
+    """Wrap the core in a Spin image that coginits it into cog 0."""
+
+    code = b''.join(struct.pack('<I', w) for w in words)
+    objsize = 8 + len(code) + 8
+    pbase = 0x10
+    vbase = pbase + objsize
+    dbase = vbase + 8
+    pcurr = pbase + 8 + len(code)
+    dcurr = dbase + 4
+
+    image = bytearray(struct.pack('<IBBHHHHH', clkfreq, clkmode, 0,
+                                  pbase, vbase, dbase, pcurr, dcurr))
+    image += struct.pack('<HBBHH', objsize, 2, 0, 8 + len(code), 0)
+    image += code
+    image += bytes([0x35, 0xC7, 0x08, 0x35, 0x2C, 0x32, 0x00, 0x00])
+
+    # the boot ROM counts the call frame it writes below dbase
+    total = sum(image) + 2 * (0xFF * 3 + 0xF9)
+    image[5] = (0x100 - total) & 0xFF
+    return bytes(image)
+
+
+def section_bytes(section):
+    return b''.join(struct.pack('<I', w) for w in section['words'])
+
+
+def split_binary(path, markers):
+    """
+    Split the DAT block of the openspin image at path into the core and
+    one section per packet marker, dropping the markers.
+    """
+
+    image = open(path, 'rb').read()
+    pbase = struct.unpack_from('<H', image, 6)[0]
+    code = struct.unpack_from('<H', image, pbase + 4)[0]
+    dat = image[pbase + 8:pbase + code]
+    words = struct.unpack('<%dI' % (len(dat) // 4), dat)
+
+    values = sorted(markers.values())
+    found = []
+    sections = [{'words': []}]
+    for w in words:
+        if w in values:
+            found.append(w)
+            sections.append({'words': []})
+        else:
+            sections[-1]['words'].append(w)
+
+    if found != values:
+        raise ValueError('%s: expected the markers %s in order, found %s'
+                         % (path, ', '.join('$%X' % v for v in values),
+                            ', '.join('$%X' % v for v in found)))
+    return sections
+
+
+def generate(sections):
+    if len(sections) != len(SECTIONS):
+        raise ValueError('expected %d sections, found %d'
+                         % (len(SECTIONS), len(sections)))
+
+    arrays = {}
+    for name, section in zip(SECTIONS, sections):
+        arrays[name] = section_bytes(section)
+    arrays['core'] = core_image(sections[0]['words'])
+    return arrays
+
+
+def format_array(name, data):
+    out = '        const uchar %s[%d] = {\n' % (name, len(data))
+    for i in range(0, len(data), 16):
+        out += '            ' + ''.join('0x%02X,' % b for b in data[i:i + 16]) + '\n'
+    return out + '        };\n'
+
+
+def parse_arrays(source):
+    arrays = {}
+    for m in re.finditer(r'const uchar (\w+)\[(\d+)\] = \{(.*?)\};', source, re.S):
+        data = bytes(int(b, 16) for b in re.findall(r'0x([0-9A-Fa-f]{2})', m.group(3)))
+        if len(data) != int(m.group(2)):
+            raise ValueError('%s: declared %s bytes, has %d'
+                             % (m.group(1), m.group(2), len(data)))
+        arrays[m.group(1)] = data
+    return arrays
+
+
+def check(path, arrays, symbols):
+    errors = []
+    source = open(path).read()
+    header = open(os.path.splitext(path)[0] + '.h').read()
+    found = parse_arrays(source)
+    errors += compare(found, arrays, 'miniloader.spin')
+
+    values = {}
+    for m in re.finditer(r'const int (\w+) = ([^;]+);', source):
+        expr = m.group(2).replace('sizeof(core)', str(len(found.get('core', b''))))
+        values[m.group(1)] = eval(expr, {'__builtins__': {}})
+
+    def expect(name, value):
+        if values.get(name) != value:
+            errors.append('%s: %s, expected %d' % (name, values.get(name), value))
+
+    # the host values are the longs from IBitTime to LastLongs in the core
+    expect('core_hostvalues', 0x18 + 4 * (symbols['ibittime'] - symbols['loader']))
+
+    for name, label in HOSTVALUES:
+        m = re.search(r'\b%s\s*=\s*(\d+)' % name, header)
+        expected = 4 * (symbols[label] - symbols['ibittime'])
+        if not m or int(m.group(1)) != expected:
+            errors.append('HostValue %s: %s, expected %d'
+                          % (name, m and m.group(1), expected))
+
+    # offsets the host patches in PACKET4 and the EEPROM driver
+    expect('load_dest', 4 * (symbols['loaddest'] - symbols['loaddriver']))
+    expect('load_longs', 4 * (symbols['loadlongs'] - symbols['loaddriver']))
+    expect('load_capacity', (symbols['packet'] + symbols['packet_buffer'] - symbols['packetdata'])
+                            - len(arrays['load_driver']) // 4)
+    expect('driver_origin', symbols['sync'])
+    expect('driver_i2cdelay', 4 * (symbols['i2cdelay'] - symbols['sync']))
+
+    return errors
+
+
+def compare(found, expected, what):
+    errors = []
+    for name in SECTIONS:
+        if name not in found:
+            errors.append('%s: missing' % name)
+        elif found[name] != expected[name]:
+            at = next((i for i, (a, b) in enumerate(zip(found[name], expected[name])) if a != b),
+                      min(len(found[name]), len(expected[name])))
+            errors.append('%s: differs from %s at byte %d' % (name, what, at))
+    return errors
+
+
+def main(argv):
+    args = argv[1:]
+    source = None
+    if args[:1] == ['--check'] and len(args) >= 2:
+        source = args[1]
+        args = args[2:]
+    if len(args) > 1:
+        print(__doc__.strip())
+        return 2
+
+    spin = os.path.join(HERE, 'miniloader.spin')
+    sections, symbols = assemble(spin)
+    arrays = generate(sections)
+
+    errors = []
+    if args:
+        _, markers = constants(strip_comments(open(spin).read()))
+        assembled = arrays
+        arrays = generate(split_binary(args[0], markers))
+        errors += compare(arrays, assembled, 'the assembler')
+
+    if source:
+        errors += check(source, arrays, symbols)
+        for e in errors:
+            print(e)
+        if not errors:
+            print('%s matches miniloader.spin' % source)
+        return 1 if errors else 0
+
+    for e in errors:
+        print(e, file=sys.stderr)
+    for name in SECTIONS:
+        print(format_array(name, arrays[name]))
+    return 1 if errors else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -1,9 +1,16 @@
 CONFIG -= qt
 TEMPLATE = aux
 
-spin.target = jm_hackable_ebadge.binary
-spin.commands = openspin jm_hackable_ebadge.spin
-spin.depends = $$files(*.spin)
+spin.target = miniloader.binary
+spin.commands = openspin -o miniloader.binary $$PWD/miniloader.spin
+spin.depends = $$PWD/miniloader.spin
 
-PRE_TARGETDEPS = jm_hackable_ebadge.binary
-QMAKE_EXTRA_TARGETS = spin
+arrays.target = arrays
+arrays.commands = python3 $$PWD/miniloader.py miniloader.binary
+arrays.depends = miniloader.binary
+
+check.commands = python3 $$PWD/miniloader.py --check $$PWD/../miniloader.cpp miniloader.binary
+check.depends = miniloader.binary
+
+PRE_TARGETDEPS = miniloader.binary
+QMAKE_EXTRA_TARGETS = spin arrays check
@@ -0,0 +1,226 @@
+#include "loaderreport.h"
+
+#include <QStringList>
+
+namespace PM
+{
+    LoaderReport::LoaderReport()
+    {
+        startedAt = 0;
+        initialBaudRate = 0;
+        finalBaudRate = 0;
+        success = false;
+        error = 0;
+    }
+
+    qint64 LoaderReport::Phase::duration() const
+    {
+        return exited < 0 ? -1 : exited - entered;
+    }
+
+    /**
+      Return the rate in bits per second at which the phase's bytes went
+      out with 8N1 framing, or 0 if it wrote nothing.
+      */
+
+    double LoaderReport::Phase::effectiveBaudRate() const
+    {
+        if (!bytes || duration() <= 0)
+            return 0;
+
+        return bytes * 10 * 1000000.0 / duration();
+    }
+
+    /**
+      Clear the report and start timing an upload to port at baudRate.
+      */
+
+    void LoaderReport::start(const QString & port, quint32 baudRate)
+    {
+        *this = LoaderReport();
+
+        portName = port;
+        initialBaudRate = baudRate;
+        finalBaudRate = baudRate;
+
+        _timer.start();
+        startedAt = _timer.msecsSinceReference();
+    }
+
+    /**
+      Close any open phases and record the outcome.
+      */
+
+    void LoaderReport::finish(bool succeeded, int loaderError)
+    {
+        closePhases();
+
+        success = succeeded;
+        error = loaderError;
+    }
+
+    /**
+      Close any open phases and record an attempt that failed with
+      loaderError, to be retried after backoff milliseconds.
+      */
+
+    void LoaderReport::retry(int loaderError, int backoff)
+    {
+        closePhases();
+
+        Attempt a;
+        a.error = loaderError;
+        a.failed = elapsed();
+        a.backoff = backoff;
+        _attempts.append(a);
+    }
+
+    void LoaderReport::closePhases()
+    {
+        qint64 now = elapsed();
+        for (int i = 0; i < _phases.size(); i++)
+        {
+            if (_phases[i].exited < 0)
+                _phases[i].exited = now;
+        }
+    }
+
+    void LoaderReport::enter(const QString & name)
+    {
+        Phase p;
+        p.name = name;
+        p.entered = elapsed();
+        p.exited = -1;
+        p.bytes = 0;
+        _phases.append(p);
+    }
+
+    /**
+      Close the most recent open phase called name.
+      */
+
+    void LoaderReport::exit(const QString & name)
+    {
+        for (int i = _phases.size() - 1; i >= 0; i--)
+        {
+            if (_phases[i].name == name && _phases[i].exited < 0)
+            {
+                _phases[i].exited = elapsed();
+                return;
+            }
+        }
+    }
+
+    /**
+      Count bytes against the innermost open phase.
+      */
+
+    void LoaderReport::written(qint64 bytes)
+    {
+        for (int i = _phases.size() - 1; i >= 0; i--)
+        {
+            if (_phases[i].exited < 0)
+            {
+                _phases[i].bytes += bytes;
+                return;
+            }
+        }
+    }
+
+    QList<LoaderReport::Phase> LoaderReport::phases() const
+    {
+        return _phases;
+    }
+
+    /**
+      Return the last phase called name, or a phase with an empty name
+      if there is none.
+      */
+
+    LoaderReport::Phase LoaderReport::phase(const QString & name) const
+    {
+        for (int i = _phases.size() - 1; i >= 0; i--)
+        {
+            if (_phases[i].name == name)
+                return _phases[i];
+        }
+
+        Phase p;
+        p.entered = -1;
+        p.exited = -1;
+        p.bytes = 0;
+        return p;
+    }
+
+    QList<LoaderReport::Attempt> LoaderReport::failedAttempts() const
+    {
+        return _attempts;
+    }
+
+    /**
+      Return how many attempts the upload took, including the last.
+      */
+
+    int LoaderReport::attempts() const
+    {
+        return _attempts.size() + 1;
+    }
+
+    /**
+      Return the microseconds since the upload started.
+      */
+
+    qint64 LoaderReport::elapsed() const
+    {
+        return _timer.isValid() ? _timer.nsecsElapsed() / 1000 : 0;
+    }
+
+    /**
+      Return the microseconds from the start of the upload until the
+      last phase closed.
+      */
+
+    qint64 LoaderReport::duration() const
+    {
+        qint64 end = 0;
+        foreach (const Phase & p, _phases)
+            end = qMax(end, p.exited);
+        return end;
+    }
+
+    qint64 LoaderReport::bytesSent() const
+    {
+        qint64 total = 0;
+        foreach (const Phase & p, _phases)
+            total += p.bytes;
+        return total;
+    }
+
+    /**
+      Return a one-line summary, such as for a log.
+      */
+
+    QString LoaderReport::toString() const
+    {
+        QStringList parts;
+        foreach (const Phase & p, _phases)
+        {
+            QString s = QString("%1 %2 ms").arg(p.name).arg(p.duration() / 1000.0, 0, 'f', 1);
+            if (p.bytes)
+                s += QString(" (%1 B, %2 baud)").arg(p.bytes).arg(qRound(p.effectiveBaudRate()));
+            parts << s;
+        }
+
+        QString outcome = success ? "ok" : "failed";
+        if (!_attempts.isEmpty())
+            outcome += QString(" after %1 attempts").arg(attempts());
+
+        return QString("%1: %2 in %3 ms at %4/%5 baud: %6")
+            .arg(portName)
+            .arg(outcome)
+            .arg(duration() / 1000.0, 0, 'f', 1)
+            .arg(initialBaudRate)
+            .arg(finalBaudRate)
+            .arg(parts.join(", "));
+    }
+}
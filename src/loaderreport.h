@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QList>
+#include <QMetaType>
+#include <QString>
+
+namespace PM
+{
+    /**
+      @class LoaderReport
+
+      The LoaderReport class records where the time of one upload went.
+
+      Each phase of the upload, such as the reset, the payload or an
+      acknowledged stage, is recorded with monotonic entry and exit times
+      in microseconds from the start of the upload, and with the bytes
+      written while it was the innermost open phase. Phases may nest;
+      the reset happens within preparation.
+
+      An upload that is retried keeps one report. Each failed attempt is
+      recorded with its error, and the phases of every attempt follow
+      one another, separated by a "backoff" phase.
+      */
+
+    class LoaderReport
+    {
+    public:
+        struct Phase
+        {
+            QString name;
+            qint64  entered;        ///< Microseconds from the start of the upload
+            qint64  exited;         ///< -1 while the phase is open
+            qint64  bytes;
+
+            qint64  duration() const;
+            double  effectiveBaudRate() const;
+        };
+
+        struct Attempt
+        {
+            int     error;          ///< PropellerLoader::LoaderError
+            qint64  failed;         ///< Microseconds from the start of the upload
+            int     backoff;        ///< Milliseconds waited before the next attempt
+        };
+
+    private:
+        QElapsedTimer _timer;
+        QList<Phase> _phases;
+        QList<Attempt> _attempts;
+
+        void closePhases();
+
+    public:
+        QString portName;
+        qint64  startedAt;          ///< QElapsedTimer::msecsSinceReference() at the start
+        quint32 initialBaudRate;
+        quint32 finalBaudRate;      ///< Miniloader rate, or the initial rate
+        bool    success;
+        int     error;              ///< PropellerLoader::LoaderError
+
+        LoaderReport();
+
+        void start(const QString & port, quint32 baudRate);
+        void finish(bool succeeded, int loaderError);
+        void retry(int loaderError, int backoff);
+
+        void enter(const QString & name);
+        void exit(const QString & name);
+        void written(qint64 bytes);
+
+        QList<Phase> phases() const;
+        Phase phase(const QString & name) const;
+
+        QList<Attempt> failedAttempts() const;
+        int attempts() const;
+
+        qint64 elapsed() const;
+        qint64 duration() const;
+        qint64 bytesSent() const;
+
+        QString toString() const;
+    };
+}
+
+Q_DECLARE_METATYPE(PM::LoaderReport)
@@ -0,0 +1,592 @@
+#include "miniloader.h"
+
+#include <string.h>
+
+namespace PM
+{
+    namespace
+    {
+        /*
+            The miniloader core (src/firmware/miniloader.spin) compiled for
+            80 MHz, with the packet markers stripped so the host values sit
+            in the seven longs ahead of the Spin stub.
+
+            These arrays are cut from the image openspin builds of
+            miniloader.spin. After changing it, run qmake and make in
+            src/firmware: "make arrays" prints them, and "make check"
+            compares them with this file.
+         */
+
+        const uchar core[472] = {
+            0x00,0xB4,0xC4,0x04,0x6F,0x25,0x10,0x00,0xD8,0x01,0xE0,0x01,0xD0,0x01,0xE4,0x01,
+            0xC8,0x01,0x02,0x00,0xC0,0x01,0x00,0x00,0x66,0xE8,0xBF,0xA0,0x66,0xEC,0xBF,0xA0,
+            0x67,0xDE,0xBC,0xA1,0x01,0xDE,0xFC,0x28,0xF1,0xDF,0xBC,0x80,0xA0,0xDC,0xCC,0xA0,
+            0x67,0xDE,0xBC,0xF8,0xF2,0xCB,0x3C,0x61,0x05,0xDC,0xFC,0xE4,0x04,0xE4,0xFC,0xA0,
+            0x6C,0xE0,0xBC,0xA0,0x08,0xD8,0xFC,0x20,0xFF,0xE0,0xFC,0x60,0x00,0xE1,0xFC,0x68,
+            0x01,0xE0,0xFC,0x2C,0x67,0xDE,0xBC,0xA0,0xF1,0xDF,0xBC,0x80,0x01,0xE0,0xFC,0x29,
+            0x67,0xDE,0xBC,0xF8,0x66,0xE8,0xBF,0x70,0x11,0xE0,0x7C,0xE8,0x0A,0xE4,0xFC,0xE4,
+            0x68,0xCE,0xBC,0xA0,0x6A,0x3E,0xFC,0x50,0x5F,0xE6,0xBC,0xA0,0x04,0xE6,0xFC,0x84,
+            0x73,0xE8,0xBC,0x08,0x78,0xEE,0xFC,0xA0,0x77,0x62,0xBC,0x54,0x04,0xE4,0xFC,0xA0,
+            0x00,0xE2,0xFC,0xA0,0x6A,0xDC,0xBC,0xA0,0x69,0xDE,0xBC,0xA1,0x00,0xE0,0xFC,0xA0,
+            0x80,0xE0,0xFC,0x72,0xF2,0xCB,0x3C,0x61,0x22,0xDC,0xF8,0xE4,0x36,0x00,0x78,0x5C,
+            0xF1,0xDF,0xBC,0x80,0x67,0xDE,0xBC,0xF8,0xF2,0xCB,0x3C,0x61,0x00,0xE1,0xFC,0x70,
+            0x01,0xE0,0xFC,0x29,0x27,0x00,0x4C,0x5C,0x70,0xE2,0xBC,0x68,0x08,0xE2,0xFC,0x20,
+            0x6B,0x3E,0xFC,0x50,0x1F,0xE4,0xFC,0xE4,0x73,0xE2,0x3C,0x08,0x71,0xF0,0xBC,0xA0,
+            0x04,0xE6,0xFC,0x80,0x01,0xEE,0xFC,0x80,0x97,0xEE,0xFC,0x4C,0x1C,0x00,0x7C,0x5C,
+            0x1F,0xDC,0xBC,0xA0,0xFF,0xDD,0xFC,0x60,0x6A,0xDC,0x7C,0x86,0x00,0xC2,0x68,0x0C,
+            0x5F,0xEA,0xBC,0xA0,0x04,0xEA,0xFC,0x84,0x75,0xE8,0x3C,0x08,0x75,0xE6,0xBC,0x84,
+            0x02,0xE6,0xFC,0x2A,0x09,0x00,0x68,0x5C,0x6C,0xF0,0x3C,0xC2,0x09,0x00,0x54,0x5C,
+            0x01,0xD8,0x7C,0xC1,0x01,0xD8,0xF0,0x84,0x79,0x00,0x70,0x5C,0x5B,0xE5,0xFC,0xA0,
+            0x01,0xD8,0x7C,0x86,0x6D,0xE4,0xA8,0xA0,0x01,0xE6,0xFC,0x84,0x72,0xE6,0xBC,0x85,
+            0x09,0x00,0x70,0x5C,0x54,0xE6,0x7C,0xEC,0x72,0xEC,0xBC,0xA0,0x01,0xEC,0xFC,0x80,
+            0x02,0xEC,0xFC,0x2C,0x75,0xEC,0xBC,0x80,0x76,0xF0,0xBC,0x08,0x01,0xF0,0xFC,0x80,
+            0x6C,0xF0,0x3C,0x86,0x09,0x00,0x54,0x5C,0x04,0xEA,0xFC,0x80,0x75,0xE2,0xBC,0x08,
+            0x5F,0xE2,0x3C,0x08,0x04,0xEA,0xFC,0x80,0x04,0xBE,0xFC,0x80,0x55,0xE4,0xFC,0xE4,
+            0x01,0xD8,0xFC,0x84,0x09,0xE6,0x7C,0xEC,0x01,0xD8,0x7C,0xC1,0x45,0x00,0x4C,0x5C,
+            0x09,0x00,0x7C,0x5C,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x80,0x00,0x00,0x00,
+            0x00,0x80,0x00,0x00,0xFF,0xFF,0xF9,0xFF,0x10,0xC0,0x07,0x00,0x00,0x00,0x00,0x80,
+            0x00,0x00,0x00,0x40,0xB6,0x02,0x00,0x00,0x5B,0x01,0x00,0x00,0x08,0x02,0x00,0x00,
+            0x55,0x73,0xCB,0x00,0x50,0x45,0x01,0x00,0x00,0x00,0x00,0x00,0x01,0x00,0x00,0x00,
+            0x35,0xC7,0x08,0x35,0x2C,0x32,0x00,0x00,
+        };
+
+        const int core_hostvalues = sizeof(core) - 9*4;
+
+        /*
+            Executable packets, assembled from the "Finalization" sections
+            of miniloader.spin against the register layout of the core.
+         */
+
+        // PACKET1: clear remaining RAM, insert the call frame, reply -checksum
+        const uchar verify_ram[72] = {
+            0x62,0xE4,0xBC,0xA0,0x5F,0xE4,0xBC,0x84,0x02,0xE4,0xFC,0x2A,0x5F,0xC0,0x14,0x08,
+            0x04,0xBE,0xD4,0x80,0x7C,0xE4,0xD4,0xE4,0x0A,0xE4,0xFC,0x04,0x04,0xE4,0xFC,0x84,
+            0x72,0xC6,0x3C,0x08,0x04,0xE4,0xFC,0x84,0x72,0xC6,0x3C,0x08,0x01,0xBE,0xFC,0x84,
+            0x5F,0xE4,0xBC,0x00,0x72,0xC0,0xBC,0x80,0x84,0xBE,0x7C,0xE8,0x60,0xD8,0xBC,0xA4,
+            0x62,0xBE,0xBC,0xA0,0x09,0x00,0x7C,0x5C,
+        };
+
+        // PACKET2: arm launch-on-timeout, acknowledge
+        const uchar launch_start[28] = {
+            0xB8,0x72,0xFC,0x58,0x7C,0x72,0xFC,0x50,0x09,0x00,0x7C,0x5C,0x06,0xBE,0xFC,0x04,
+            0x10,0xBE,0x7C,0x86,0x00,0xC2,0x54,0x0C,0x02,0xC8,0x7C,0x0C,
+        };
+
+        // PACKET3: launch the application
+        const uchar launch_final[16] = {
+            0x06,0xBE,0xFC,0x04,0x10,0xBE,0x7C,0x86,0x00,0xC2,0x54,0x0C,0x02,0xC8,0x7C,0x0C,
+        };
+
+        // PACKET4: copy the driver code that follows into the cog, acknowledge
+        const uchar load_driver[40] = {
+            0x80,0xF8,0xBC,0x54,0x83,0xF8,0xFC,0x50,0x81,0xE4,0xBC,0xA0,0x00,0x00,0xBC,0xA0,
+            0x82,0xF8,0xBC,0x80,0x7C,0xE4,0xFC,0xE4,0x09,0x00,0x7C,0x5C,0x00,0x00,0x00,0x00,
+            0x01,0x00,0x00,0x00,0x01,0x02,0x00,0x00,
+        };
+
+        const int load_dest = 7*4;          // cog register to copy to
+        const int load_longs = 8*4;         // longs of driver code that follow
+        const int load_capacity = 21;       // most longs of driver code per packet
+
+        // PACKET5: run the EEPROM driver
+        const uchar sync_eeprom[4] = {
+            0x98,0x00,0x7C,0x5C,
+        };
+
+        /*
+            The EEPROM driver from the "EEPROM Driver" section, delivered by
+            PACKET4 packets to the cog registers past the packet buffer.
+         */
+
+        const uchar eeprom_driver[428] = {
+            0xFE,0xE8,0xBF,0x68,0xFE,0xEC,0xBF,0x68,0xFF,0xE8,0xBF,0x64,0xFF,0xEC,0xBF,0x64,
+            0xF3,0xF2,0xFD,0x5C,0x00,0x06,0xFE,0xA0,0x00,0x08,0xFE,0xA0,0xAF,0x7C,0xFD,0x5C,
+            0xA5,0x00,0x68,0x5C,0xBF,0x8E,0xFD,0x5C,0xAF,0x7C,0xFD,0x5C,0xAB,0x00,0x54,0x5C,
+            0x01,0x08,0xFE,0x80,0x40,0x06,0xFE,0x80,0x62,0x06,0x3E,0x86,0x9F,0x00,0x54,0x5C,
+            0x01,0xD9,0xBC,0xA0,0x04,0xD9,0xBC,0x84,0x09,0x00,0x7C,0x5C,0x06,0x06,0xFE,0x28,
+            0x02,0xD9,0xBC,0xA0,0x03,0xD9,0xBC,0x84,0x09,0x00,0x7C,0x5C,0xC8,0xA2,0xFD,0x5C,
+            0xEC,0xE4,0xFD,0x5C,0xA1,0x0E,0xFE,0xA0,0xD2,0xB4,0xFD,0x5C,0x40,0x0A,0xFE,0xA0,
+            0x03,0xE7,0xBC,0xA0,0x00,0x0C,0xFE,0xA0,0xDB,0xCA,0xFD,0x5C,0x73,0xE0,0xBC,0x00,
+            0x07,0xE1,0xBC,0x6C,0x70,0x0C,0xBE,0x68,0x01,0xE6,0xFC,0x80,0xB6,0x0A,0xFE,0xE4,
+            0xF3,0xF2,0xFD,0x5C,0x00,0x0C,0x7E,0x86,0x00,0x00,0x7C,0x5C,0xC8,0xA2,0xFD,0x5C,
+            0x40,0x0A,0xFE,0xA0,0x03,0xE7,0xBC,0xA0,0x73,0x0E,0xBE,0x00,0xD2,0xB4,0xFD,0x5C,
+            0x01,0xE6,0xFC,0x80,0xC2,0x0A,0xFE,0xE4,0xF3,0xF2,0xFD,0x5C,0x00,0x00,0x7C,0x5C,
+            0xEC,0xE4,0xFD,0x5C,0xA0,0x0E,0xFE,0xA0,0xD2,0xB4,0xFD,0x5C,0xC8,0x00,0x70,0x5C,
+            0x03,0x0F,0xBE,0xA0,0x08,0x0E,0xFE,0x28,0xD2,0xB4,0xFD,0x5C,0x03,0x0F,0xBE,0xA0,
+            0xD2,0xB4,0xFD,0x5C,0x00,0x00,0x7C,0x5C,0x18,0x0E,0xFE,0x2C,0x08,0x10,0xFE,0xA0,
+            0x01,0x0E,0xFE,0x35,0xFF,0xEC,0xBF,0x74,0xE6,0xD6,0xFD,0x5C,0xD4,0x10,0xFE,0xE4,
+            0xFF,0xEC,0xBF,0x64,0xE6,0xD6,0xFD,0x5C,0x00,0x00,0x7C,0x5C,0xFF,0xEC,0xBF,0x64,
+            0x08,0x10,0xFE,0xA0,0xE6,0xD6,0xFD,0x5C,0x01,0x0E,0xFE,0x34,0xDD,0x10,0xFE,0xE4,
+            0xFF,0x0E,0xFE,0x60,0x01,0x0A,0x7E,0x86,0xFF,0xEC,0xBF,0x7C,0xE6,0xD6,0xFD,0x5C,
+            0xFF,0xEC,0xBF,0x64,0x00,0x00,0x7C,0x5C,0xFA,0xFA,0xFD,0x5C,0xFE,0xE8,0xBF,0x68,
+            0xFA,0xFA,0xFD,0x5C,0xF2,0xFF,0x3D,0x61,0xFE,0xE8,0xBF,0x64,0x00,0x00,0x7C,0x5C,
+            0xFF,0xEC,0xBF,0x64,0xFE,0xE8,0xBF,0x68,0xFA,0xFA,0xFD,0x5C,0xFF,0xEC,0xBF,0x68,
+            0xFA,0xFA,0xFD,0x5C,0xFE,0xE8,0xBF,0x64,0x00,0x00,0x7C,0x5C,0xFF,0xEC,0xBF,0x68,
+            0xFA,0xFA,0xFD,0x5C,0xFE,0xE8,0xBF,0x68,0xFA,0xFA,0xFD,0x5C,0xFF,0xEC,0xBF,0x64,
+            0xFA,0xFA,0xFD,0x5C,0x00,0x00,0x7C,0x5C,0x00,0xDD,0xBC,0xA0,0xF1,0xDD,0xBC,0x80,
+            0x00,0xDC,0xFC,0xF8,0x00,0x00,0x7C,0x5C,0x00,0x00,0x00,0x10,0x00,0x00,0x00,0x20,
+            0x64,0x00,0x00,0x00,0x00,0x00,0x00,0xC0,0x00,0x00,0x00,0xA0,
+        };
+
+        const int driver_origin = 0x98;
+        const int driver_i2cdelay = 104*4;  // half I2C bit period
+
+        // The driver acknowledges with these less the pages written, or
+        // less the page that failed to verify.
+        const qint32 sync_done      = -0x40000000;
+        const qint32 sync_failed    = -0x60000000;
+
+        // The miniloader clears RAM and inserts two of these call frames.
+        const quint32 callframe_checksum = 2 * (0xff + 0xff + 0xf9 + 0xff);
+    }
+
+    MiniLoader::MiniLoader(int maxRetries, int window)
+    {
+        _phase = Idle;
+        _failed = Idle;
+        _offset = 0;
+        _id = 0;
+        _checksum = 0;
+        _packets = 0;
+        _sent = 0;
+        _window = qMax(1, window);
+        _retries = 0;
+        _naks = 0;
+        _max_retries = maxRetries;
+        _eeprom = false;
+        _driver_offset = 0;
+        _pages_written = -1;
+        _failed_page = -1;
+    }
+
+    MiniLoader::~MiniLoader()
+    {
+    }
+
+    QByteArray MiniLoader::packLong(qint32 value)
+    {
+        QByteArray b(4, Qt::Uninitialized);
+        for (int i = 0; i < 4; i++)
+            b[i] = (char) ((quint32) value >> (8 * i));
+        return b;
+    }
+
+    /**
+      Return whether image can be delivered by the miniloader.
+
+      The miniloader times serial bits with the system clock, so the image
+      must run from an external crystal or clock input.
+      */
+
+    bool MiniLoader::isSupported(PropellerImage & image)
+    {
+        return image.isValid()
+            && (image.clockMode() & 0x20)
+            && image.clockFrequency();
+    }
+
+    /**
+      Return the miniloader core patched to run at the clock settings of
+      image and to expect packets at the rate of plan, the last of which
+      carries lastLongs longs of data.
+      */
+
+    PropellerImage MiniLoader::loader(PropellerImage & image,
+                                      const BaudPlanner::Plan & plan,
+                                      int packets, int lastLongs)
+    {
+        PropellerImage l(QByteArray((const char *) core, sizeof(core)));
+
+        l.writeLong(0, image.clockFrequency());
+        l.writeByte(4, image.clockMode());
+
+        l.writeLong(core_hostvalues + IBitTime,    plan.initialBitTime);
+        l.writeLong(core_hostvalues + FBitTime,    plan.finalBitTime);
+        l.writeLong(core_hostvalues + BitTime1_5,  plan.bitTime1_5);
+        l.writeLong(core_hostvalues + Failsafe,    plan.failsafe);
+        l.writeLong(core_hostvalues + EndOfPacket, plan.endOfPacket);
+        l.writeLong(core_hostvalues + ExpectedID,  packets);
+        l.writeLong(core_hostvalues + LastLongs,   lastLongs);
+
+        l.recalculateChecksum();
+        return l;
+    }
+
+    /**
+      Return whether image is a miniloader core returned by loader(),
+      for any clock settings and host values.
+      */
+
+    bool MiniLoader::isLoader(PropellerImage & image)
+    {
+        QByteArray d = image.data();
+        if (d.size() != (int) sizeof(core))
+            return false;
+
+        const uchar * b = (const uchar *) d.constData();
+        return !memcmp(b + 6, core + 6, core_hostvalues - 6)
+            && !memcmp(b + core_hostvalues + 7*4, core + core_hostvalues + 7*4,
+                       sizeof(core) - core_hostvalues - 7*4);
+    }
+
+    /**
+      Return the host value patched into loader, a miniloader core.
+      */
+
+    quint32 MiniLoader::hostValue(PropellerImage & loader, HostValue value)
+    {
+        return loader.readLong(core_hostvalues + value);
+    }
+
+    /**
+      Prepare to deliver image, and return the miniloader core to download
+      with the standard protocol before the first call to consume().
+
+      Only the program is sent; the miniloader clears the variables and
+      stack and inserts the initial call frame itself.
+
+      If eeprom is true, the EEPROM is synchronized with the verified RAM
+      before launch, writing only the pages that differ.
+      */
+
+    PropellerImage MiniLoader::start(PropellerImage image, const BaudPlanner::Plan & plan,
+                                     bool eeprom)
+    {
+        int size = qMin((int) image.startOfVariables(), (int) image.imageSize());
+        _data = image.data().left(size);
+        _data.append(QByteArray((4 - _data.size() % 4) % 4, 0));
+
+        _checksum = callframe_checksum;
+        const uchar * d = (const uchar *) _data.constData();
+        for (int i = 0; i < _data.size(); i++)
+            _checksum += d[i];
+
+        _packets = (_data.size() + max_payload - 5) / (max_payload - 4);
+        _id = _packets;
+        _offset = 0;
+        _sent = 0;
+        _retries = 0;
+        _naks = 0;
+        _reply.clear();
+        _phase = Ready;
+        _failed = Idle;
+
+        // the driver clocks the EEPROM at up to 400 kHz
+        _eeprom = eeprom;
+        _driver = QByteArray((const char *) eeprom_driver, sizeof(eeprom_driver));
+        _driver.replace(driver_i2cdelay, 4,
+                packLong(qMax<qint32>(20, image.clockFrequency() / 800000)));
+        _driver_offset = 0;
+        _pages_written = -1;
+        _failed_page = -1;
+
+        int last = _data.size() - (_packets - 1) * (max_payload - 4);
+        _loader = loader(image, plan, _packets, last / 4);
+        return _loader;
+    }
+
+    MiniLoader::Phase MiniLoader::phase()
+    {
+        return _phase;
+    }
+
+    /**
+      Return the phase in which the download failed, or Idle.
+      */
+
+    MiniLoader::Phase MiniLoader::failedPhase()
+    {
+        return _failed;
+    }
+
+    /**
+      Return the packets to send for the current phase.
+
+      In the Data phase this is up to window() image packets back to back.
+      The miniloader streams them through the end of RAM before moving
+      each into place, so the window is cut short where the packet IDs
+      would push the last of it past 0x8000.
+      */
+
+    QByteArray MiniLoader::packet()
+    {
+        QByteArray p;
+
+        if (_phase == Data)
+        {
+            int offset = _offset;
+            for (_sent = 0; _sent < _window && _id - _sent > 0; _sent++)
+            {
+                int size = qMin(max_payload - 4, _data.size() - offset);
+                if (_sent && offset + size + 4 * _sent > 0x8000)
+                    break;
+
+                p.append(packLong(_id - _sent));
+                p.append(_data.constData() + offset, size);
+                offset += size;
+            }
+            return p;
+        }
+
+        p = packLong(_id);
+
+        switch (_phase)
+        {
+            case VerifyRam:
+                p.append((const char *) verify_ram, sizeof(verify_ram));
+                break;
+            case LoadDriver:
+            {
+                QByteArray load((const char *) load_driver, sizeof(load_driver));
+                load.replace(load_dest, 4, packLong(driver_origin + _driver_offset));
+                load.replace(load_longs, 4, packLong(driverLongs()));
+                p.append(load);
+                p.append(_driver.mid(4 * _driver_offset, 4 * driverLongs()));
+                break;
+            }
+            case SyncEeprom:
+                p.append((const char *) sync_eeprom, sizeof(sync_eeprom));
+                break;
+            case LaunchStart:
+                p.append((const char *) launch_start, sizeof(launch_start));
+                break;
+            case LaunchFinal:
+                p.append((const char *) launch_final, sizeof(launch_final));
+                break;
+            default:
+                return QByteArray();
+        }
+
+        return p;
+    }
+
+    /**
+      Process bytes received from the miniloader.
+
+      A reply is the next expected packet ID as a long. Replying with the
+      ID of the first packet just sent is a negative acknowledgement, and
+      the packets are sent again up to maxRetries times. In the Data phase
+      any ID within the window acknowledges the packets before it.
+
+      The EEPROM driver replies with a result code in place of the next
+      ID. A page that fails to verify fails the download in the
+      SyncEeprom phase, and failedPage() returns it.
+
+      \return true if a reply was resolved and packet() should be sent,
+      or the phase became Failed.
+      */
+
+    bool MiniLoader::consume(const QByteArray & reply)
+    {
+        _reply.append(reply);
+
+        if (_phase == Ready)
+        {
+            // skip anything left over from the standard protocol
+            int i = _reply.indexOf(packLong(_id));
+            if (i < 0)
+            {
+                _reply = _reply.right(3);
+                return false;
+            }
+
+            _reply.remove(0, i + 4);
+            _phase = Data;
+            return true;
+        }
+
+        if (_phase == Idle || _phase == LaunchFinal || _phase == Failed
+                || _reply.size() < 4)
+            return false;
+
+        const uchar * r = (const uchar *) _reply.constData();
+        qint32 value = (qint32) (r[0] | r[1] << 8 | r[2] << 16 | (quint32) r[3] << 24);
+        _reply.remove(0, 4);
+
+        if (value == _id)
+        {
+            _naks++;
+            if (++_retries > _max_retries)
+            {
+                _failed = _phase;
+                _phase = Failed;
+            }
+            return true;
+        }
+
+        bool expected;
+        switch (_phase)
+        {
+            case Data:
+                expected = value < _id && value >= _id - _sent;
+                break;
+            case VerifyRam:
+                expected = value == -(qint32) _checksum;
+                break;
+            case SyncEeprom:
+                expected = value <= sync_done && value >= sync_done - eeprom_pages;
+                if (value <= sync_failed && value > sync_failed - eeprom_pages)
+                    _failed_page = sync_failed - value;
+                break;
+            default:
+                expected = value == _id - 1;
+                break;
+        }
+
+        if (!expected)
+        {
+            _failed = _phase;
+            _phase = Failed;
+            return true;
+        }
+
+        _retries = 0;
+
+        if (_phase == Data)
+            _offset += (_id - value) * (max_payload - 4);
+
+        _id = value;
+
+        switch (_phase)
+        {
+            case Data:
+                if (!_id)
+                    _phase = VerifyRam;
+                break;
+            case VerifyRam:
+                _phase = _eeprom ? LoadDriver : LaunchStart;
+                break;
+            case LoadDriver:
+                _driver_offset += driverLongs();
+                if (!driverLongs())
+                    _phase = SyncEeprom;
+                break;
+            case SyncEeprom:
+                _pages_written = sync_done - value;
+                _phase = LaunchStart;
+                break;
+            case LaunchStart:
+                _phase = LaunchFinal;
+                break;
+            default:
+                break;
+        }
+
+        return true;
+    }
+
+    /**
+      Record that no reply arrived for the packets last sent. They are
+      sent again up to maxRetries times, like after a negative
+      acknowledgement.
+
+      A missing Ready announcement is not retried, as there is nothing to
+      send again.
+
+      \return true if packet() should be sent, or the phase became Failed.
+      */
+
+    bool MiniLoader::expire()
+    {
+        if (_phase == Idle || _phase == Ready
+                || _phase == LaunchFinal || _phase == Failed)
+            return false;
+
+        _reply.clear();
+
+        if (++_retries > _max_retries)
+        {
+            _failed = _phase;
+            _phase = Failed;
+        }
+        return true;
+    }
+
+    /**
+      Return the most image packets sent per write.
+      */
+
+    int MiniLoader::window()
+    {
+        return _window;
+    }
+
+    /**
+      Set the most image packets sent per write. A window of 1 waits for
+      each packet to be acknowledged before sending the next.
+      */
+
+    void MiniLoader::setWindow(int packets)
+    {
+        _window = qMax(1, packets);
+    }
+
+    int MiniLoader::packetCount()
+    {
+        return _packets;
+    }
+
+    /**
+      Return the number of image bytes not yet acknowledged.
+      */
+
+    int MiniLoader::bytesRemaining()
+    {
+        return qMax(0, _data.size() - _offset);
+    }
+
+    /**
+      Return the number of negative acknowledgements received.
+      */
+
+    int MiniLoader::retries()
+    {
+        return _naks;
+    }
+
+    /**
+      Return the 32-bit sum of RAM expected after delivery.
+      */
+
+    quint32 MiniLoader::checksum()
+    {
+        return _checksum;
+    }
+
+    /**
+      Return whether the download synchronizes the EEPROM.
+      */
+
+    bool MiniLoader::writesEeprom()
+    {
+        return _eeprom;
+    }
+
+    /**
+      Return the EEPROM pages written, of eeprom_pages, or -1 until the
+      EEPROM is synchronized.
+      */
+
+    int MiniLoader::pagesWritten()
+    {
+        return _pages_written;
+    }
+
+    /**
+      Return the EEPROM page that failed to verify, or -1.
+      */
+
+    int MiniLoader::failedPage()
+    {
+        return _failed_page;
+    }
+
+    /**
+      Return the longs of driver code the next PACKET4 packet carries.
+      */
+
+    int MiniLoader::driverLongs()
+    {
+        return qMin(load_capacity, _driver.size() / 4 - _driver_offset);
+    }
+}
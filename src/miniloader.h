@@ -0,0 +1,137 @@
+#pragma once
+
+#include <QByteArray>
+
+#include "propellerimage.h"
+#include "baudplanner.h"
+
+namespace PM
+{
+    /**
+      @class MiniLoader
+
+      The MiniLoader class implements the host side of the high-speed
+      download protocol served by src/firmware/miniloader.spin.
+
+      The miniloader core is a small image delivered with the standard
+      Propeller download protocol. Its host-initialized values are
+      patched in by loader() from a BaudPlanner::Plan, so it runs at the
+      target's clock settings, receives at the planned baud rate and knows
+      the number of packets to expect.
+
+      Once running, it announces itself at the initial baud rate, then
+      receives the target image at the final baud rate in packets of at
+      most max_payload bytes, each prefixed with a packet ID. Packet IDs
+      count down to 1; packets with IDs of 0 and below carry code that the
+      miniloader executes to clear and verify RAM, and finally to launch
+      the application.
+
+      Image packets are sent back to back, up to window() of them per
+      write, so the port latency is paid once per window rather than once
+      per packet. The miniloader acknowledges the whole window with the ID
+      of the next packet it still needs; a lost or misaligned packet drops
+      it and everything after it, and sending resumes from there.
+
+      For delta EEPROM programming, start() is asked to synchronize the
+      EEPROM as well. After the RAM is verified, the miniloader loads an
+      I2C driver into its cog in a few more executable packets, then runs
+      it to compare each page of the EEPROM with the verified RAM and
+      write only the pages that differ. An unchanged image writes nothing.
+
+      MiniLoader performs no I/O. Feed replies to consume(), and send
+      packet() whenever consume() returns true and the phase is not
+      Failed. Over lossy links, call expire() when a reply is overdue.
+      */
+
+    class MiniLoader
+    {
+    public:
+        enum Phase
+        {
+            Idle,
+            Ready,          ///< Waiting for the miniloader to announce itself
+            Data,           ///< Sending image packets
+            VerifyRam,      ///< Sending the RAM clear and checksum packet
+            LoadDriver,     ///< Sending the EEPROM driver packets
+            SyncEeprom,     ///< Sending the EEPROM synchronization packet
+            LaunchStart,    ///< Sending the first launch packet
+            LaunchFinal,    ///< Sending the final launch packet; no reply
+            Failed
+        };
+
+        enum HostValue
+        {
+            IBitTime    = 0,
+            FBitTime    = 4,
+            BitTime1_5  = 8,
+            Failsafe    = 12,
+            EndOfPacket = 16,
+            ExpectedID  = 20,
+            LastLongs   = 24
+        };
+
+        static const int max_payload = 1392;
+        static const int default_window = 8;
+        static const int eeprom_pages = 512;
+
+    private:
+        PropellerImage _loader;
+        QByteArray _data;
+        QByteArray _reply;
+
+        Phase _phase;
+        Phase _failed;
+
+        int _offset;
+        qint32 _id;
+        quint32 _checksum;
+        int _packets;
+        int _sent;
+        int _window;
+        int _retries;
+        int _naks;
+        int _max_retries;
+
+        bool _eeprom;
+        QByteArray _driver;
+        int _driver_offset;
+        int _pages_written;
+        int _failed_page;
+
+        static QByteArray packLong(qint32 value);
+        int driverLongs();
+
+    public:
+        MiniLoader(int maxRetries = 3, int window = default_window);
+        ~MiniLoader();
+
+        static bool isSupported(PropellerImage & image);
+        static PropellerImage loader(PropellerImage & image,
+                                     const BaudPlanner::Plan & plan,
+                                     int packets, int lastLongs);
+        static bool isLoader(PropellerImage & image);
+        static quint32 hostValue(PropellerImage & loader, HostValue value);
+
+        PropellerImage start(PropellerImage image, const BaudPlanner::Plan & plan,
+                             bool eeprom = false);
+
+        Phase phase();
+        Phase failedPhase();
+
+        QByteArray packet();
+        bool consume(const QByteArray & reply);
+        bool expire();
+
+        int window();
+        void setWindow(int packets);
+
+        int packetCount();
+        int bytesRemaining();
+        int retries();
+        quint32 checksum();
+
+        bool writesEeprom();
+        int pagesWritten();
+        int failedPage();
+    };
+}
@@ -0,0 +1,109 @@
+#include "payloadanalyzer.h"
+
+#include <QtEndian>
+
+#include <string.h>
+
+namespace PM
+{
+    const int PayloadAnalyzer::ram_size;
+    const int PayloadAnalyzer::header_size;
+
+    /**
+      Return the contents of RAM after the boot loader has received
+      data: data, then zeros up to 32 kB, with the initial call frame
+      written in the two longs at stackSpace, as returned by
+      PropellerImage::startOfStackSpace().
+      */
+
+    QByteArray PayloadAnalyzer::ram(const QByteArray & data, int stackSpace)
+    {
+        QByteArray r = data.left(ram_size);
+        r.append(QByteArray(ram_size - r.size(), 0));
+
+        if (stackSpace >= 0 && stackSpace + 8 <= ram_size)
+        {
+            uchar * d = (uchar *) r.data();
+            qToLittleEndian<quint32>(callframe, d + stackSpace);
+            qToLittleEndian<quint32>(callframe, d + stackSpace + 4);
+        }
+
+        return r;
+    }
+
+    /**
+      Return the additive checksum of ram, which the boot loader requires
+      to be 0.
+      */
+
+    quint8 PayloadAnalyzer::checksum(const QByteArray & ram)
+    {
+        quint8 sum = 0;
+        const uchar * d = (const uchar *) ram.constData();
+        for (int i = 0; i < ram.size(); i++)
+            sum += d[i];
+        return sum;
+    }
+
+    /**
+      Return the size in bytes of the shortest prefix of data that leaves
+      the same RAM behind: everything up to the last long that is neither
+      zero nor part of the call frame, and no less than the header.
+      */
+
+    int PayloadAnalyzer::minimalSize(const QByteArray & data, int stackSpace)
+    {
+        const uchar * d = (const uchar *) data.constData();
+
+        int size = qMin(data.size(), ram_size) & ~3;
+        while (size > header_size)
+        {
+            int offset = size - 4;
+            if (offset != stackSpace && offset != stackSpace + 4
+                    && qFromLittleEndian<quint32>(d + offset))
+                break;
+
+            size = offset;
+        }
+
+        return qMax(size, qMin(header_size, data.size()));
+    }
+
+    /**
+      Return the part of image that must be downloaded, or all of it if
+      it could not be shown to leave the same RAM behind.
+
+      The RAM left by the reduced download is compared with RAM built
+      separately from the full image, with the call frame placed from
+      DBase itself, which must also pass the boot loader's checksum.
+      */
+
+    QByteArray PayloadAnalyzer::minimize(PropellerImage & image)
+    {
+        QByteArray data = image.data();
+        if (!image.isValid())
+            return data;
+
+        int stackSpace = image.startOfStackSpace();
+        int size = minimalSize(data, stackSpace);
+        if (size >= data.size())
+            return data;
+
+        int dbase = image.readWord(0x0A);
+        if (dbase < 8 || dbase > ram_size)
+            return data;
+
+        QByteArray expected = data.left(ram_size);
+        expected.append(QByteArray(ram_size - expected.size(), 0));
+        memcpy(expected.data() + dbase - 8, "\xff\xff\xf9\xff\xff\xff\xf9\xff", 8);
+
+        if (checksum(expected) != 0)
+            return data;
+
+        QByteArray payload = data.left(size);
+        if (ram(payload, stackSpace) != expected)
+            return data;
+
+        return payload;
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <QByteArray>
+
+#include "propellerimage.h"
+
+namespace PM
+{
+    /**
+      @class PayloadAnalyzer
+
+      The PayloadAnalyzer class works out how much of an image the
+      Propeller must actually receive.
+
+      Once a download has arrived, the boot loader clears the rest of RAM
+      and writes the initial call frame at the start of stack space, just
+      below DBase, then checks the checksum of all 32 kB. Trailing zero
+      longs and the call frame need not be sent, which for .eeprom images,
+      whose variables and stack are stored in full, usually leaves only
+      the program.
+
+      Every reduction is checked by rebuilding the RAM the Propeller will
+      end up with from what is sent, and comparing it with the RAM of the
+      full image, whose checksum must be valid. If they differ, the full
+      image is sent.
+      */
+
+    class PayloadAnalyzer
+    {
+    public:
+        static const int ram_size = 0x8000;
+        static const int header_size = 16;
+        static const quint32 callframe = 0xfff9ffff;
+
+        static QByteArray ram(const QByteArray & data, int stackSpace);
+        static quint8 checksum(const QByteArray & ram);
+        static int minimalSize(const QByteArray & data, int stackSpace);
+
+        static QByteArray minimize(PropellerImage & image);
+    };
+}
@@ -0,0 +1,110 @@
+#include "payloadcache.h"
+
+#include <QCryptographicHash>
+#include <QtEndian>
+
+namespace PM
+{
+    PayloadCache::PayloadCache(int maxSize)
+    {
+        _cache.setMaxCost(maxSize);
+        _hits = 0;
+        _misses = 0;
+    }
+
+    PayloadCache::~PayloadCache()
+    {
+    }
+
+    /**
+      Build the cache key for downloading image with command.
+
+      The length is part of the key, so a full image and a minimized
+      download of it, which share a prefix, never share an entry.
+      */
+
+    QByteArray PayloadCache::key(const QByteArray & image, Command::Command command)
+    {
+        QByteArray k = QCryptographicHash::hash(image, QCryptographicHash::Sha1);
+        k.append((char) command);
+
+        uchar length[4];
+        qToLittleEndian<quint32>(image.size(), length);
+        k.append((const char *) length, 4);
+        return k;
+    }
+
+    /**
+      Look up the download stream for key, counting a hit or a miss.
+
+      \return true and sets payload if found, otherwise false.
+      */
+
+    bool PayloadCache::lookup(const QByteArray & key, QByteArray & payload)
+    {
+        QByteArray * cached = _cache.object(key);
+
+        if (!cached)
+        {
+            _misses++;
+            return false;
+        }
+
+        _hits++;
+        payload = *cached;
+        return true;
+    }
+
+    /**
+      Store the download stream for key. Streams larger than maxSize()
+      are not cached.
+      */
+
+    void PayloadCache::insert(const QByteArray & key, const QByteArray & payload)
+    {
+        _cache.insert(key, new QByteArray(payload), payload.size());
+    }
+
+    void PayloadCache::clear()
+    {
+        _cache.clear();
+    }
+
+    /**
+      Return the maximum total size of cached streams in bytes.
+      */
+
+    int PayloadCache::maxSize()
+    {
+        return _cache.maxCost();
+    }
+
+    void PayloadCache::setMaxSize(int bytes)
+    {
+        _cache.setMaxCost(bytes);
+    }
+
+    /**
+      Return the total size of cached streams in bytes.
+      */
+
+    int PayloadCache::size()
+    {
+        return _cache.totalCost();
+    }
+
+    int PayloadCache::count()
+    {
+        return _cache.count();
+    }
+
+    quint64 PayloadCache::hits()
+    {
+        return _hits;
+    }
+
+    quint64 PayloadCache::misses()
+    {
+        return _misses;
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <QByteArray>
+#include <QCache>
+
+#include "protocol.h"
+
+namespace PM
+{
+    /**
+      @class PayloadCache
+
+      The PayloadCache class holds recently encoded download streams, so
+      repeated downloads of an unchanged image skip encoding entirely.
+
+      Entries are keyed by a hash of the data sent, its length and the
+      download command, and the least recently used entries are evicted once the
+      total size of cached streams exceeds maxSize().
+      */
+
+    class PayloadCache
+    {
+        QCache<QByteArray, QByteArray> _cache;
+
+        quint64 _hits;
+        quint64 _misses;
+
+    public:
+        PayloadCache(int maxSize = 8 * 1024 * 1024);
+        ~PayloadCache();
+
+        static QByteArray key(const QByteArray & image, Command::Command command);
+
+        bool lookup(const QByteArray & key, QByteArray & payload);
+        void insert(const QByteArray & key, const QByteArray & payload);
+        void clear();
+
+        int maxSize();
+        void setMaxSize(int bytes);
+        int size();
+        int count();
+
+        quint64 hits();
+        quint64 misses();
+    };
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "protocol.h"
+
+/**
+  Compile-time generation of the Propeller handshake.
+
+  The handshake request is two calibration pulses followed by the first
+  250 bits of the LFSR sequence, sent through the download stream
+  translator. The Propeller replies with the next 250 bits of the
+  sequence, two bits per byte, clocked out by the 125 calibration bytes
+  that follow the request.
+
+  The complete prelude sent ahead of the image, handshake, calibration
+  bytes and encoded command, is generated here for every Command and
+  checked against the hand-written Propeller::request and
+  Propeller::reply tables.
+  */
+
+namespace Propeller {
+namespace Prelude {
+
+const int handshake_bits = 250;
+const int calibration_size = reply_size + 4;
+const quint8 calibration_byte = 0x29;
+
+const int capacity = request_size + calibration_size + 11;
+
+struct Bits
+{
+    quint8 data[2 + 2 * handshake_bits];
+};
+
+struct Stream
+{
+    int size;
+    quint8 data[capacity];
+};
+
+struct Reply
+{
+    quint8 data[reply_size];
+};
+
+constexpr int lfsr(int seed)
+{
+    return ((seed << 1) & 0xfe) | (((seed >> 7) ^ (seed >> 5) ^ (seed >> 4) ^ (seed >> 1)) & 1);
+}
+
+constexpr Bits buildLfsrSequence()
+{
+    Bits seq {};
+    int seed = 'P';
+    for (int i = 0; i < 2 * handshake_bits; i++)
+    {
+        seq.data[i] = seed & 0x01;
+        seed = lfsr(seed);
+    }
+    return seq;
+}
+
+constexpr Bits lfsr_sequence = buildLfsrSequence();
+
+constexpr Bits buildHandshake()
+{
+    Bits bits {};
+    bits.data[0] = 1;
+    bits.data[1] = 0;
+    for (int i = 0; i < handshake_bits; i++)
+        bits.data[2 + i] = lfsr_sequence.data[i];
+    return bits;
+}
+
+constexpr Bits buildLong(quint32 value)
+{
+    Bits bits {};
+    for (int i = 0; i < 32; i++)
+        bits.data[i] = (value >> i) & 1;
+    return bits;
+}
+
+constexpr int translate(const Bits & bits, int count, Stream & out)
+{
+    int i = 0;
+    while (i < count)
+    {
+        int size = count - i < 5 ? count - i : 5;
+        int value = 0;
+        for (int b = 0; b < size; b++)
+            value |= bits.data[i + b] << b;
+
+        out.data[out.size++] = translator[value][size - 1][0];
+        i += translator[value][size - 1][1];
+    }
+    return out.size;
+}
+
+constexpr Stream buildPrelude(int command)
+{
+    Stream prelude {};
+    translate(buildHandshake(), 2 + handshake_bits, prelude);
+
+    for (int i = 0; i < calibration_size; i++)
+        prelude.data[prelude.size++] = calibration_byte;
+
+    translate(buildLong(command), 32, prelude);
+    return prelude;
+}
+
+constexpr Reply buildReply()
+{
+    Reply reply {};
+    for (int i = 0; i < reply_size; i++)
+    {
+        reply.data[i] = 0xCE
+            | lfsr_sequence.data[handshake_bits + 2 * i]
+            | lfsr_sequence.data[handshake_bits + 2 * i + 1] << 5;
+    }
+    return reply;
+}
+
+constexpr Stream preludes[] = {
+    buildPrelude(Command::Shutdown),
+    buildPrelude(Command::Run),
+    buildPrelude(Command::Write),
+    buildPrelude(Command::WriteRun)
+};
+
+constexpr Reply reply = buildReply();
+
+constexpr bool equal(const quint8 * a, const quint8 * b, int size)
+{
+    for (int i = 0; i < size; i++)
+    {
+        if (a[i] != b[i])
+            return false;
+    }
+    return true;
+}
+
+static_assert(equal(preludes[Command::Shutdown].data, Propeller::request, request_size),
+        "generated handshake request does not match Propeller::request");
+static_assert(equal(preludes[Command::WriteRun].data, Propeller::request, request_size),
+        "generated handshake request does not match Propeller::request");
+static_assert(equal(reply.data, Propeller::reply, reply_size),
+        "generated handshake reply does not match Propeller::reply");
+
+}
+}
@@ -11,7 +11,7 @@ namespace PM
 {
 
     PropellerDevice::PropellerDevice(QString devicename)
-        : Interface()
+        : Device()
     {
         _resource_error_count = 0;
         _minimum_timeout = 400;
@@ -178,19 +178,23 @@ namespace PM
     }
 
     /**
-      The total timeout period is calculated as follows.
+      Return the time in milliseconds to transmit bytes with the current
+      framing, plus minimumTimeout().
 
-      timeout = bytes * bits_per_character / bits_per_second
-     * (1000ms / 1s) * safety_factor / 10
-     + minimumTimeout()
+      timeout = bytes * (1 + data_bits + stop_bits) * 1000 / bits_per_second
+              + minimumTimeout()
 
-     safety_factor defaults to 10, and is divided by 10, allowing <1 safety factors.
+      No safety factor is applied; PropellerLoader adds its own margins
+      via PM::TransferModel.
      */
 
     quint32 PropellerDevice::calculateTimeout(quint32 bytes)
     {
-        return bytes * (device.dataBits() + device.stopBits()) * 25 / 10
-            * 1000 / baudRate() + minimumTimeout();
+        if (!baudRate())
+            return minimumTimeout();
+
+        quint64 bits = (quint64) bytes * (1 + device.dataBits() + device.stopBits());
+        return (bits * 1000 + baudRate() - 1) / baudRate() + minimumTimeout();
     }
 
     /**
@@ -314,6 +318,16 @@ namespace PM
         return 95;
     }
 
+    /**
+      Serial ports apply resets and baud rates before returning, so
+      nothing is ever pending.
+      */
+
+    bool PropellerDevice::commandsPending()
+    {
+        return false;
+    }
+
     bool PropellerDevice::clear()
     {
         device.clear();
@@ -1,6 +1,6 @@
 #pragma once
 
-#include "template/interface.h"
+#include "template/device.h"
 
 #include <QSerialPort>
 #include <QStringList>
@@ -19,7 +19,7 @@
 namespace PM
 {
 
-class PropellerDevice : public Interface
+class PropellerDevice : public Device
 {
     Q_OBJECT
     
@@ -72,6 +72,8 @@ public:
     bool        reset();
     quint32     resetPeriod();
 
+    bool        commandsPending();
+
 };
 
 }
@@ -42,6 +42,10 @@ to the rest of the RAM/EEPROM, after the end of code (up to 32 Kbytes), and
 inserts the initial call frame in the proper location. This effectively clears
 (initializes) all global variables to zero (0) and sets all available stack
 and free space to zero (0) as well.
+
+PM::PayloadAnalyzer finds the part to send, trimming trailing zero longs and
+the call frame, and sends the whole image instead if it can't confirm that
+the Propeller would end up with the same RAM and checksum.
 */
 
 /**
@@ -4,46 +4,67 @@
 #include <QDebug>
 #include <QFile>
 #include <QElapsedTimer>
+#include <QSerialPortInfo>
 
+#include "propellertask.h"
+#include "xbeedevice.h"
 #include "logging.h"
 
 PropellerLoader::PropellerLoader(PropellerManager * manager, const QString & portname,
                                  QObject * parent)
     : QObject(parent)
 {
-    _versionstrings[0] = tr("");
-    _versionstrings[1] = tr("Propeller P8X32A");
-
     _error = NoError;
-    _errorstrings[NoError]                  = tr("No Error");
-    _errorstrings[DeviceBusyError]          = tr("Device is busy");
-    _errorstrings[DeviceNotOpenError]       = tr("Device not open");
-    _errorstrings[DeviceNotFoundError]      = tr("Device not found");
-    _errorstrings[DownloadInProgressError]  = tr("Download already in progress");
-    _errorstrings[InvalidImageError]        = tr("Invalid image");
-    _errorstrings[VerifyRamError]           = tr("Verify RAM failed");
-    _errorstrings[WriteEepromError]         = tr("EEPROM write failed");
-    _errorstrings[VerifyEepromError]        = tr("Verify EEPROM failed");
-    _errorstrings[TimeoutError]             = tr("Download timed out");
-    _errorstrings[HandshakeError]           = tr("Handshake not received");
-    _errorstrings[InvalidHandshakeError]    = tr("Invalid handshake");
-    _errorstrings[UnknownError]             = tr("Device error");
-
     _version = 0;
+    _probe = false;
     _ack     = 0;
+    _streaming = false;
+    _template = 0;
+    _handshake_time = -1;
+    _acks = 0;
+    _stage = PM::TransferModel::Handshake;
+    _payload_size = 0;
+    _highspeed = false;
+    _use_highspeed = false;
+    _delta_write = false;
+    _delta_failed = false;
+    _highspeed_baud = 0;
+    _highspeed_switched = false;
+    _initial_baud = 115200;
+    _pulsing = false;
+    _train_end = 0;
+    _train_at = 0;
+    _train_sent = false;
+    _launch_end = 0;
+
+    _manager = manager;
+    _ticket = 0;
+    _priority = 0;
+    _queueing = true;
+    _queued_write = false;
+    _queued_run = true;
 
     this->session = new PropellerSession(manager, portname);
 
     totalTimeout.setSingleShot(true);
     handshakeTimeout.setSingleShot(true);
+    stageTimeout.setSingleShot(true);
     resetTimer.setSingleShot(true);
+    poll.setSingleShot(true);
+    poll.setTimerType(Qt::PreciseTimer);
+    retryTimer.setSingleShot(true);
 
     connect(&totalTimeout,      SIGNAL(timeout()), this, SLOT(timeover()));
     connect(&handshakeTimeout,  SIGNAL(timeout()), this, SLOT(timeover()));
+    connect(&stageTimeout,      SIGNAL(timeout()), this, SLOT(timeover()));
+    connect(&resetTimer,        SIGNAL(timeout()), this, SLOT(reset_finished()));
+    connect(&retryTimer,        SIGNAL(timeout()), this, SLOT(retry_start()));
+    connect(this,               SIGNAL(finished()),this, SLOT(finish_task()));
     connect(&resetTimer,        SIGNAL(timeout()), this, SIGNAL(prepared()));
 
     connect(session,&PropellerSession::sendError,
             this,   &PropellerLoader::error);
+    connect(session,    SIGNAL(bytesWritten(qint64)),   this,   SLOT(report_written(qint64)));
 
     QFinalState * s_failure = new QFinalState();
     QFinalState * s_success = new QFinalState();
@@ -59,12 +80,29 @@ PropellerLoader::PropellerLoader(PropellerManager * manager, const QString & por
     QState * s_verify       = new QState(s_active);
     QState * s_write        = new QState(s_active);
     QState * s_verifywrite  = new QState(s_active);
+    QState * s_highspeed    = new QState(s_active);
+
+    s_prepare    ->setObjectName("prepare");
+    s_payload    ->setObjectName("payload");
+    s_verify     ->setObjectName("verify-ram");
+    s_write      ->setObjectName("write-eeprom");
+    s_verifywrite->setObjectName("verify-eeprom");
+    s_highspeed  ->setObjectName("highspeed");
+
+    // time each state before its own entry and exit handlers run
+    foreach (QState * state, QList<QState *>() << s_prepare << s_payload << s_verify
+                                               << s_write << s_verifywrite << s_highspeed)
+    {
+        connect(state,  SIGNAL(entered()), this, SLOT(report_entered()));
+        connect(state,  SIGNAL(exited()),  this, SLOT(report_exited()));
+    }
 
     s_prepare    ->assignProperty(this, "status", tr("Preparing image..."));
     s_payload    ->assignProperty(this, "status", tr("Downloading to RAM..."));
     s_verify     ->assignProperty(this, "status", tr("Verifying RAM..."));
     s_write      ->assignProperty(this, "status", tr("Writing to EEPROM..."));
     s_verifywrite->assignProperty(this, "status", tr("Verifying EEPROM..."));
+    s_highspeed  ->assignProperty(this, "status", tr("Downloading to RAM (high speed)..."));
 
     s_verify     ->assignProperty(this, "stat", 1);
     s_write      ->assignProperty(this, "stat", 2);
@@ -95,6 +133,7 @@ PropellerLoader::PropellerLoader(PropellerManager * manager, const QString & por
 
     s_verify     ->addTransition(this,  SIGNAL(acknowledged()),  s_write);
     s_verify     ->addTransition(this,  SIGNAL(success()),       s_success);
+    s_verify     ->addTransition(this,  SIGNAL(loader_started()),s_highspeed);
 
     connect(s_write,         SIGNAL(entered()), this, SLOT(acknowledge_entry()));
     connect(s_write,         SIGNAL(exited()),  this, SLOT(acknowledge_exit()));
@@ -105,10 +144,57 @@ PropellerLoader::PropellerLoader(PropellerManager * manager, const QString & por
     connect(s_verifywrite,   SIGNAL(exited()),  this, SLOT(acknowledge_exit()));
  
     s_verifywrite->addTransition(this,  SIGNAL(success()),       s_success);
+
+    // high-speed download through the miniloader
+    connect(s_highspeed,     SIGNAL(entered()), this, SLOT(highspeed_entry()));
+    connect(s_highspeed,     SIGNAL(exited()),  this, SLOT(highspeed_exit()));
+
+    s_highspeed  ->addTransition(this,  SIGNAL(success()),       s_success);
+}
+
+/**
+  Return the messages of each LoaderError, shared by all loaders.
+  */
+
+const QHash<PropellerLoader::LoaderError, QString> & PropellerLoader::errorStrings()
+{
+    static QHash<LoaderError, QString> strings;
+    if (strings.isEmpty())
+    {
+        strings[NoError]                 = tr("No Error");
+        strings[DeviceBusyError]         = tr("Device is busy");
+        strings[DeviceNotOpenError]      = tr("Device not open");
+        strings[DeviceNotFoundError]     = tr("Device not found");
+        strings[DownloadInProgressError] = tr("Download already in progress");
+        strings[InvalidImageError]       = tr("Invalid image");
+        strings[VerifyRamError]          = tr("Verify RAM failed");
+        strings[WriteEepromError]        = tr("EEPROM write failed");
+        strings[VerifyEepromError]       = tr("Verify EEPROM failed");
+        strings[TimeoutError]            = tr("Download timed out");
+        strings[HandshakeError]          = tr("Handshake not received");
+        strings[InvalidHandshakeError]   = tr("Invalid handshake");
+        strings[CancelledError]          = tr("Upload cancelled");
+        strings[UnknownError]            = tr("Device error");
+    }
+    return strings;
+}
+
+const QHash<int, QString> & PropellerLoader::versionStrings()
+{
+    static QHash<int, QString> strings;
+    if (strings.isEmpty())
+    {
+        strings[0] = tr("");
+        strings[1] = tr("Propeller P8X32A");
+    }
+    return strings;
 }
 
 PropellerLoader::~PropellerLoader()
 {
+    if (_ticket)
+        _manager->cancelReservation(_ticket);
+
     session->release();
     delete session;
 }
@@ -123,9 +209,52 @@ void PropellerLoader::error(const QString & text)
     message("ERROR: "+text);
 }
 
+/**
+  Send a calibration pulse, or once per stage, when the reply is
+  expected, a train of them lasting _pulse_train_time ms on the line.
+  acknowledge_drained() waits for whatever is in flight when the
+  Propeller replies before moving on.
+  */
+
 void PropellerLoader::calibrate()
 {
-    session->putChar(0xf9);
+    if (!_pulsing)
+        return;
+
+    quint32 baud = session->baudRate();
+    int pulses = 1;
+    if (!_train_sent && stageTimer.nsecsElapsed() >= _train_at)
+    {
+        pulses = qMax(1, (int) (baud / 10 * _pulse_train_time / 1000));
+        _train_sent = true;
+    }
+
+    _train_end = stageTimer.nsecsElapsed()
+        + (qint64) (PM::TransferModel::transferTime(pulses, baud) * 1000000);
+
+    session->write(QByteArray(pulses, (char) 0xf9));
+}
+
+/**
+  Schedule the next calibration pulse once the last one has been
+  clocked out: _pulse_interval ms later, as the Propeller was always
+  polled, or sooner if the expected reply window opens first.
+  */
+
+void PropellerLoader::calibrate_written()
+{
+    if (!_pulsing || session->bytesToWrite())
+        return;
+
+    qint64 next = _train_end + (qint64) _pulse_interval * 1000000;
+    if (!_train_sent)
+        next = qMin(next, _train_at);
+
+    qint64 remaining = next - stageTimer.nsecsElapsed();
+    if (remaining <= 0)
+        calibrate();
+    else
+        poll.start((int) ((remaining + 999999) / 1000000));
 }
 
 void PropellerLoader::writeLong(quint32 value)
@@ -135,38 +264,87 @@ void PropellerLoader::writeLong(quint32 value)
 
 void PropellerLoader::failure_entry()
 {
-    setProperty("status", tr("ERROR: %1")
-            .arg(_errorstrings[_error]));
+    if (_highspeed && _highspeed_switched)
+        baudPlanner().recordFailure(session->portName(), _highspeed_baud);
+
     totalTimeout.stop();
+    handshakeTimeout.stop();
+    stageTimeout.stop();
+    disconnect(session, SIGNAL(commandsFinished(bool)), this, SLOT(reset_applied(bool)));
+
+    if (retry())
+        return;
+
+    // a port that gave no valid reply may still get a Propeller without
+    // the port changing, as when the board is powered up later, so the
+    // failure is not remembered; only what was known before is dropped.
+    if (_command == 0 && (_error == TimeoutError
+                || _error == HandshakeError
+                || _error == InvalidHandshakeError))
+        _manager->forgetIdentity(session->portName());
+
+    setProperty("status", tr("ERROR: %1")
+            .arg(errorStrings().value(_error)));
+
     session->release();
+
+    _report.finish(false, _error);
+    message(_report.toString());
+    emit reported(_report);
     emit finished();
 }
 
 void PropellerLoader::success_entry()
 {
     setProperty("status", tr("Success!"));
+
+    if (_highspeed)
+        baudPlanner().recordSuccess(session->portName(), _highspeed_baud);
+
+    if (_command == 0)
+        _manager->storeIdentity(session->portName(), _version);
+
     totalTimeout.stop();
+    handshakeTimeout.stop();
+    stageTimeout.stop();
     session->release();
+
+    _report.finish(true, _error);
+    message(_report.toString());
+    emit reported(_report);
     emit finished();
 }
 
 /**
   Get the version of the connected device.
+
+  The device is reset and queried every time, unless cached is true, in
+  which case a version remembered by PropellerManager is returned
+  without touching the device.
   
   \return The version number, or 0 if not found.
   */
-int PropellerLoader::version()
+int PropellerLoader::version(bool cached)
+{
+    PropellerTask * task = identify(false, !cached);
+    task->waitForFinished();
+
+    int version = task->result().version;
+    delete task;
+
+    return version;
+}
+
+void PropellerLoader::startVersion()
 {
     _write = 0;
     _run = 0;
+    _version = 0;
+    _highspeed = false;
+    _retries.clear();
+    _report.start(session->portName(), session->baudRate());
     machine.setInitialState(s_active);
     machine.start();
-
-    QEventLoop loop;
-    connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
-    loop.exec();
-
-    return _version;
 }
 
 void PropellerLoader::prepare_entry()
@@ -174,64 +352,184 @@ void PropellerLoader::prepare_entry()
     _error = NoError;
     _completed = 0;
     m_stat = 0;
+    _stage_times.clear();
 
     _command = 2*_write + _run;
 
-    QByteArray request = protocol.buildRequest((Command::Command) _command);
+    int payload_size = 0;
+    if (_template && _template->isCompatible(_image))
+    {
+        // a personalized image: re-encode only what differs from the
+        // template. This encodes the full image, not the minimized data,
+        // so it is neither looked up in nor stored in the cache.
+        _stream = PropellerEncoder();
+        _payload = _template->buildDownload(_image, (Command::Command) _command);
+        _payload_key.clear();
+        payload_size = _payload.size();
+    }
+    else
+    {
+        // send only what the Propeller can't reconstruct by itself
+        QByteArray data = PM::PayloadAnalyzer::minimize(_image);
+        QByteArray key = PM::PayloadCache::key(data, (Command::Command) _command);
+
+        if (key == _payload_key && !_payload.isEmpty())
+        {
+            // a retry, or the same image again: already encoded
+            _stream = PropellerEncoder();
+            payload_size = _payload.size();
+        }
+        else if (payloadCache().lookup(key, _payload))
+        {
+            _stream = PropellerEncoder();
+            _payload_key = key;
+            payload_size = _payload.size();
+        }
+        else if (_streaming)
+        {
+            _payload.clear();
+            _payload_key.clear();
+            _stream.start(protocol, data, (Command::Command) _command);
+            payload_size = _stream.size();
+        }
+        else
+        {
+            _stream = PropellerEncoder();
+            _payload = protocol.buildDownload(data, (Command::Command) _command);
+            _payload_key = key;
+            payloadCache().insert(key, _payload);
+            payload_size = _payload.size();
+        }
+    }
+
+    _payload_size = payload_size;
 
-    _payload = request;
+    // the overall deadline covers the reset and every stage this
+    // command will go through; each stage also has its own deadline.
+    PM::TransferModel & model = transferModel();
+    QString port = session->portName();
+    quint32 baud = session->baudRate();
 
+    int timeout_total = session->resetPeriod();
     if (_command > 0)
     {
-        _payload.append(protocol.encodeLong(_image.imageSize() / 4));
-        _payload.append(protocol.encodeData(_image.data()));
+        timeout_total += model.deadline(port, PM::TransferModel::Payload, payload_size, baud);
+        timeout_total += model.deadline(port, PM::TransferModel::VerifyRam, 0, baud);
+    }
+    else if (_probe)
+    {
+        timeout_total += model.probeDeadline(port,
+                protocol.requestSize((Command::Command) _command), baud);
+    }
+    else
+    {
+        timeout_total += model.deadline(port, PM::TransferModel::Handshake,
+                protocol.requestSize((Command::Command) _command), baud);
     }
 
-    int timeout_payload = session->calculateTimeout(_payload.size());
     if (_write)
-        timeout_payload += 5000; // ms (EEPROM write speed is constant.
-                                 // the Propeller firmware only does 32kB EEPROMs
-                                 // and this transaction is handled entirely by the firmware.
+    {
+        timeout_total += model.deadline(port, PM::TransferModel::WriteEeprom, 0, baud);
+        timeout_total += model.deadline(port, PM::TransferModel::VerifyEeprom, 0, baud);
+    }
+
+    if (_highspeed)
+    {
+        timeout_total += model.deadline(port, PM::TransferModel::Handshake, 12, baud);
+        timeout_total += model.deadline(port, PM::TransferModel::Payload,
+                _miniloader.bytesRemaining() + 4 * _miniloader.packetCount(), _highspeed_baud);
+        timeout_total += model.deadline(port, PM::TransferModel::VerifyRam,
+                PM::MiniLoader::max_payload, _highspeed_baud);
+
+        if (_miniloader.writesEeprom())
+        {
+            timeout_total += model.deadline(port, PM::TransferModel::WriteEeprom, 0, baud);
+            timeout_total += model.deadline(port, PM::TransferModel::VerifyEeprom, 0, baud);
+        }
+    }
 
+    _report.enter("reset");
+    totalTimeout.setInterval(timeout_total);
     session->reset();
 
-    totalTimeout.start(timeout_payload);
-    handshakeTimeout.start(session->calculateTimeout(request.size()));
+    // an XBee only queues the reset; wait until it has been applied
+    if (session->commandsPending())
+        connect(session, SIGNAL(commandsFinished(bool)), this, SLOT(reset_applied(bool)));
+    else
+        reset_applied(true);
+}
+
+/**
+  Start timing the download once the device has applied the reset, and
+  the baud rate set ahead of it.
+  */
+
+void PropellerLoader::reset_applied(bool ok)
+{
+    disconnect(session, SIGNAL(commandsFinished(bool)), this, SLOT(reset_applied(bool)));
+
+    if (!ok)
+    {
+        error("Couldn't reset device");
+        _error = UnknownError;
+        emit failure();
+        return;
+    }
+
+    totalTimeout.start();
     resetTimer.start(session->resetPeriod());
     elapsedTimer.start();
 }
 
 void PropellerLoader::handshake_read()
 {
-//    qDebug() << "BYTES" << session->bytesAvailable();
-    if (session->bytesAvailable() == protocol.reply().size() + 4)
+    if (_handshake.state() == PropellerHandshake::Matched
+            || _handshake.state() == PropellerHandshake::Mismatch)
+        return;
+
+    switch (_handshake.consume(session->readAll()))
     {
-        handshakeTimeout.stop();
-        if (session->read(protocol.reply().size()) != protocol.reply())
-        {
+        case PropellerHandshake::Mismatch:
+            handshakeTimeout.stop();
+            _handshake_time = handshakeTimer.elapsed();
+            message(QString("Handshake mismatch at byte %1 after %2 ms")
+                    .arg(_handshake.mismatchOffset())
+                    .arg(_handshake_time));
+
             _error = InvalidHandshakeError;
             emit failure();
-        }
+            break;
 
-        QByteArray versiondata = session->read(4);
+        case PropellerHandshake::Matched:
+            handshakeTimeout.stop();
+            _handshake_time = handshakeTimer.elapsed();
 
-        _version = 0;
-        for (int i = 0; i < 4; i++)
-        {
-            _version += (versiondata.at(i) & 1) +
-                        ((versiondata.at(i) >> 5) & 1);
-        }
+            // the reply completes once the handshake and the calibration
+            // bytes have been clocked out, ahead of the command; anything
+            // beyond that is adapter latency.
+            transferModel().observeLatency(session->portName(), _handshake_time
+                    - PM::TransferModel::transferTime(
+                        PropellerProtocol::handshakeSize(),
+                        session->baudRate()));
 
-        if (_version != 1)
-        {
-            _error = HandshakeError;
-            emit failure();
-        }
+            _stage_times[PM::TransferModel::Handshake] = handshakeTimer.nsecsElapsed() / 1000;
 
-        if (_command > 0)
-            emit handshake_received();
-        else
-            emit success();
+            _version = _handshake.version();
+            if (_version != 1)
+            {
+                _error = HandshakeError;
+                emit failure();
+                break;
+            }
+
+            if (_command > 0)
+                emit handshake_received();
+            else
+                emit success();
+            break;
+
+        default:
+            break;
     }
 }
 
@@ -243,11 +541,33 @@ void PropellerLoader::sendpayload_entry()
     connect(this,       SIGNAL(payload_sent()),         this, SLOT(upload_status()));
 
     session->clear();         // clear mysterious junk data that arrives just before this write().
-    session->write(_payload);
+
+    _handshake.reset();
+    _handshake_time = -1;
+    handshakeTimer.start();
+    _acks = 0;
+
+    PM::TransferModel & model = transferModel();
+    if (_command == 0 && _probe)
+        handshakeTimeout.start(model.probeDeadline(session->portName(),
+                    protocol.requestSize((Command::Command) _command), session->baudRate()));
+    else
+        handshakeTimeout.start(model.deadline(session->portName(), PM::TransferModel::Handshake,
+                    protocol.requestSize((Command::Command) _command), session->baudRate()));
+
+    if (_command > 0)
+        stageTimeout.start(model.deadline(session->portName(), PM::TransferModel::Payload,
+                    _payload_size, session->baudRate()));
+
+    if (_streaming)
+        session->write(_stream.read(_chunk_size));
+    else
+        session->write(_payload);
 }
 
 void PropellerLoader::sendpayload_exit()
 {
+    stageTimeout.stop();
     disconnect(this,    SIGNAL(handshake_received()),   this, SLOT(upload_status()));
     disconnect(this,    SIGNAL(payload_sent()),         this, SLOT(upload_status()));
     disconnect(session, SIGNAL(bytesWritten(qint64)),   this, SLOT(sendpayload_write()));
@@ -256,6 +576,14 @@ void PropellerLoader::sendpayload_exit()
 
 void PropellerLoader::sendpayload_write()
 {
+    if (!_stream.atEnd())
+    {
+        // keep at most two chunks queued for the device
+        if (session->bytesToWrite() < _chunk_size)
+            session->write(_stream.read(_chunk_size));
+        return;
+    }
+
     if (!session->bytesToWrite())
         emit payload_sent();
 }
@@ -266,32 +594,59 @@ void PropellerLoader::upload_status()
 
     if (_completed > 1)
     {
+        _stage_times[PM::TransferModel::Payload] = handshakeTimer.nsecsElapsed() / 1000;
         emit upload_completed();
     }
 }
 
 void PropellerLoader::acknowledge_entry()
 {
-    connect(session,    SIGNAL(readyRead()),this,   SLOT(acknowledge_read()));
-    connect(&poll,      SIGNAL(timeout()),  this,   SLOT(calibrate()));
-
-    poll.setInterval(20);
-    poll.start();
+    connect(session,    SIGNAL(readyRead()),            this,   SLOT(acknowledge_read()));
+    connect(session,    SIGNAL(bytesWritten(qint64)),   this,   SLOT(calibrate_written()));
+    connect(&poll,      SIGNAL(timeout()),              this,   SLOT(calibrate()));
+
+    // m_stat is only assigned after entry, so count acknowledgements instead
+    _stage = (PM::TransferModel::Stage) (PM::TransferModel::VerifyRam + _acks++);
+    stageTimeout.start(transferModel().deadline(session->portName(), _stage,
+                0, session->baudRate()));
+    stageTimer.start();
+
+    // the train goes out just before the stage usually completes
+    double expected = transferModel().stageTime(session->portName(), _stage);
+    _train_at = qMax((qint64) 0, (qint64) ((expected - _pulse_train_time) * 1000000));
+    _train_sent = false;
+
+    _pulsing = true;
+    calibrate();
 }
 
 void PropellerLoader::acknowledge_exit()
 {
-    disconnect(&poll,   SIGNAL(timeout()),  this,   SLOT(calibrate()));
-    disconnect(session, SIGNAL(readyRead()),this,   SLOT(acknowledge_read()));
+    _pulsing = false;
+    poll.stop();
+    stageTimeout.stop();
+    disconnect(&poll,   SIGNAL(timeout()),              this,   SLOT(calibrate()));
+    disconnect(&poll,   SIGNAL(timeout()),              this,   SLOT(acknowledge_drained()));
+    disconnect(session, SIGNAL(bytesWritten(qint64)),   this,   SLOT(calibrate_written()));
+    disconnect(session, SIGNAL(bytesWritten(qint64)),   this,   SLOT(acknowledge_drained()));
+    disconnect(session, SIGNAL(readyRead()),            this,   SLOT(acknowledge_read()));
 }
 
 void PropellerLoader::acknowledge_read()
 {
+    // already acknowledged and draining the last pulse train
+    if (!_pulsing)
+        return;
+
     if (session->bytesAvailable())
     {
-        _ack = QString(session->readAll().data()).toInt();
+        // leave anything after the acknowledgement for the miniloader
+        QByteArray reply = _highspeed ? session->read(1) : session->readAll();
+        _ack = QString(reply.data()).toInt();
 
+        _pulsing = false;
         poll.stop();
+        _stage_times[_stage] = stageTimer.nsecsElapsed() / 1000;
 //        message(QString("ACK: %1").arg(_ack));
         if (_ack)
         {
@@ -306,295 +661,710 @@ void PropellerLoader::acknowledge_read()
         }
         else
         {
-            if ((m_stat == 3 && _write) 
-                    || (m_stat == 1 && !_write))
-            {
-                if (_run && _write)
-                    session->reset();
+            PM::TransferModel & model = transferModel();
+            model.observeStage(session->portName(), _stage,
+                    _stage_times[_stage] / 1000.0 - model.latency(session->portName()));
 
-                emit success();
-            }
-            else
-            {
-                emit acknowledged();
-            }
+            stageTimeout.stop();
+            disconnect(&poll,   SIGNAL(timeout()),              this,   SLOT(calibrate()));
+            disconnect(session, SIGNAL(bytesWritten(qint64)),   this,   SLOT(calibrate_written()));
+            connect(session,    SIGNAL(bytesWritten(qint64)),   this,   SLOT(acknowledge_drained()));
+            connect(&poll,      SIGNAL(timeout()),              this,   SLOT(acknowledge_drained()));
+
+            acknowledge_drained();
         }
     }
 }
 
+/**
+  Move on from an acknowledged stage once the calibration pulses already
+  written have been clocked out. Otherwise they would reach the
+  Propeller after it has moved on, and end up in front of the miniloader
+  or the downloaded program.
+  */
+
+void PropellerLoader::acknowledge_drained()
+{
+    if (session->bytesToWrite())
+        return;
+
+    qint64 remaining = _train_end - stageTimer.nsecsElapsed();
+    if (remaining > 0)
+    {
+        poll.start((int) ((remaining + 999999) / 1000000));
+        return;
+    }
+
+    disconnect(&poll,   SIGNAL(timeout()),              this,   SLOT(acknowledge_drained()));
+    disconnect(session, SIGNAL(bytesWritten(qint64)),   this,   SLOT(acknowledge_drained()));
+
+    if (m_stat == 1 && _highspeed)
+    {
+        emit loader_started();
+    }
+    else if ((m_stat == 3 && _write) 
+            || (m_stat == 1 && !_write))
+    {
+        if (_run && _write)
+            session->reset();
+
+        emit success();
+    }
+    else
+    {
+        emit acknowledged();
+    }
+}
+
 /**
   Upload a PropellerImage object to the target.
 
   \param image The PropellerImage to upload.
   \param write Write the image to the EEPROM.
   \param run Run the image after downloading.
+  \param wait Block in a nested event loop until the upload finishes.
+
+  \see uploadAsync()
   */
 
 bool PropellerLoader::upload(PropellerImage image, bool write, bool run, bool wait)
 {
-    if (!session->reserve())
-    {
-        error("Device is busy");
+    if (begin(image, write, run) != NoError)
         return false;
+
+    if (wait)
+    {
+        QEventLoop loop;
+        connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
+        loop.exec();
     }
 
-    if (!session->isOpen())
+    return true;
+}
+
+/**
+  Start uploading a PropellerImage object to the target without blocking.
+
+  \return A task that finishes with the outcome of the upload, including
+  failures to start it.
+  */
+
+PropellerTask * PropellerLoader::uploadAsync(PropellerImage image, bool write, bool run)
+{
+    PropellerTask * task = new PropellerTask(this);
+
+    LoaderError e = begin(image, write, run);
+    if (e != NoError)
+        task->finish(result(e));
+    else
+        _task = task;
+
+    return task;
+}
+
+/**
+  Start querying the version of the connected device without blocking.
+
+  \param probe Give up as soon as a Propeller would have answered, using
+  PM::TransferModel::probeDeadline() rather than the usual handshake
+  deadline. This suits scanning ports that may have nothing attached.
+  \param refresh Query the device even if its version is cached by
+  PropellerManager.
+
+  \return A task whose result carries the version, or 0 if not found.
+  */
+
+PropellerTask * PropellerLoader::identify(bool probe, bool refresh)
+{
+    PropellerTask * task = new PropellerTask(this);
+
+    int version;
+    if (!refresh && _manager->lookupIdentity(session->portName(), &version))
     {
-        error("Device not open");
-        return false;
+        PropellerResult r = result(NoError);
+        r.version = version;
+        r.cached = true;
+        r.report = PM::LoaderReport();
+        task->finish(r);
+        return task;
     }
-    
-    if (machine.isRunning())
+
+    if (machine.isRunning() || _ticket || retryTimer.isActive())
+    {
+        task->finish(result(DownloadInProgressError));
+        return task;
+    }
+
+    _task = task;
+    _probe = probe;
+    startVersion();
+
+    return task;
+}
+
+/**
+  Validate the request and start the state machine for an upload.
+  */
+
+PropellerLoader::LoaderError PropellerLoader::begin(PropellerImage & image, bool write, bool run)
+{
+    if (machine.isRunning() || _ticket || retryTimer.isActive())
     {
         error("Download already in progress");
-        return false;
+        return DownloadInProgressError;
+    }
+
+    if (!session->reserve())
+    {
+        if (_queueing)
+            _ticket = _manager->queueReservation(session, this, "start_queued", _priority);
+
+        if (!_ticket)
+        {
+            error(_queueing ? "Device is busy and its queue is full" : "Device is busy");
+            return DeviceBusyError;
+        }
+
+        message(QString("Queued behind %1 other uploads")
+                .arg(_manager->queueDepth(session->portName()) - 1));
+
+        _queued_image = image;
+        _queued_write = write;
+        _queued_run = run;
+        return NoError;
+    }
+
+    if (!session->isOpen())
+    {
+        error("Device not open");
+        session->release();
+        return DeviceNotOpenError;
     }
 
     if (!image.isValid())
     {
         error("Image is invalid");
-        return false;
+        session->release();
+        return InvalidImageError;
     }
 
     if (!session->setBaudRate(115200))
     {
         error("Couldn't set baud rate");
-        return false;
+        session->release();
+        return UnknownError;
+    }
+
+    _initial_baud = 115200;
+
+    _delta_failed = false;
+    planDownload(image, write, run);
+
+    if (PM::XBeeDevice::isXBee(session->portName()) && !_highspeed)
+    {
+        error("XBee downloads must run the image through the miniloader");
+        session->release();
+        return InvalidImageError;
     }
 
-    _image = image;
-    _write = write;
-    _run = run;
+    _retries.clear();
+    _report.start(session->portName(), _initial_baud);
+    if (_highspeed)
+        _report.finalBaudRate = _highspeed_baud;
 
     machine.setInitialState(s_active);
     machine.start();
 
-    if (wait)
+    return NoError;
+}
+
+/**
+  Return whether a download of image would be offered to the miniloader
+  on this loader's port. It still goes out with the standard protocol if
+  baudPlanner() finds no rate it considers safe.
+
+  The miniloader always launches what it receives, so only downloads
+  that run the image can use it; anything else, in particular command 0,
+  goes out unchanged with the standard protocol. Writes that run the
+  image go through the miniloader as well in delta write mode, unless a
+  delta write of this upload already failed.
+  */
+
+bool PropellerLoader::usesMiniLoader(PropellerImage & image, bool write, bool run)
+{
+    bool delta = write && run && _delta_write && !_delta_failed;
+    bool xbee = PM::XBeeDevice::isXBee(session->portName());
+
+    return (_use_highspeed || xbee) && run && (!write || delta)
+        && PM::MiniLoader::isSupported(image);
+}
+
+/**
+  Choose between the standard protocol and the miniloader for image, and
+  prepare what the state machine will send.
+  */
+
+void PropellerLoader::planDownload(PropellerImage & image, bool write, bool run)
+{
+    _highspeed = false;
+    _highspeed_baud = 0;
+
+    PM::BaudPlanner::Plan plan;
+    if (usesMiniLoader(image, write, run))
     {
-        QEventLoop loop;
-        connect(this, SIGNAL(finished()), &loop, SLOT(quit()));
-        loop.exec();
+        plan = baudPlanner().plan(session->portName(),
+                image.clockFrequency(),
+                PM::BaudPlanner::adapter(QSerialPortInfo(session->portName()).vendorIdentifier()),
+                _initial_baud);
+
+        _highspeed = plan.isValid();
+        _highspeed_baud = plan.finalBaudRate;
+    }
+
+    if (_highspeed)
+    {
+        // deliver the miniloader with the standard protocol; it then
+        // receives the image itself at the planned baud rate.
+        _target = image;
+        _image = _miniloader.start(image, plan, write);
+        _write = false;
+        _run = true;
+    }
+    else
+    {
+        _image = image;
+        _write = write;
+        _run = run;
     }
+}
+
+/**
+  Schedule another attempt at a failed upload if retryPolicy() allows
+  one for its error. The port stays reserved in the meantime.
+
+  Version queries are not retried, as a port without a Propeller would
+  only fail again, and neither are XBee downloads once only the basic
+  protocol is left for them.
+  */
+
+bool PropellerLoader::retry()
+{
+    if (_command == 0 || _error == CancelledError
+            || _retries.value(_error) >= _retry_policy.budget(_error))
+        return false;
 
+    // plan the next attempt now, so a rate that keeps failing gives way
+    // to a slower one, and a failed delta write to a standard write.
+    if (_highspeed)
+    {
+        planDownload(_target, _miniloader.writesEeprom(), true);
+        _report.finalBaudRate = _highspeed ? _highspeed_baud : _initial_baud;
+
+        if (!_highspeed && PM::XBeeDevice::isXBee(session->portName()))
+            return false;
+    }
+
+    _retries[_error]++;
+
+    int attempt = _report.attempts();
+    int backoff = _retry_policy.backoff(attempt);
+
+    message(QString("%1 on attempt %2; retrying in %3 ms")
+            .arg(errorStrings().value(_error))
+            .arg(attempt)
+            .arg(backoff));
+
+    setProperty("status", tr("%1, retrying...")
+            .arg(errorStrings().value(_error)));
+
+    _report.retry(_error, backoff);
+    _report.enter("backoff");
+    retryTimer.start(backoff);
     return true;
 }
 
+/**
+  Start the next attempt, as planned by retry(), from the reset.
+  */
+
+void PropellerLoader::retry_start()
+{
+    _report.exit("backoff");
+
+    machine.setInitialState(s_active);
+    machine.start();
+}
+
+/**
+  Start the queued upload once the manager has reserved the port for it.
+  */
+
+void PropellerLoader::start_queued()
+{
+    if (!_ticket)
+        return;
+
+    _ticket = 0;
+
+    LoaderError e = begin(_queued_image, _queued_write, _queued_run);
+    _queued_image = PropellerImage();
+
+    if (e != NoError)
+    {
+        _error = e;
+        emit finished();
+    }
+}
+
+/**
+  Cancel the upload, whether it is still queued or already running.
+  The upload finishes with CancelledError.
+  */
+
+void PropellerLoader::cancel()
+{
+    if (_ticket)
+    {
+        // already handed the port, but not yet started
+        if (!_manager->cancelReservation(_ticket))
+            session->release();
+
+        _ticket = 0;
+        _queued_image = PropellerImage();
+
+        _error = CancelledError;
+        _report.start(session->portName(), session->baudRate());
+        _report.finish(false, _error);
+        emit finished();
+    }
+    else if (machine.isRunning())
+    {
+        _error = CancelledError;
+        emit failure();
+    }
+    else if (retryTimer.isActive())
+    {
+        retryTimer.stop();
+        _error = CancelledError;
+        failure_entry();
+    }
+}
+
+/**
+  Return the loader to its default settings between jobs, as
+  PropellerManager does for pooled loaders. The port, the shared caches
+  and anything learned about the port are kept.
+  */
+
+void PropellerLoader::restoreDefaults()
+{
+    cancel();
+
+    _template = 0;
+    _streaming = false;
+    _use_highspeed = false;
+    _delta_write = false;
+    _priority = 0;
+    _queueing = true;
+    _retry_policy = PM::RetryPolicy();
+    _task = 0;
+
+    _error = NoError;
+    _version = 0;
+    _probe = false;
+    _handshake_time = -1;
+    _stage_times.clear();
+}
+
+QString PropellerLoader::portName()
+{
+    return session->portName();
+}
+
+/**
+  Return whether the upload is waiting for its port.
+  */
+
+bool PropellerLoader::isQueued()
+{
+    return _ticket != 0;
+}
+
+int PropellerLoader::priority()
+{
+    return _priority;
+}
+
+/**
+  Set the priority of later uploads in the queue of a reserved port.
+  Higher priorities are served first; the default is 0.
+  */
+
+void PropellerLoader::setPriority(int priority)
+{
+    _priority = priority;
+}
+
+bool PropellerLoader::queueing()
+{
+    return _queueing;
+}
+
+/**
+  Queue uploads to a reserved port instead of failing with
+  DeviceBusyError. Queueing is enabled by default.
+  */
+
+void PropellerLoader::setQueueing(bool enabled)
+{
+    _queueing = enabled;
+}
+
+PM::RetryPolicy PropellerLoader::retryPolicy()
+{
+    return _retry_policy;
+}
+
+/**
+  Set which failed uploads are retried, and how soon. Pass
+  PM::RetryPolicy::none() to fail on the first error.
+
+  Streaming downloads are encoded again on each attempt, as no full copy
+  of the stream is kept.
+  */
+
+void PropellerLoader::setRetryPolicy(const PM::RetryPolicy & policy)
+{
+    _retry_policy = policy;
+}
+
+PropellerResult PropellerLoader::result(LoaderError e)
+{
+    PropellerResult r;
+    r.error = e;
+    r.errorString = errorStrings().value(e);
+    r.portName = session->portName();
+    r.version = _version;
+    r.report = _report;
+    return r;
+}
+
+void PropellerLoader::finish_task()
+{
+    if (!_task)
+        return;
+
+    _task->finish(result(_error));
+    _task = 0;
+}
+
+void PropellerLoader::highspeed_entry()
+{
+    _highspeed_switched = false;
+    connect(session,    SIGNAL(readyRead()),    this, SLOT(highspeed_read()));
+
+    // overdue replies are retried rather than failing the download
+    disconnect(&stageTimeout, SIGNAL(timeout()), this, SLOT(timeover()));
+    connect(&stageTimeout,    SIGNAL(timeout()), this, SLOT(highspeed_timeout()));
+
+    // the miniloader announces itself at the initial baud rate
+    // once the line has been idle for eight byte periods.
+    stageTimeout.start(transferModel().deadline(session->portName(),
+                PM::TransferModel::Handshake, 12, _initial_baud));
+
+    if (session->bytesAvailable())
+        highspeed_read();
+}
+
+void PropellerLoader::highspeed_exit()
+{
+    stageTimeout.stop();
+    poll.stop();
+    disconnect(session, SIGNAL(commandsFinished(bool)), this, SLOT(highspeed_baud_set(bool)));
+    disconnect(session, SIGNAL(readyRead()),            this, SLOT(highspeed_read()));
+    disconnect(session, SIGNAL(bytesWritten(qint64)),   this, SLOT(highspeed_written()));
+    disconnect(&poll,   SIGNAL(timeout()),              this, SLOT(highspeed_written()));
+
+    disconnect(&stageTimeout, SIGNAL(timeout()), this, SLOT(highspeed_timeout()));
+    connect(&stageTimeout,    SIGNAL(timeout()), this, SLOT(timeover()));
+
+    session->setBaudRate(_initial_baud);
+}
+
+void PropellerLoader::highspeed_read()
+{
+    PM::MiniLoader::Phase phase = _miniloader.phase();
+
+    if (!_miniloader.consume(session->readAll()))
+        return;
+
+    if (phase == PM::MiniLoader::SyncEeprom && _miniloader.pagesWritten() >= 0)
+    {
+        _report.exit("sync-eeprom");
+        message(QString("%1 of %2 EEPROM pages written")
+                .arg(_miniloader.pagesWritten())
+                .arg(PM::MiniLoader::eeprom_pages));
+    }
+    else if (phase != PM::MiniLoader::SyncEeprom
+            && _miniloader.phase() == PM::MiniLoader::SyncEeprom)
+    {
+        _report.enter("sync-eeprom");
+        setProperty("status", tr("Writing to EEPROM..."));
+    }
+
+    highspeed_send();
+}
+
+void PropellerLoader::highspeed_timeout()
+{
+    if (!_miniloader.expire())
+    {
+        timeover();
+        return;
+    }
+
+    message(QString("No reply from miniloader; resending (retry %1)")
+            .arg(_miniloader.retries()));
+
+    highspeed_send();
+}
+
+void PropellerLoader::highspeed_send()
+{
+    PM::MiniLoader::Phase phase = _miniloader.phase();
+
+    if (phase == PM::MiniLoader::Failed)
+    {
+        message(QString("Miniloader failed in phase %1 after %2 retries")
+                .arg(_miniloader.failedPhase())
+                .arg(_miniloader.retries()));
+
+        if (_miniloader.failedPhase() == PM::MiniLoader::VerifyRam)
+            _error = VerifyRamError;
+        else if (_miniloader.failedPhase() == PM::MiniLoader::LoadDriver
+                || _miniloader.failedPhase() == PM::MiniLoader::SyncEeprom)
+            _error = (_miniloader.failedPage() < 0) ? WriteEepromError : VerifyEepromError;
+        else
+            _error = UnknownError;
+
+        if (_miniloader.failedPage() >= 0)
+            message(QString("EEPROM page %1 failed to verify")
+                    .arg(_miniloader.failedPage()));
+
+        // the board may not have the EEPROM the driver expects
+        if (_error == WriteEepromError || _error == VerifyEepromError)
+            _delta_failed = true;
+
+        emit failure();
+        return;
+    }
+
+    if (session->baudRate() != _highspeed_baud)
+    {
+        _highspeed_switched = true;
+        if (!session->setBaudRate(_highspeed_baud))
+        {
+            error("Couldn't set baud rate");
+            _error = UnknownError;
+            emit failure();
+            return;
+        }
+
+        // an XBee changes rate asynchronously; send once it has
+        if (session->commandsPending())
+        {
+            stageTimeout.stop();
+            connect(session, SIGNAL(commandsFinished(bool)), this, SLOT(highspeed_baud_set(bool)));
+            return;
+        }
+    }
 
-//bool PropellerLoader::highSpeedUpload(PropellerImage image, bool write, bool run)
-//{
-//    QFile file("miniloaders/miniloader.binary");
-//
-//    if (!file.open(QIODevice::ReadOnly))
-//        return false;
-//
-//    PropellerImage loader(file.readAll());
-//
-//    // SPLIT ALL PACKETS
-//
-//    /*
-//    QMap<quint32, QByteArray> pieces;
-//
-//    int last = 0;
-//    quint32 lastvalue = 0;
-//    for (int i = 0; i < loader.imageSize(); i += 4)
-//    {
-//        quint32 value = loader.readLong(i);
-//        if ((value & 0xFFFFFFF0) == 0x11111110)
-//        {
-//
-//            if (value != 0x11111110)
-//            {
-//                pieces[lastvalue] = loader.data().mid(last, i-last);
-//                last = i+4;
-//            }
-//            else
-//            {
-//                pieces[lastvalue] = loader.data().mid(last, i-last);
-//                last = i;
-//            }
-//            lastvalue = value;
-//        }
-//    }
-//    
-//    if ((loader.imageSize() - last) > 0)
-//        pieces[lastvalue] = loader.data().mid(last, loader.imageSize() - last);
-//
-//    foreach (quint32 v, pieces.keys())
-//        qDebug() << QString::number(v,16) << pieces[v].toHex();
-//
-//
-//    // GENERATE HOST INITIALIZED VALUES
-//
-//    quint32 maxRxSenseError = 23; // maximum number of cycles by which the detection of a start bit could be off (SHOULD BE AUTO CALCULATED?!?)
-//
-//    quint32 clkfreq = image.clockFrequency();
-//
-//    quint32 initialbaud = 115200;
-//    quint32 initialperiod = clkfreq / initialbaud;
-//
-//    quint32 finalbaud = 460800; // 921600
-//    quint32 finalperiod = clkfreq / finalbaud;
-//
-//    quint32 errorperiod = ((1.5 * clkfreq) / finalbaud) - maxRxSenseError;  // no idea what this does
-//    quint32 timeout_failsafe = (2 * clkfreq / (3 * 4));                     //
-//    quint32 timeout_endofpacket = (2 * finalperiod * 10 / 12);              //
-//
-//    quint32 total_packet_count = image.imageSize() / (Propeller::_max_data_size - 4); // binary image / (max XBee packet - packet header)
-//    quint32 packetid = total_packet_count;
-//
-//
-//    // INJECT HOST VALUES INTO IMAGE AND MOVE SPIN CODE
-//
-//    PropellerImage l(pieces[0x11111110]);
-//
-//    l.writeLong(4+0, initialperiod);
-//    l.writeLong(4+4, finalperiod);
-//    l.writeLong(4+8, errorperiod);
-//    l.writeLong(4+12, timeout_failsafe);
-//    l.writeLong(4+16, timeout_endofpacket);
-//    l.writeLong(4+20, packetid);
-//
-//    QByteArray newdata = pieces[0x0];
-//    QByteArray spincode = pieces[pieces.lastKey()].right(8);
-//    pieces[pieces.lastKey()].chop(8);
-//
-//    newdata.append(l.data());
-//    newdata.append(spincode);
-//
-//    l.setData(newdata);
-//
-//
-//    // MAGIC TRANSFORMATION
-//
-//    int removedbytes = loader.imageSize() - l.imageSize();
-//    qDebug() << removedbytes;
-//
-//    for (int i = 8; i <= 14; i += 2)
-//        l.writeWord(i, l.readWord(i) - removedbytes);
-//
-//    qDebug() << "SPIN METHODS??" << l.readWord(18) << l.readWord(18)-1;
-//    for (int i = 0; i <= (l.readWord(18)-1); i++)
-//    {
-//        int offset = 16+i*4;
-//        qDebug() << offset << l.readWord(offset);
-//        l.writeWord(offset, l.readWord(offset) - removedbytes);
-//        qDebug() << offset << l.readWord(offset);
-//    }
-//
-//
-//
-//    // finalize loader image
-//
-//    loader.setData(newdata);
-//    loader.recalculateChecksum();
-//
-//    qDebug() << loader.checksumIsValid();
-//    qDebug() << loader.isValid();
-//
-//
-//    qDebug() << loader.data().size() << loader.data().toHex();
-//
-//    QByteArray dataz = loader.data();
-//    QByteArray pretty = dataz.toHex().toUpper();
-//    for (int i = 0 ; i < pretty.size() ; i++)
-//    {
-//        printf("%c",(unsigned char) pretty[i]);
-//        if (i % 2 == 1)
-//            printf("\n");
-//    }
-//
-//    */
-//
-//    // GENERATE HOST INITIALIZED VALUES
-//
-//    quint32 maxRxSenseError = 23; // maximum number of cycles by which the detection of a start bit could be off (SHOULD BE AUTO CALCULATED?!?)
-//
-//    quint32 clkfreq = image.clockFrequency();
-//
-//    quint32 initialbaud = 115200;
-//    quint32 initialperiod = clkfreq / initialbaud;
-//
-//    quint32 finalbaud = 460800; // 921600
-//    quint32 finalperiod = clkfreq / finalbaud;
-//
-//    quint32 errorperiod = ((1.5 * clkfreq) / finalbaud) - maxRxSenseError;  // no idea what this does
-//    quint32 timeout_failsafe = (2 * clkfreq / (3 * 4));                     //
-//    quint32 timeout_endofpacket = (2 * finalperiod * 10 / 12);              //
-//
-//    int total_packet_count = image.imageSize() / (Propeller::_max_data_size - 4) + 1; // binary image / (max XBee packet - packet header)
-//    quint32 packetid = total_packet_count;
-//
-//
-//    const quint8 rawLoaderImage[348] = {
-//        0x00,0xB4,0xC4,0x04,0x6F,0xC3,0x10,0x00,0x5C,0x01,0x64,0x01,0x54,0x01,0x68,0x01,
-//        0x4C,0x01,0x02,0x00,0x44,0x01,0x00,0x00,0x48,0xE8,0xBF,0xA0,0x48,0xEC,0xBF,0xA0,
-//        0x49,0xA0,0xBC,0xA1,0x01,0xA0,0xFC,0x28,0xF1,0xA1,0xBC,0x80,0xA0,0x9E,0xCC,0xA0,
-//        0x49,0xA0,0xBC,0xF8,0xF2,0x8F,0x3C,0x61,0x05,0x9E,0xFC,0xE4,0x04,0xA4,0xFC,0xA0,
-//        0x4E,0xA2,0xBC,0xA0,0x08,0x9C,0xFC,0x20,0xFF,0xA2,0xFC,0x60,0x00,0xA3,0xFC,0x68,
-//        0x01,0xA2,0xFC,0x2C,0x49,0xA0,0xBC,0xA0,0xF1,0xA1,0xBC,0x80,0x01,0xA2,0xFC,0x29,
-//        0x49,0xA0,0xBC,0xF8,0x48,0xE8,0xBF,0x70,0x11,0xA2,0x7C,0xE8,0x0A,0xA4,0xFC,0xE4,
-//        0x4A,0x92,0xBC,0xA0,0x4C,0x3C,0xFC,0x50,0x54,0xA6,0xFC,0xA0,0x53,0x3A,0xBC,0x54,
-//        0x53,0x56,0xBC,0x54,0x53,0x58,0xBC,0x54,0x04,0xA4,0xFC,0xA0,0x00,0xA8,0xFC,0xA0,
-//        0x4C,0x9E,0xBC,0xA0,0x4B,0xA0,0xBC,0xA1,0x00,0xA2,0xFC,0xA0,0x80,0xA2,0xFC,0x72,
-//        0xF2,0x8F,0x3C,0x61,0x21,0x9E,0xF8,0xE4,0x31,0x00,0x78,0x5C,0xF1,0xA1,0xBC,0x80,
-//        0x49,0xA0,0xBC,0xF8,0xF2,0x8F,0x3C,0x61,0x00,0xA3,0xFC,0x70,0x01,0xA2,0xFC,0x29,
-//        0x26,0x00,0x4C,0x5C,0x51,0xA8,0xBC,0x68,0x08,0xA8,0xFC,0x20,0x4D,0x3C,0xFC,0x50,
-//        0x1E,0xA4,0xFC,0xE4,0x01,0xA6,0xFC,0x80,0x19,0x00,0x7C,0x5C,0x1E,0x9E,0xBC,0xA0,
-//        0xFF,0x9F,0xFC,0x60,0x4C,0x9E,0x7C,0x86,0x00,0x84,0x68,0x0C,0x4E,0xA8,0x3C,0xC2,
-//        0x09,0x00,0x54,0x5C,0x01,0x9C,0xFC,0xC1,0x55,0x00,0x70,0x5C,0x55,0xA6,0xFC,0x84,
-//        0x40,0xAA,0x3C,0x08,0x04,0x80,0xFC,0x80,0x43,0x74,0xBC,0x80,0x3A,0xA6,0xFC,0xE4,
-//        0x55,0x74,0xFC,0x54,0x09,0x00,0x7C,0x5C,0x00,0x00,0x00,0x00,0x00,0x00,0x00,0x00,
-//        0x80,0x00,0x00,0x00,0x00,0x02,0x00,0x00,0x00,0x80,0x00,0x00,0xFF,0xFF,0xF9,0xFF,
-//        0x10,0xC0,0x07,0x00,0x00,0x00,0x00,0x80,0x00,0x00,0x00,0x40,0xB6,0x02,0x00,0x00,
-//        0x5B,0x01,0x00,0x00,0x08,0x02,0x00,0x00,0x55,0x73,0xCB,0x00,0x50,0x45,0x01,0x00,
-//        0x00,0x00,0x00,0x00,0x35,0xC7,0x08,0x35,0x2C,0x32,0x00,0x00
-//    };
-//
-//    QByteArray _loader((char*) rawLoaderImage, 348);
-//
-//    const int offset = 348 - 8*4; // offset from end
-//
-//    loader.setData(_loader);
-//
-//    loader.writeLong(offset+0, initialperiod);
-//    loader.writeLong(offset+4, finalperiod);
-//    loader.writeLong(offset+8, errorperiod);
-//    loader.writeLong(offset+12, timeout_failsafe);
-//    loader.writeLong(offset+16, timeout_endofpacket);
-//    loader.writeLong(offset+20, packetid);
-//
-//    loader.recalculateChecksum();
-//
-//    upload(loader, write, run);
-//
-//
-//
-//    session->setBaudRate(finalbaud);
-//
-//    QByteArray data = image.data();
-//    qDebug() << data.size();
-//
-//    int maxsize = Propeller::_max_data_size - 4;
-//
-//    qDebug() << "DOWNLOADING";
-//    for (int i = total_packet_count ; i > 0 ; i--)
-//    {
-//        qDebug() << "ASSEMBLE";
-//        QByteArray payload;
-//        payload.append(protocol.packLong(i));
-//        payload.append(data.left(maxsize));
-//
-//        qDebug() << payload.size();
-//
-////        sendPayload(payload);
-//        qDebug() << "RETURN FROM PAYHLOAD";
-//    }
-//
-//
-////    upload(image, write, run);
-////
-//    return true;
-//}
+    QByteArray packet = _miniloader.packet();
+
+    if (phase == PM::MiniLoader::SyncEeprom)
+    {
+        // the driver reads every page and may write them all
+        stageTimeout.start(
+                transferModel().deadline(session->portName(),
+                    PM::TransferModel::WriteEeprom, packet.size(), _highspeed_baud)
+                + transferModel().deadline(session->portName(),
+                    PM::TransferModel::VerifyEeprom, 0, _highspeed_baud));
+    }
+    else
+    {
+        stageTimeout.start(transferModel().deadline(session->portName(),
+                    phase == PM::MiniLoader::VerifyRam
+                        ? PM::TransferModel::VerifyRam
+                        : PM::TransferModel::Payload,
+                    packet.size(), _highspeed_baud));
+    }
+
+    // the final launch packet is not acknowledged
+    if (phase == PM::MiniLoader::LaunchFinal)
+    {
+        _launch_end = elapsedTimer.nsecsElapsed()
+            + (qint64) (PM::TransferModel::transferTime(packet.size(), _highspeed_baud) * 1000000);
+
+        connect(session, SIGNAL(bytesWritten(qint64)), this, SLOT(highspeed_written()));
+        connect(&poll,   SIGNAL(timeout()),            this, SLOT(highspeed_written()));
+    }
+
+    session->write(packet);
+}
+
+void PropellerLoader::highspeed_baud_set(bool ok)
+{
+    disconnect(session, SIGNAL(commandsFinished(bool)), this, SLOT(highspeed_baud_set(bool)));
+
+    if (!ok)
+    {
+        error("Couldn't set baud rate");
+        _error = UnknownError;
+        emit failure();
+        return;
+    }
+
+    highspeed_send();
+}
+
+/**
+  Finish once the final launch packet has left the adapter, not merely
+  the driver: highspeed_exit() changes the baud rate back, which would
+  cut off whatever the adapter is still clocking out.
+  */
+
+void PropellerLoader::highspeed_written()
+{
+    if (session->bytesToWrite())
+        return;
+
+    qint64 remaining = _launch_end - elapsedTimer.nsecsElapsed();
+    if (remaining > 0)
+        poll.start((int) ((remaining + 999999) / 1000000));
+    else
+        emit success();
+}
+
+void PropellerLoader::reset_finished()
+{
+    _report.exit("reset");
+}
+
+void PropellerLoader::report_entered()
+{
+    _report.enter(sender()->objectName());
+}
+
+void PropellerLoader::report_exited()
+{
+    _report.exit(sender()->objectName());
+}
+
+void PropellerLoader::report_written(qint64 bytes)
+{
+    if (machine.isRunning())
+        _report.written(bytes);
+}
 
 void PropellerLoader::timestamp()
 {
@@ -611,5 +1381,185 @@ void PropellerLoader::timeover()
 
 QString PropellerLoader::versionString(int version)
 {
-    return _versionstrings[version];
+    return versionStrings().value(version);
+}
+
+/**
+  Enable or disable streaming downloads.
+
+  When streaming, the download is encoded in chunks as the device
+  reports bytes written, so the handshake is transmitted while the
+  rest of the image is still being translated, and only a bounded
+  amount of the encoded stream is held in memory.
+
+  Streaming is disabled by default.
+  */
+
+void PropellerLoader::setStreaming(bool enabled)
+{
+    _streaming = enabled;
+}
+
+bool PropellerLoader::streaming()
+{
+    return _streaming;
+}
+
+/**
+  Return the time in milliseconds from the start of transmission until
+  the handshake reply was accepted or rejected by the last download,
+  or -1 if no reply was resolved before the timeout.
+  */
+
+qint64 PropellerLoader::handshakeTime()
+{
+    return _handshake_time;
+}
+
+/**
+  Return the timing record of the last upload or version query. It is
+  complete once finished() has been emitted, and is also delivered by
+  reported() just before it.
+  */
+
+PM::LoaderReport PropellerLoader::report()
+{
+    return _report;
+}
+
+/**
+  Return the time in microseconds that stage took in the last download,
+  or -1 if it was not reached.
+
+  The handshake and payload stages are timed from the start of
+  transmission. Each acknowledged stage is timed from its first
+  calibration pulse until its reply arrived.
+  */
+
+qint64 PropellerLoader::stageTime(PM::TransferModel::Stage stage)
+{
+    return _stage_times.value(stage, -1);
+}
+
+/**
+  Encode compatible images incrementally from base instead of in full.
+  A compatible image is checked against base before anything else, and
+  bypasses the payload cache entirely: it is not hashed, and counts as
+  neither a hit nor a miss.
+
+  Pass 0 to stop using a template. The loader does not take ownership
+  of base.
+
+  \see PropellerTemplate
+  */
+
+void PropellerLoader::setTemplate(PropellerTemplate * base)
+{
+    _template = base;
+}
+
+PropellerTemplate * PropellerLoader::templateImage()
+{
+    return _template;
+}
+
+/**
+  Return the cache of encoded download streams shared by all loaders.
+
+  Use PM::PayloadCache::hits() and PM::PayloadCache::misses() to
+  confirm repeated downloads are served from the cache. Streaming
+  downloads use cached streams but do not add to the cache.
+  */
+
+PM::PayloadCache & PropellerLoader::payloadCache()
+{
+    static PM::PayloadCache cache;
+    return cache;
+}
+
+/**
+  Return the download timing model shared by all loaders.
+
+  Every stage of a download gets a deadline derived from the bytes sent
+  at the current baud rate, plus the adapter latency and EEPROM timings
+  learned from earlier downloads on the same port. Use
+  PM::TransferModel::setMargin() to loosen or tighten deadlines.
+  */
+
+PM::TransferModel & PropellerLoader::transferModel()
+{
+    static PM::TransferModel model;
+    return model;
+}
+
+/**
+  Enable or disable high-speed downloads.
+
+  When enabled, images that run from a crystal or external clock and are
+  not being written to EEPROM, or are written in delta write mode, are
+  delivered by the miniloader: a small loader is sent with the standard
+  protocol, which then receives the image in acknowledged packets at the
+  fastest rate baudPlanner() finds safe for the port.
+
+  High-speed downloads are disabled by default, as the miniloader has not
+  yet been verified on hardware. XBee devices use it regardless, since
+  the standard protocol cannot recover a lost datagram.
+  */
+
+void PropellerLoader::setHighSpeed(bool enabled)
+{
+    _use_highspeed = enabled;
+}
+
+bool PropellerLoader::highSpeed()
+{
+    return _use_highspeed;
+}
+
+/**
+  Enable or disable delta writes to EEPROM.
+
+  When enabled, and high-speed downloads are too, an image that is
+  written to EEPROM and run is delivered by the miniloader, which then
+  compares each 64-byte page of the EEPROM with the image in RAM and
+  writes and verifies only the pages that differ. Writing an image that
+  is already in the EEPROM writes nothing at all.
+
+  The driver expects a 24xx256 EEPROM on P28 and P29, as the Propeller
+  boots from. If the delta write fails and retryPolicy() allows another
+  attempt, the whole EEPROM is written with the standard protocol.
+
+  Delta writes are disabled by default. They are experimental: the
+  EEPROM driver has only been exercised in emulation, not on hardware.
+  */
+
+void PropellerLoader::setDeltaWrite(bool enabled)
+{
+    _delta_write = enabled;
+}
+
+bool PropellerLoader::deltaWrite()
+{
+    return _delta_write;
+}
+
+/**
+  Return the baud rate the last high-speed download was planned at,
+  or 0 if none was.
+  */
+
+quint32 PropellerLoader::highSpeedBaudRate()
+{
+    return _highspeed_baud;
+}
+
+/**
+  Return the planner that chooses high-speed baud rates, shared by all
+  loaders so rates that worked or failed are remembered per port.
+  */
+
+PM::BaudPlanner & PropellerLoader::baudPlanner()
+{
+    static PM::BaudPlanner planner;
+    return planner;
 }
@@ -1,15 +1,26 @@
 #pragma once
 
 #include "propellerimage.h"
+#include "propellertemplate.h"
 #include "propellersession.h"
 #include "protocol.h"
+#include "payloadcache.h"
+#include "transfermodel.h"
+#include "miniloader.h"
+#include "loaderreport.h"
+#include "retrypolicy.h"
+#include "payloadanalyzer.h"
 
 #include <QTimer>
 #include <QElapsedTimer>
+#include <QPointer>
 #include <QStateMachine>
 #include <QFinalState>
 #include <QState>
 
+class PropellerTask;
+struct PropellerResult;
+
 /**
 @class PropellerLoader loader/propellerloader.h PropellerLoader
 
@@ -18,13 +29,34 @@
 PropellerLoader automatically selects the best download strategy based on the
 given image to download and the target device.
 
-- If downloading to an XBee device, high-speed loading must be used. If a 
-  crystal oscillator is not defined, PropellerManager errors.
-- If downloading through a serial connection, use high-speed download if a
-  crystal oscillator is defined, otherwise use the basic protocol.
+- If downloading to an XBee device, high-speed loading must be used, as the
+  basic protocol cannot recover a lost datagram. The image must define a
+  crystal oscillator and be run, and EEPROM writes are only possible in
+  delta write mode; anything else fails with InvalidImageError. A retry
+  that could only use the basic protocol is not attempted.
+- If downloading through a serial connection, use high-speed download if it
+  was enabled with setHighSpeed(), a crystal oscillator is defined and the
+  image is run, otherwise use the basic protocol. EEPROM writes use the basic protocol outside delta write
+  mode.
 
 PropellerDevice selects the reset strategy based on the port name. This can be overridden via the useReset() function.
 At present, all devices assume DTR reset as the default, except ttyAMA as this is specific to the ARM architecture and uses GPIO.
+XBee devices, named by their IPv4 address, reset through one of the XBee's DIO pins.
+Miniloader packets that go unacknowledged are sent again, so downloads survive lost datagrams.
+
+Uploads to a port that another loader is using wait in the port's queue in
+PropellerManager, ordered by priority(), and start as soon as it is released.
+cancel() withdraws a queued upload or stops a running one.
+
+uploadAsync() and identify() return a PropellerTask rather than blocking, so one thread
+can drive many loaders at once.
+
+Uploads that fail with a transient error, such as a timeout or a garbled handshake,
+are retried from the reset under retryPolicy(). The port stays reserved and the
+encoded payload is reused, so a retry costs one more reset rather than a new upload.
+
+Every upload is timed phase by phase. The resulting PM::LoaderReport is emitted by
+reported() just before finished(), and remains available from report().
 
 \see PropellerTerminal
 */
@@ -62,13 +94,16 @@ public:
         TimeoutError,
         HandshakeError,
         InvalidHandshakeError,
+        CancelledError,
         UnknownError
     };
 
 private:
+    PropellerManager * _manager;
     PropellerSession * session;
     PropellerProtocol protocol;
     PropellerImage _image;
+    PropellerTemplate * _template;
 
     int _command;
     int _completed;
@@ -76,29 +111,78 @@ private:
     int m_stat;
     
     QByteArray _payload;
+    QByteArray _payload_key;
+    int _payload_size;
+    PropellerEncoder _stream;
+    bool _streaming;
+    static const int _chunk_size = 1024;
 
     QStateMachine machine;
     QState * s_active;
 
     LoaderError _error;
-    QHash<LoaderError, QString> _errorstrings;
 
     int _version;
-    QHash<int, QString> _versionstrings;
+    bool _probe;
 
     int _ack;
     int _write, _run;
 
     QTimer totalTimeout;
     QTimer handshakeTimeout;
+    QTimer stageTimeout;
     QTimer resetTimer;
     QTimer poll;
+    QTimer retryTimer;
+    bool _pulsing;
+    qint64 _train_end;
+    qint64 _train_at;
+    bool _train_sent;
+    qint64 _launch_end;
+    static const int _pulse_train_time = 2;
+    static const int _pulse_interval = 20;
+    QHash<int, qint64> _stage_times;
+    PM::LoaderReport _report;
+    QPointer<PropellerTask> _task;
+    PM::RetryPolicy _retry_policy;
+    QHash<int, int> _retries;
+
+    int _ticket;
+    int _priority;
+    bool _queueing;
+    PropellerImage _queued_image;
+    bool _queued_write;
+    bool _queued_run;
     QElapsedTimer elapsedTimer;
+    QElapsedTimer stageTimer;
+    int _acks;
+    PM::TransferModel::Stage _stage;
+
+    PM::MiniLoader _miniloader;
+    PropellerImage _target;
+    bool _highspeed;
+    bool _use_highspeed;
+    bool _delta_write;
+    bool _delta_failed;
+    quint32 _highspeed_baud;
+    bool _highspeed_switched;
+    quint32 _initial_baud;
+
+    PropellerHandshake _handshake;
+    QElapsedTimer handshakeTimer;
+    qint64 _handshake_time;
 
     void writeLong(quint32 value);
+    void startVersion();
+    LoaderError begin(PropellerImage & image, bool write, bool run);
+    void planDownload(PropellerImage & image, bool write, bool run);
+    bool retry();
+    PropellerResult result(LoaderError e);
+    void highspeed_send();
 
 signals:
     void finished();
+    void reported(const PM::LoaderReport & report);
     void success();
     void failure();
 
@@ -107,6 +191,7 @@ signals:
     void handshake_received();
     void upload_completed();
     void acknowledged();
+    void loader_started();
 
     void statusChanged(const QString & message);
 
@@ -128,11 +213,29 @@ private slots:
     void acknowledge_entry();
     void acknowledge_exit();
     void acknowledge_read();
+    void acknowledge_drained();
+
+    void highspeed_entry();
+    void highspeed_exit();
+    void highspeed_read();
+    void highspeed_written();
+    void highspeed_timeout();
+    void highspeed_baud_set(bool ok);
 
     void calibrate();
+    void calibrate_written();
     void timeover();
     void timestamp();
 
+    void reset_applied(bool ok);
+    void reset_finished();
+    void report_entered();
+    void report_exited();
+    void report_written(qint64 bytes);
+    void finish_task();
+    void retry_start();
+    void start_queued();
+
     void message(const QString & text);
     void error(const QString & text);
 
@@ -142,10 +245,52 @@ public:
                     QObject * parent = 0);
     ~PropellerLoader();
 
-    int version();
+    int version(bool cached = false);
     QString versionString(int version);
 
     bool upload(PropellerImage image, bool write=false, bool run=true, bool wait=false);
-//    bool highSpeedUpload(PropellerImage image, bool write=false, bool run=true);
+
+    PropellerTask * uploadAsync(PropellerImage image, bool write=false, bool run=true);
+    PropellerTask * identify(bool probe = false, bool refresh = false);
+
+    void cancel();
+    void restoreDefaults();
+    QString portName();
+    bool isQueued();
+
+    int priority();
+    void setPriority(int priority);
+    bool queueing();
+    void setQueueing(bool enabled);
+
+    PM::RetryPolicy retryPolicy();
+    void setRetryPolicy(const PM::RetryPolicy & policy);
+
+    void setStreaming(bool enabled);
+    bool streaming();
+
+    qint64 handshakeTime();
+    qint64 stageTime(PM::TransferModel::Stage stage);
+    PM::LoaderReport report();
+
+    void setTemplate(PropellerTemplate * base);
+    PropellerTemplate * templateImage();
+
+    static const QHash<LoaderError, QString> & errorStrings();
+    static const QHash<int, QString> & versionStrings();
+
+    static PM::PayloadCache & payloadCache();
+    static PM::TransferModel & transferModel();
+    static PM::BaudPlanner & baudPlanner();
+
+    void setHighSpeed(bool enabled);
+    bool highSpeed();
+
+    void setDeltaWrite(bool enabled);
+    bool deltaWrite();
+
+    bool usesMiniLoader(PropellerImage & image, bool write, bool run);
+
+    quint32 highSpeedBaudRate();
 };
 
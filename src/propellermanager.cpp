@@ -1,5 +1,11 @@
 #include "propellermanager.h"
 
+#include "propellerloader.h"
+#include "propellertask.h"
+#include "xbeedevice.h"
+
+#include <QSerialPortInfo>
+
 #include "logging.h"
 
 PropellerManager::PropellerManager(QObject * parent)
@@ -7,16 +13,26 @@ PropellerManager::PropellerManager(QObject * parent)
 {
     sessions = new PM::SessionManager();
     devices = new PM::DeviceManager();
+    _pool_size = 2;
 
     connect(&monitor,   SIGNAL(listChanged()),
             this,       SIGNAL(portListChanged()));
 
     connect(&monitor,   SIGNAL(listChanged()),
             this,       SLOT(openNewPorts()));
+
+    connect(&monitor,   SIGNAL(listChanged()),
+            this,       SLOT(forgetChangedPorts()));
 }
 
 PropellerManager::~PropellerManager()
 {
+    foreach (QList<PropellerLoader *> loaders, _idle_loaders.values())
+        qDeleteAll(loaders);
+    qDeleteAll(_busy_loaders);
+    foreach (QPointer<PropellerLoader> loader, _retired_loaders)
+        delete loader;
+
     delete sessions;
     delete devices;
 }
@@ -37,6 +53,8 @@ void PropellerManager::endSession(PropellerSession * session)
     if (!session) return;
 //    qCDebug(pmanager) << "ending" << session;
 
+    queue.remove(session);
+
     session->detach();
     sessions->remove(session);
 }
@@ -102,12 +120,269 @@ void PropellerManager::release(PropellerSession * session)
             emit interface->deviceAvailableChanged(!interface->isPaused());
         }
     }
+
+    handOver(session->portName());
+}
+
+/**
+  Reserve the port of session now or, if another session holds it, as
+  soon as it is released. Once reserved, member is invoked on receiver
+  from the event loop.
+
+  \return A ticket for cancelReservation(), or 0 if the port's queue is full.
+  */
+
+int PropellerManager::queueReservation(PropellerSession * session, QObject * receiver,
+                                       const char * member, int priority)
+{
+    int ticket = queue.push(session->portName(), session, receiver, member, priority);
+    if (ticket && !isReserved(session) && reserve(session))
+        handOver(session->portName());
+
+    return ticket;
+}
+
+/**
+  Withdraw a queued reservation.
+
+  \return false if it has already been served or never existed.
+  */
+
+bool PropellerManager::cancelReservation(int ticket)
+{
+    return queue.cancel(ticket);
+}
+
+/**
+  Serve the next session waiting for port. Called with the port just
+  released, so the reservation passes on with no gap.
+  */
+
+void PropellerManager::handOver(const QString & port)
+{
+    PM::ReservationQueue::Entry e;
+    while (queue.take(port, &e))
+    {
+        if (!e.receiver || e.session->portName() != port)
+            continue;
+
+        if (!isReserved(e.session) && !reserve(e.session))
+        {
+            qCDebug(pmanager) << "couldn't hand over" << port;
+            continue;
+        }
+
+        QMetaObject::invokeMethod(e.receiver, e.member.constData(), Qt::QueuedConnection);
+        return;
+    }
+}
+
+/**
+  Return a loader for the port name, reusing an idle pooled loader if
+  there is one. Hand it back with releaseLoader() once its job has
+  finished; the manager owns it either way.
+  */
+
+PropellerLoader * PropellerManager::acquireLoader(const QString & name)
+{
+    PropellerLoader * loader;
+
+    if (_idle_loaders.contains(name) && !_idle_loaders[name].isEmpty())
+        loader = _idle_loaders[name].takeLast();
+    else
+        loader = new PropellerLoader(this, name);
+
+    _busy_loaders.insert(loader);
+    return loader;
+}
+
+/**
+  Return loader to the pool. Its job, if still queued or running, is
+  cancelled. Loaders beyond loaderPoolSize() per port are deleted.
+  */
+
+void PropellerManager::releaseLoader(PropellerLoader * loader)
+{
+    if (!_busy_loaders.remove(loader))
+        return;
+
+    loader->restoreDefaults();
+
+    QList<PropellerLoader *> & idle = _idle_loaders[loader->portName()];
+    if (idle.size() < _pool_size)
+    {
+        idle.append(loader);
+        return;
+    }
+
+    // it may be finishing its job, so it is deleted from the event loop
+    _retired_loaders.removeAll(QPointer<PropellerLoader>());
+    _retired_loaders.append(loader);
+    loader->deleteLater();
+}
+
+int PropellerManager::loaderPoolSize()
+{
+    return _pool_size;
+}
+
+/**
+  Set the most idle loaders kept per port. The default is 2.
+  */
+
+void PropellerManager::setLoaderPoolSize(int loaders)
+{
+    _pool_size = qMax(0, loaders);
+
+    foreach (QString port, _idle_loaders.keys())
+    {
+        QList<PropellerLoader *> & idle = _idle_loaders[port];
+        while (idle.size() > _pool_size)
+            delete idle.takeLast();
+    }
+}
+
+/**
+  Upload image to every one of ports at once.
+
+  EEPROM writes always use the standard protocol here, never delta
+  writes, which have not been verified on hardware.
+
+  \return A task that finishes once every port has. Its results() hold
+  the outcome and timing report of each port, in the order of ports.
+  The manager owns the task, and the caller may delete it once finished.
+  */
+
+PropellerTask * PropellerManager::uploadAll(const PropellerImage & image, const QStringList & ports,
+                                            bool write, bool run)
+{
+    PropellerImage target = image;
+
+    QList<PropellerLoader *> loaders;
+    bool standard = false;
+    foreach (QString port, ports)
+    {
+        PropellerLoader * loader = acquireLoader(port);
+        loader->setDeltaWrite(false);
+        loaders.append(loader);
+
+        standard = standard || !loader->usesMiniLoader(target, write, run);
+    }
+
+    // encode the standard download up front if any port will use it, so
+    // every loader finds it in the cache; high-speed downloads share
+    // their miniloader the same way once the first loader has encoded it.
+    if (target.isValid() && standard)
+    {
+        Command::Command command = (Command::Command) (2*write + run);
+        QByteArray data = PM::PayloadAnalyzer::minimize(target);
+        QByteArray key = PM::PayloadCache::key(data, command);
+
+        QByteArray payload;
+        if (!PropellerLoader::payloadCache().lookup(key, payload))
+            PropellerLoader::payloadCache().insert(key,
+                    PropellerProtocol().buildDownload(data, command));
+    }
+
+    QList<PropellerTask *> tasks;
+    foreach (PropellerLoader * loader, loaders)
+    {
+        PropellerTask * task = loader->uploadAsync(target, write, run);
+        track(task, loader);
+        tasks.append(task);
+    }
+
+    PropellerTask * gang = PropellerTask::all(tasks, this);
+
+    // keep the results with the gang once the loaders go back to the pool
+    foreach (PropellerTask * task, tasks)
+        task->setParent(gang);
+
+    return gang;
+}
+
+/**
+  Query the version of the device at every one of ports at once. Each
+  query gives up as soon as a Propeller would have answered, and is
+  reported by portFinished() as soon as it resolves.
+
+  Ports whose version is cached are answered without a reset, unless
+  refresh is true.
+
+  \return A task that finishes once every port has. Its results() hold
+  the version found at each port, or 0, in the order of ports.
+  The manager owns the task, and the caller may delete it once finished.
+  */
+
+PropellerTask * PropellerManager::identifyAll(const QStringList & ports, bool refresh)
+{
+    QList<PropellerTask *> tasks;
+    foreach (QString port, ports)
+    {
+        PropellerLoader * loader = acquireLoader(port);
+        PropellerTask * task = loader->identify(true, refresh);
+        track(task, loader);
+        tasks.append(task);
+    }
+
+    PropellerTask * scan = PropellerTask::all(tasks, this);
+
+    foreach (PropellerTask * task, tasks)
+        task->setParent(scan);
+
+    return scan;
+}
+
+/**
+  Return loader to the pool once task is done with it.
+  */
+
+void PropellerManager::track(PropellerTask * task, PropellerLoader * loader)
+{
+    _gang_loaders[task] = loader;
+
+    connect(task,   SIGNAL(finished(const PropellerResult &)),
+            this,   SLOT(gang_task_finished(const PropellerResult &)));
+    connect(task,   SIGNAL(destroyed(QObject *)),
+            this,   SLOT(gang_task_destroyed(QObject *)));
+}
+
+void PropellerManager::gang_task_finished(const PropellerResult & result)
+{
+    gang_task_destroyed(sender());
+    emit portFinished(result);
+}
+
+void PropellerManager::gang_task_destroyed(QObject * task)
+{
+    PropellerLoader * loader = _gang_loaders.take(static_cast<PropellerTask *>(task));
+    if (loader)
+        releaseLoader(loader);
+}
+
+int PropellerManager::queueDepth(const QString & name)
+{
+    return queue.depth(name);
+}
+
+int PropellerManager::maximumQueueDepth()
+{
+    return queue.maximumDepth();
+}
+
+/**
+  Set the most loaders that may wait for one port. The default is 16.
+  */
+
+void PropellerManager::setMaximumQueueDepth(int depth)
+{
+    queue.setMaximumDepth(depth);
 }
 
 void PropellerManager::setPortName(PropellerSession * session, const QString & name)
 {
     PM::SessionInterface * sessionInterface = sessions->interface(session);
-    PM::PropellerDevice * deviceInterface = getDevice(name);
+    Device * deviceInterface = getDevice(name);
 
     QString oldname = sessionInterface->portName();
 
@@ -145,6 +420,78 @@ void PropellerManager::enablePortMonitor(bool enabled, int timeout)
     monitor.toggle(enabled, timeout);
 }
 
+/**
+  Forget the cached version of the device at name, or of every device
+  if name is empty, so the next query resets it.
+  */
+
+void PropellerManager::forgetIdentity(const QString & name)
+{
+    if (name.isEmpty())
+        _identities.clear();
+    else
+        _identities.remove(name);
+}
+
+/**
+  Return in version the cached version of the device at name, if there
+  is one and the same adapter is still attached.
+  */
+
+bool PropellerManager::lookupIdentity(const QString & name, int * version)
+{
+    if (!_identities.contains(name))
+        return false;
+
+    const Identity & identity = _identities[name];
+    if (identity.serialNumber != serialNumber(name))
+    {
+        _identities.remove(name);
+        return false;
+    }
+
+    *version = identity.version;
+    return true;
+}
+
+void PropellerManager::storeIdentity(const QString & name, int version)
+{
+    Identity identity;
+    identity.serialNumber = serialNumber(name);
+    identity.version = version;
+    _identities[name] = identity;
+}
+
+/**
+  Return the USB serial number of the adapter at name, or an empty
+  string if it has none, as for XBee devices.
+  */
+
+QString PropellerManager::serialNumber(const QString & name)
+{
+    return QSerialPortInfo(name).serialNumber();
+}
+
+/**
+  Drop cached identities of serial ports that have disappeared or
+  reappeared, as whatever is attached may have changed. XBee devices
+  are not listed by the port monitor, so their identities are kept.
+  */
+
+void PropellerManager::forgetChangedPorts()
+{
+    QStringList ports = monitor.list();
+
+    foreach (QString name, _identities.keys())
+    {
+        if (PM::XBeeDevice::isXBee(name))
+            continue;
+
+        if (!ports.contains(name) || monitor.latest().contains(name))
+            _identities.remove(name);
+    }
+}
+
 void PropellerManager::openNewPorts()
 {
     foreach (QString s, monitor.latest())
@@ -153,10 +500,10 @@ void PropellerManager::openNewPorts()
     }
 }
 
-PM::PropellerDevice * PropellerManager::getDevice(const QString & name)
+Device * PropellerManager::getDevice(const QString & name)
 {
     bool exists = devices->exists(name);
-    PM::PropellerDevice * device = devices->interface(name);
+    Device * device = devices->interface(name);
 
     if(!exists)
         connect(device, SIGNAL(readyRead()),    sessions,   SLOT(readyBuffer()));
@@ -1,16 +1,26 @@
 #pragma once
 
 #include <QObject>
+#include <QHash>
+#include <QList>
+#include <QPointer>
+#include <QSet>
 #include "portmonitor.h"
 #include "devicemanager.h"
 #include "sessionmanager.h"
 #include "propellersession.h"
+#include "propellerimage.h"
+#include "reservationqueue.h"
 
 namespace PM
 {
     class SessionManager;
 }
 
+class PropellerLoader;
+class PropellerTask;
+struct PropellerResult;
+
 /**
 @class PropellerManager manager/propellermanager.h PropellerManager
 
@@ -41,6 +51,59 @@ One of the unique features of PropellerManager is that it makes opening and clos
 by maintaining a count of the number of sessions currently accessing any given device, and as long as this count
 remains above 0, the device will be held open.
 
+### Upload Queue
+
+Only one session at a time may reserve a port, as PropellerLoader does for
+the length of a download. Loaders that find their port reserved wait in a
+per-port queue instead of failing, ordered by PropellerLoader::priority().
+When a port is released, it is reserved for the next waiting session before
+release() returns, so nothing can take it in between and the next download
+starts straight away.
+
+### Loader Pool
+
+Constructing a PropellerLoader builds its state machine, timers and session.
+Applications that upload or identify often can instead borrow a loader with
+acquireLoader() and hand it back with releaseLoader(). Returned loaders are
+reset to their defaults and kept for the next job on the same port.
+
+### Scanning Ports
+
+identifyAll() resets and queries every given port at once, each with a
+deadline just long enough for a Propeller to answer, so scanning many ports
+takes about as long as scanning one. portFinished() reports each port as
+soon as it resolves.
+
+### Gang Programming
+
+uploadAll() programs one image into many boards at once. The download is
+encoded once and the same stream is shared by every port, and each port is
+driven by its own pooled loader, so the resets, handshakes and transfers all
+overlap and the whole gang takes about as long as its slowest board.
+
+@code
+PropellerTask * gang = manager.uploadAll(image, manager.listPorts());
+gang->waitForFinished();
+
+foreach (PropellerResult r, gang->results())
+    qDebug() << r.portName << r.errorString << r.report.duration();
+@endcode
+
+### Identity Cache
+
+Identifying a device resets it, interrupting whatever it was running. The
+version found at each port is therefore remembered along with the USB serial
+number of the adapter, and PropellerLoader::identify() and identifyAll() answer
+later queries without touching the device. An entry is dropped when the port
+monitor sees its port disappear or reappear, when a different adapter turns up
+under the same name, or when the device stops answering. Ports where nothing
+answered are not remembered, as a board may be attached or powered up there at
+any time. Pass refresh to identify() or identifyAll() to query the device
+regardless, or call forgetIdentity().
+
+PropellerLoader::version() always queries the device unless asked for the
+cached version.
+
 ### Port Monitoring
 
 PropellerManager enables you to monitor all available connections in the background
@@ -90,11 +153,33 @@ class PropellerManager : public QObject
     PM::PortMonitor monitor;
     PM::DeviceManager * devices;
     PM::SessionManager * sessions;
+    PM::ReservationQueue queue;
+
+    QHash<QString, QList<PropellerLoader *> > _idle_loaders;
+    QSet<PropellerLoader *> _busy_loaders;
+    QList<QPointer<PropellerLoader> > _retired_loaders;
+    int _pool_size;
+    QHash<PropellerTask *, PropellerLoader *> _gang_loaders;
+
+    struct Identity
+    {
+        QString serialNumber;
+        int version;
+    };
+
+    QHash<QString, Identity> _identities;
 
-    PM::PropellerDevice * getDevice(const QString & name);
+    static QString serialNumber(const QString & name);
+
+    Device * getDevice(const QString & name);
+    void track(PropellerTask * task, PropellerLoader * loader);
+    void handOver(const QString & port);
 
 private slots:
     void openNewPorts();
+    void forgetChangedPorts();
+    void gang_task_finished(const PropellerResult & result);
+    void gang_task_destroyed(QObject * task);
 
 public:
     PropellerManager(QObject *parent = 0);
@@ -106,6 +191,20 @@ public:
     QStringList latestPorts();
     void enablePortMonitor(bool enabled, int timeout = 200);
 
+    PropellerLoader * acquireLoader(const QString & name);
+    void releaseLoader(PropellerLoader * loader);
+    int loaderPoolSize();
+    void setLoaderPoolSize(int loaders);
+
+    PropellerTask * uploadAll(const PropellerImage & image, const QStringList & ports,
+                              bool write = false, bool run = true);
+    PropellerTask * identifyAll(const QStringList & ports, bool refresh = false);
+    void forgetIdentity(const QString & name = QString());
+
+    int queueDepth(const QString & name);
+    int maximumQueueDepth();
+    void setMaximumQueueDepth(int depth);
+
 /// @cond
 
     bool beginSession(PropellerSession * session);
@@ -115,10 +214,18 @@ public:
     bool isReserved(PropellerSession * session);
     void release(PropellerSession * session);
 
+    int queueReservation(PropellerSession * session, QObject * receiver,
+                         const char * member, int priority = 0);
+    bool cancelReservation(int ticket);
+
     void setPortName(PropellerSession * session, const QString & name);
 
+    bool lookupIdentity(const QString & name, int * version);
+    void storeIdentity(const QString & name, int version);
+
 /// @endcond
 
 signals:
     void portListChanged();
+    void portFinished(const PropellerResult & result);
 };
@@ -0,0 +1,161 @@
+#include "propellertask.h"
+
+#include <QEventLoop>
+#include <QTimer>
+
+PropellerResult::PropellerResult()
+{
+    error = PropellerLoader::NoError;
+    version = 0;
+    cached = false;
+}
+
+bool PropellerResult::success() const
+{
+    return error == PropellerLoader::NoError;
+}
+
+PropellerTask::PropellerTask(QObject * parent)
+    : QObject(parent)
+{
+    _finished = false;
+    _pending = 0;
+}
+
+PropellerTask::~PropellerTask()
+{
+}
+
+/**
+  Return a task that finishes once every one of tasks has finished.
+
+  Its result carries the first error among them, or NoError; the
+  individual results are available from results().
+  */
+
+PropellerTask * PropellerTask::all(const QList<PropellerTask *> & tasks, QObject * parent)
+{
+    PropellerTask * task = new PropellerTask(parent);
+
+    foreach (PropellerTask * t, tasks)
+    {
+        task->_children.append(t);
+        if (!t->isFinished())
+        {
+            task->_pending++;
+            connect(t,  SIGNAL(finished(const PropellerResult &)),
+                    task, SLOT(child_finished()));
+        }
+    }
+
+    if (!task->_pending)
+        task->child_finished();
+
+    return task;
+}
+
+void PropellerTask::child_finished()
+{
+    if (sender())
+        _pending--;
+
+    if (_pending > 0)
+        return;
+
+    PropellerResult result;
+    foreach (PropellerTask * t, _children)
+    {
+        if (t && !t->result().success())
+        {
+            result = t->result();
+            break;
+        }
+    }
+
+    finish(result);
+}
+
+/**
+  Record result and emit finished() from the event loop. Only the first
+  result is kept.
+  */
+
+void PropellerTask::finish(const PropellerResult & result)
+{
+    if (_finished)
+        return;
+
+    _result = result;
+    _finished = true;
+
+    QTimer::singleShot(0, this, SLOT(notify()));
+}
+
+void PropellerTask::notify()
+{
+    emit finished(_result);
+}
+
+bool PropellerTask::isFinished()
+{
+    return _finished;
+}
+
+PropellerResult PropellerTask::result()
+{
+    return _result;
+}
+
+/**
+  Return the results of the tasks combined by all(), or this task's own
+  result.
+  */
+
+QList<PropellerResult> PropellerTask::results()
+{
+    QList<PropellerResult> list;
+
+    if (_children.isEmpty())
+    {
+        list.append(_result);
+        return list;
+    }
+
+    foreach (PropellerTask * t, _children)
+    {
+        if (t)
+            list.append(t->result());
+    }
+    return list;
+}
+
+/**
+  Block until the task has finished, or msecs have passed if msecs is
+  not -1, while processing events.
+
+  This runs a nested event loop, which is what the asynchronous API
+  avoids; it is meant for simple programs and tests.
+
+  \return true if the task finished.
+  */
+
+bool PropellerTask::waitForFinished(int msecs)
+{
+    if (_finished)
+        return true;
+
+    QEventLoop loop;
+    QTimer wait;
+    wait.setSingleShot(true);
+
+    connect(this,  SIGNAL(finished(const PropellerResult &)), &loop, SLOT(quit()));
+    connect(&wait, SIGNAL(timeout()), &loop, SLOT(quit()));
+
+    if (msecs >= 0)
+        wait.start(msecs);
+
+    while (!_finished && (msecs < 0 || wait.isActive()))
+        loop.exec();
+
+    return _finished;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <QObject>
+#include <QList>
+#include <QPointer>
+
+#include "propellerloader.h"
+#include "loaderreport.h"
+
+/**
+@class PropellerResult loader/propellertask.h PropellerTask
+
+@brief The PropellerResult class holds the outcome of a PropellerTask.
+*/
+
+struct PropellerResult
+{
+    PropellerLoader::LoaderError error;
+    QString         errorString;
+    QString         portName;
+    int             version;
+    bool            cached;         ///< Answered from PropellerManager's identity cache
+    PM::LoaderReport report;
+
+    PropellerResult();
+    bool success() const;
+};
+
+Q_DECLARE_METATYPE(PropellerResult)
+
+/**
+@class PropellerTask loader/propellertask.h PropellerTask
+
+@brief The PropellerTask class is the completion handle of an upload or identify.
+
+PropellerLoader::uploadAsync() and PropellerLoader::identify() start their
+work and return a task immediately, so one thread can drive many loaders at
+once without any of them blocking the others. The task emits finished() once
+the result is known, always from the event loop, even if the operation failed
+before it started.
+
+Tasks compose: all() returns a task that finishes when every given task has.
+
+@code
+QList<PropellerTask *> tasks;
+foreach (PropellerLoader * loader, loaders)
+    tasks << loader->uploadAsync(image);
+
+PropellerTask * done = PropellerTask::all(tasks);
+connect(done, SIGNAL(finished(PropellerResult)), this, SLOT(uploaded()));
+@endcode
+
+The loader owns the tasks it returns. A task may be deleted early, and
+the loader then drops its result.
+*/
+
+class PropellerTask : public QObject
+{
+    Q_OBJECT
+
+    PropellerResult _result;
+    bool _finished;
+
+    QList<QPointer<PropellerTask> > _children;
+    int _pending;
+
+private slots:
+    void notify();
+    void child_finished();
+
+signals:
+    void finished(const PropellerResult & result);
+
+public:
+    PropellerTask(QObject * parent = 0);
+    ~PropellerTask();
+
+    static PropellerTask * all(const QList<PropellerTask *> & tasks, QObject * parent = 0);
+
+    void finish(const PropellerResult & result);
+
+    bool isFinished();
+    PropellerResult result();
+    QList<PropellerResult> results();
+
+    bool waitForFinished(int msecs = -1);
+};
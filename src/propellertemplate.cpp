@@ -0,0 +1,234 @@
+#include "propellertemplate.h"
+
+#include <string.h>
+
+PropellerTemplate::PropellerTemplate(const PropellerImage & image, int interval)
+{
+    _interval = qMax(interval, 4);
+    _segments.setMaxCost(8 * 1024 * 1024);
+    _reencoded = 0;
+    setImage(image);
+}
+
+/**
+  Set the template image, encoding it once and recording a checkpoint
+  at the start of every block.
+  */
+
+void PropellerTemplate::setImage(const PropellerImage & image)
+{
+    _image = image;
+    _data = _image.data();
+    _segments.clear();
+
+    int blocks = (_data.size() + _interval - 1) / _interval;
+
+    _checkpoints.resize(blocks + 1);
+    _encoded = QByteArray(_data.size() * 8 / 3 + 2, Qt::Uninitialized);
+
+    char * begin = _encoded.data();
+    char * out = begin;
+    int carry = 0;
+
+    for (int b = 0; b < blocks; b++)
+    {
+        _checkpoints[b].output = out - begin;
+        _checkpoints[b].carry = carry;
+
+        int offset = b * _interval;
+        int size = qMin(_interval, _data.size() - offset);
+        out = PropellerProtocol::encodePartial(_data.constData() + offset, size, out, &carry);
+    }
+
+    _checkpoints[blocks].output = out - begin;
+    _checkpoints[blocks].carry = carry;
+
+    out = PropellerProtocol::encodeFinish(carry, out);
+    _encoded.resize(out - begin);
+}
+
+PropellerImage PropellerTemplate::image()
+{
+    return _image;
+}
+
+/**
+  Return the number of bytes between checkpoints.
+  */
+
+int PropellerTemplate::interval()
+{
+    return _interval;
+}
+
+/**
+  Return whether image can be encoded incrementally from this
+  template. Only images of the same size are compatible.
+  */
+
+bool PropellerTemplate::isCompatible(PropellerImage image)
+{
+    return !_data.isEmpty() && image.imageSize() == (quint32) _data.size();
+}
+
+/**
+  Return the encoding of the template image.
+  */
+
+QByteArray PropellerTemplate::encoded()
+{
+    return _encoded;
+}
+
+/**
+  Encode image, translating only the blocks that differ from the
+  template and the bytes needed to fall back in step with it.
+  Incompatible images are encoded in full.
+  */
+
+QByteArray PropellerTemplate::encode(PropellerImage image)
+{
+    QByteArray data = image.data();
+
+    if (!isCompatible(image))
+    {
+        _reencoded = data.size();
+        return PropellerProtocol::encodeData(data);
+    }
+
+    int blocks = _checkpoints.size() - 1;
+
+    QByteArray encoded(data.size() * 8 / 3 + 2, Qt::Uninitialized);
+    char * begin = encoded.data();
+    char * out = begin;
+
+    _reencoded = 0;
+
+    int b = 0;
+    while (b < blocks)
+    {
+        // find the next modified block; the stream is in step until then
+        int d = b;
+        while (d < blocks)
+        {
+            int offset = d * _interval;
+            int size = qMin(_interval, data.size() - offset);
+            if (memcmp(data.constData() + offset, _data.constData() + offset, size))
+                break;
+            d++;
+        }
+
+        int from = _checkpoints[b].output;
+        int to = (d < blocks) ? _checkpoints[d].output : _encoded.size();
+        memcpy(out, _encoded.constData() + from, to - from);
+        out += to - from;
+
+        if (d == blocks)
+        {
+            encoded.resize(out - begin);
+            return encoded;
+        }
+
+        // translate until the carry state matches the template again
+        int carry = _checkpoints[d].carry;
+        do
+        {
+            int offset = d * _interval;
+            int size = qMin(_interval, data.size() - offset);
+            const char * in = data.constData() + offset;
+
+            if (memcmp(in, _data.constData() + offset, size))
+            {
+                out = PropellerProtocol::encodePartial(in, size, out, &carry);
+                _reencoded += size;
+            }
+            else
+            {
+                int key = d * 32 + carry;
+                Segment * segment = _segments.object(key);
+                if (segment)
+                {
+                    memcpy(out, segment->output.constData(), segment->output.size());
+                    out += segment->output.size();
+                    carry = segment->carry;
+                }
+                else
+                {
+                    char * start = out;
+                    out = PropellerProtocol::encodePartial(in, size, out, &carry);
+                    _reencoded += size;
+
+                    segment = new Segment;
+                    segment->output = QByteArray(start, out - start);
+                    segment->carry = carry;
+                    _segments.insert(key, segment, segment->output.size());
+                }
+            }
+
+            d++;
+        }
+        while (d < blocks && carry != _checkpoints[d].carry);
+
+        b = d;
+
+        if (b == blocks)
+            out = PropellerProtocol::encodeFinish(carry, out);
+    }
+
+    encoded.resize(out - begin);
+    return encoded;
+}
+
+/**
+  Build the complete download stream for image, encoding the image
+  incrementally from this template.
+  */
+
+QByteArray PropellerTemplate::buildDownload(PropellerImage image, Command::Command command)
+{
+    PropellerProtocol protocol;
+    QByteArray stream = protocol.buildRequest(command);
+
+    if (command != Command::Shutdown)
+    {
+        stream.append(protocol.encodeLong(image.imageSize() / 4));
+        stream.append(encode(image));
+    }
+
+    return stream;
+}
+
+/**
+  Return the maximum total size in bytes of the translated blocks kept
+  for reuse. The least recently used are dropped beyond it, and
+  translated again when next needed.
+  */
+
+int PropellerTemplate::maxSegmentSize()
+{
+    return _segments.maxCost();
+}
+
+void PropellerTemplate::setMaxSegmentSize(int bytes)
+{
+    _segments.setMaxCost(bytes);
+}
+
+/**
+  Return the total size in bytes of the translated blocks kept for reuse.
+  */
+
+int PropellerTemplate::segmentSize()
+{
+    return _segments.totalCost();
+}
+
+/**
+  Return the number of image bytes translated by the last call to
+  encode().
+  */
+
+int PropellerTemplate::reencodedBytes()
+{
+    return _reencoded;
+}
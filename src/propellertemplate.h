@@ -0,0 +1,86 @@
+#pragma once
+
+#include <QByteArray>
+#include <QCache>
+#include <QVector>
+
+#include "propellerimage.h"
+#include "protocol.h"
+
+/**
+@class PropellerTemplate image/propellertemplate.h PropellerTemplate
+
+@brief The PropellerTemplate class encodes personalized copies of an image incrementally.
+
+When the same image is downloaded to many boards with small per-board
+changes, such as a serial number or calibration constants, encoding the
+whole image for every board is wasted work. PropellerTemplate encodes
+the template image once and records a checkpoint of the translator
+state every interval() bytes.
+
+To encode a personalized copy, unchanged blocks are copied from the
+template encoding, and translation restarts only at the checkpoint
+before each modified block. Because the translator carries at most 4
+bits from one byte to the next, it falls back in step with the template
+shortly after the modified bytes, and copying resumes from there.
+
+Where it does not, as in long runs of zeros that are always translated
+3 bits at a time, the translation of each unmodified block is kept for
+the carry state it was entered with. Boards patched at the same
+locations reuse these, so after the first board only the modified
+blocks are translated. Like the payload cache, they are bounded by total
+size, 8 MB by default; see setMaxSegmentSize().
+
+@code
+PropellerTemplate base(image);
+
+PropellerImage board = base.image();
+board.writeLong(serial_offset, serial);
+board.recalculateChecksum();
+
+loader.setTemplate(&base);
+loader.upload(board);
+@endcode
+*/
+
+class PropellerTemplate
+{
+    struct Checkpoint
+    {
+        int output;     // offset into encoded template
+        int carry;      // translator carry state
+    };
+
+    struct Segment
+    {
+        QByteArray output;
+        int carry;      // translator carry state after the block
+    };
+
+    PropellerImage _image;
+    QByteArray _data;
+    QByteArray _encoded;
+    QVector<Checkpoint> _checkpoints;
+    QCache<int, Segment> _segments;
+    int _interval;
+    int _reencoded;
+
+public:
+    PropellerTemplate(const PropellerImage & image = PropellerImage(), int interval = 64);
+
+    void setImage(const PropellerImage & image);
+    PropellerImage image();
+    int interval();
+
+    bool isCompatible(PropellerImage image);
+
+    QByteArray encoded();
+    QByteArray encode(PropellerImage image);
+    QByteArray buildDownload(PropellerImage image, Command::Command command);
+
+    int maxSegmentSize();
+    void setMaxSegmentSize(int bytes);
+    int segmentSize();
+
+    int reencodedBytes();
+};
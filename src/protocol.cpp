@@ -1,15 +1,450 @@
 #include "protocol.h"
+#include "prelude.h"
 
 #include <QDataStream>
 #include <QDebug>
 
+#include <string.h>
+
 PropellerProtocol::PropellerProtocol()
 {
-    _request = QByteArray((char*) Propeller::request, Propeller::request_size);
-    _reply = QByteArray((char*) Propeller::reply, Propeller::reply_size);
+    _request = QByteArray::fromRawData((const char *) Propeller::Prelude::preludes[0].data,
+                                       Propeller::request_size);
+    _reply = QByteArray::fromRawData((const char *) Propeller::Prelude::reply.data,
+                                     Propeller::reply_size);
+}
+
+namespace {
+
+/**
+  The translator consumes 3 to 5 bits per output byte, so up to 4 bits of
+  every input byte are left over for the next one. An ExpansionTable entry
+  describes the complete translation of one input byte given the bits still
+  pending from the previous byte.
+
+  Pending bits are stored as a carry state: (1 << bits) - 1 + value, giving
+  31 states for 0 to 4 pending bits.
+  */
+
+const int _carry_states = 31;
+
+struct Expansion
+{
+    quint8 size;        // number of translated bytes
+    quint8 carry;       // carry state after this byte
+    quint8 bytes[3];    // translated bytes
+};
+
+struct ExpansionTable
+{
+    Expansion entry[_carry_states][256];
+
+    ExpansionTable()
+    {
+        for (int state = 0; state < _carry_states; state++)
+        {
+            int pending = 0;
+            while ((2 << pending) - 1 <= state)
+                pending++;
+
+            for (int byte = 0; byte < 256; byte++)
+            {
+                quint32 value = (state + 1 - (1 << pending)) | (byte << pending);
+                int bits = pending + 8;
+
+                Expansion & e = entry[state][byte];
+                e.size = 0;
+
+                while (bits >= 5)
+                {
+                    const quint8 * t = Propeller::translator[value & 0x1F][4];
+                    e.bytes[e.size++] = t[0];
+                    value >>= t[1];
+                    bits -= t[1];
+                }
+
+                e.carry = (1 << bits) - 1 + value;
+            }
+        }
+    }
+};
+
+const ExpansionTable & expansionTable()
+{
+    static const ExpansionTable table;
+    return table;
+}
+
+int pendingBits(int carry)
+{
+    int bits = 0;
+    while ((2 << bits) - 1 <= carry)
+        bits++;
+    return bits;
+}
+
+int translatedSize(const uchar * in, const uchar * end)
+{
+    const Expansion (* table)[256] = expansionTable().entry;
+
+    int size = 0;
+    int carry = 0;
+    for (; in < end; in++)
+    {
+        const Expansion & e = table[carry][*in];
+        size += e.size;
+        carry = e.carry;
+    }
+
+    int bits = pendingBits(carry);
+    quint8 value = carry + 1 - (1 << bits);
+    while (bits > 0)
+    {
+        const quint8 * t = Propeller::translator[value][bits - 1];
+        size++;
+        value >>= t[1];
+        bits -= t[1];
+    }
+
+    return size;
+}
+
+char * translate(const uchar * in, const uchar * end, char * out, int * carry)
+{
+    const Expansion (* table)[256] = expansionTable().entry;
+
+    int state = *carry;
+
+    // Each input byte translates to at least one byte, so while two more
+    // input bytes follow, the unused stores are overwritten before the end.
+    for (; end - in > 2; in++)
+    {
+        const Expansion & e = table[state][*in];
+        out[0] = e.bytes[0];
+        out[1] = e.bytes[1];
+        out[2] = e.bytes[2];
+        out += e.size;
+        state = e.carry;
+    }
+
+    for (; in < end; in++)
+    {
+        const Expansion & e = table[state][*in];
+        for (int i = 0; i < e.size; i++)
+            *out++ = e.bytes[i];
+        state = e.carry;
+    }
+
+    *carry = state;
+    return out;
+}
+
+// flush pending bits using the narrower translator columns
+char * flush(int carry, char * out)
+{
+    int bits = pendingBits(carry);
+    quint8 value = carry + 1 - (1 << bits);
+    while (bits > 0)
+    {
+        const quint8 * t = Propeller::translator[value][bits - 1];
+        *out++ = t[0];
+        value >>= t[1];
+        bits -= t[1];
+    }
+
+    return out;
+}
+
+char * translate(const uchar * in, const uchar * end, char * out)
+{
+    int carry = 0;
+    out = translate(in, end, out, &carry);
+    return flush(carry, out);
+}
+
+/**
+  The Propeller measures the length of each low pulse on its receive
+  pin: one bit period is a 1, two bit periods a 0. A DecodeTable entry
+  holds the bits carried by each byte sent at the standard baud rate,
+  counting the start bit, or a count of 0 if the byte is not a valid
+  download stream byte.
+  */
+
+struct Pulses
+{
+    quint8 value;
+    quint8 count;
+};
+
+struct DecodeTable
+{
+    Pulses entry[256];
+
+    DecodeTable()
+    {
+        for (int byte = 0; byte < 256; byte++)
+        {
+            int line = (byte << 1) | 0x200;     // start bit, data, stop bit
+
+            Pulses & p = entry[byte];
+            p.value = 0;
+            p.count = 0;
+
+            int bit = 0;
+            while (bit < 10)
+            {
+                if ((line >> bit) & 1)
+                {
+                    bit++;
+                    continue;
+                }
+
+                int length = 0;
+                while (!((line >> bit) & 1))
+                {
+                    length++;
+                    bit++;
+                }
+
+                if (length > 2)
+                {
+                    p.count = 0;
+                    break;
+                }
+
+                p.value |= (length == 1) << p.count;
+                p.count++;
+            }
+        }
+    }
+};
+
+const DecodeTable & decodeTable()
+{
+    static const DecodeTable table;
+    return table;
+}
+
+/**
+  Decodes two stream bytes at a time: the low 10 bits of each entry
+  hold the bits carried by both bytes, the upper bits their count, and
+  an entry of 0 marks a pair containing an invalid byte.
+  */
+
+struct PairTable
+{
+    quint16 entry[65536];
+
+    PairTable()
+    {
+        const Pulses * table = decodeTable().entry;
+
+        for (int pair = 0; pair < 65536; pair++)
+        {
+            const Pulses & first = table[pair & 0xFF];
+            const Pulses & second = table[pair >> 8];
+
+            if (!first.count || !second.count)
+                entry[pair] = 0;
+            else
+                entry[pair] = (first.value | (second.value << first.count))
+                            | ((first.count + second.count) << 10);
+        }
+    }
+};
+
+const PairTable & pairTable()
+{
+    static const PairTable table;
+    return table;
+}
+
+void storeLong(quint32 value, uchar * out)
+{
+    for (int i = 0; i < 4; i++)
+        out[i] = (value >> (i * 8)) & 0xFF;
+}
+
 }
 
 QByteArray PropellerProtocol::encodeData(QByteArray image)
+{
+    // every translated byte but the last two carries at least 3 bits
+    QByteArray encoded_image(image.size() * 8 / 3 + 2, Qt::Uninitialized);
+
+    char * end = encodeData(image, encoded_image.data());
+
+    encoded_image.resize(end - encoded_image.constData());
+    return encoded_image;
+}
+
+/**
+  Translate image into the caller-provided buffer out, which must
+  hold at least encodedSize(image) bytes.
+
+  \return A pointer to the byte following the last translated byte.
+  */
+
+char * PropellerProtocol::encodeData(const QByteArray & image, char * out)
+{
+    const uchar * in = (const uchar *) image.constData();
+    return translate(in, in + image.size(), out);
+}
+
+/**
+  Translate part of an image into out, continuing from the bits left
+  pending by the previous part. Start an image with a carry of 0 and
+  finish it with encodeFinish().
+
+  Each input byte produces at most 3 bytes.
+
+  \return A pointer to the byte following the last translated byte.
+  */
+
+char * PropellerProtocol::encodePartial(const char * data, int size, char * out, int * carry)
+{
+    const uchar * in = (const uchar *) data;
+    return translate(in, in + size, out, carry);
+}
+
+/**
+  Translate the bits left pending by encodePartial(). This produces at
+  most 2 bytes.
+  */
+
+char * PropellerProtocol::encodeFinish(int carry, char * out)
+{
+    return flush(carry, out);
+}
+
+/**
+  Decode outSize image bytes from the download stream data, reading at
+  most size bytes. Stream bytes are decoded from the pulses they put on
+  the wire, independently of the translator table.
+
+  \return The number of stream bytes consumed, or -1 if the stream
+  contains an invalid byte, ends early, or does not end on a byte
+  boundary.
+  */
+
+int PropellerProtocol::decodeData(const char * data, int size, char * out, int outSize)
+{
+    const Pulses * table = decodeTable().entry;
+    const quint16 * pairs = pairTable().entry;
+
+    const uchar * in = (const uchar *) data;
+    const uchar * end = in + size;
+    char * outend = out + outSize;
+
+    quint64 acc = 0;
+    int bits = 0;
+
+    // decode pairs of stream bytes while they cannot run past outSize,
+    // storing a long at a time
+    while (end - in >= 2 && (outend - out) * 8 >= bits + 10)
+    {
+        quint16 p = pairs[in[0] | (in[1] << 8)];
+        if (!p)
+            break;
+
+        in += 2;
+        acc |= (quint64) (p & 0x3FF) << bits;
+        bits += p >> 10;
+
+        if (bits >= 32)
+        {
+            out[0] = acc;
+            out[1] = acc >> 8;
+            out[2] = acc >> 16;
+            out[3] = acc >> 24;
+            out += 4;
+            acc >>= 32;
+            bits -= 32;
+        }
+    }
+
+    while (bits >= 8)
+    {
+        *out++ = acc;
+        acc >>= 8;
+        bits -= 8;
+    }
+
+    while (out < outend && in < end)
+    {
+        const Pulses & p = table[*in++];
+        if (!p.count)
+            return -1;
+
+        acc |= p.value << bits;
+        bits += p.count;
+
+        if (bits >= 8)
+        {
+            *out++ = acc;
+            acc >>= 8;
+            bits -= 8;
+        }
+    }
+
+    if (out < outend || bits)
+        return -1;
+
+    return in - (const uchar *) data;
+}
+
+/**
+  Decode size image bytes from the start of the download stream encoded.
+  */
+
+QByteArray PropellerProtocol::decodeData(const QByteArray & encoded, int size, bool * ok)
+{
+    QByteArray image(size, Qt::Uninitialized);
+    int consumed = decodeData(encoded.constData(), encoded.size(), image.data(), size);
+
+    if (ok)
+        *ok = (consumed >= 0);
+
+    if (consumed < 0)
+        return QByteArray();
+
+    return image;
+}
+
+/**
+  Decode a long from the download stream data.
+
+  \return The number of stream bytes consumed, or -1 on error.
+  */
+
+int PropellerProtocol::decodeLong(const char * data, int size, quint32 * value)
+{
+    uchar bytes[4];
+    int consumed = decodeData(data, size, (char *) bytes, 4);
+    if (consumed < 0)
+        return -1;
+
+    *value = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((quint32) bytes[3] << 24);
+    return consumed;
+}
+
+/**
+  Return the exact number of bytes encodeData() will produce for image,
+  without encoding it.
+  */
+
+int PropellerProtocol::encodedSize(const QByteArray & image)
+{
+    const uchar * in = (const uchar *) image.constData();
+    return translatedSize(in, in + image.size());
+}
+
+/**
+  Bit-at-a-time implementation of encodeData(), kept to cross-check
+  the table-driven encoder.
+  */
+
+QByteArray PropellerProtocol::encodeDataReference(QByteArray image)
 {
     int bits_processed = 0;
     int total_bits = image.size()*8;
@@ -52,9 +487,24 @@ QByteArray PropellerProtocol::packLong(quint32 value)
 
 QByteArray PropellerProtocol::encodeLong(quint32 value)
 {
-    return encodeData(packLong(value));
+    QByteArray encoded(encodedLongSize(value), Qt::Uninitialized);
+    encodeLong(value, encoded.data());
+    return encoded;
 }
 
+char * PropellerProtocol::encodeLong(quint32 value, char * out)
+{
+    uchar data[4];
+    storeLong(value, data);
+    return translate(data, data + 4, out);
+}
+
+int PropellerProtocol::encodedLongSize(quint32 value)
+{
+    uchar data[4];
+    storeLong(value, data);
+    return translatedSize(data, data + 4);
+}
 
 int PropellerProtocol::lfsr(int * seed)
 {
@@ -77,15 +527,199 @@ QList<char> PropellerProtocol::buildLfsrSequence(int size)
 }
 
 
+/**
+  Return the request for command. The request is generated at compile
+  time and returned without copying.
+  */
+
 QByteArray PropellerProtocol::buildRequest(Command::Command command)
 {
-    QByteArray array = _request;
-    array.append(QByteArray(125, 0x29));
-    array.append(QByteArray(4, 0x29));
-    array.append(encodeLong(command));
-    return array;
+    const Propeller::Prelude::Stream & prelude = Propeller::Prelude::preludes[command];
+    return QByteArray::fromRawData((const char *) prelude.data, prelude.size);
+}
+
+/**
+  Write the handshake request for command into out, which must hold at
+  least requestSize(command) bytes.
+
+  \return A pointer to the byte following the request.
+  */
+
+char * PropellerProtocol::buildRequest(Command::Command command, char * out)
+{
+    const Propeller::Prelude::Stream & prelude = Propeller::Prelude::preludes[command];
+    memcpy(out, prelude.data, prelude.size);
+    return out + prelude.size;
+}
+
+int PropellerProtocol::requestSize(Command::Command command)
+{
+    return Propeller::Prelude::preludes[command].size;
+}
+
+/**
+  Return the number of request bytes the Propeller must receive before
+  its handshake reply and version are complete: the handshake and the
+  calibration bytes that clock out the reply, but not the command.
+  */
+
+int PropellerProtocol::handshakeSize()
+{
+    return Propeller::request_size + Propeller::Prelude::calibration_size;
+}
+
+/**
+  Return the exact size of the complete download stream for image: the
+  handshake request, and for any command other than Command::Shutdown,
+  the image length in longs followed by the image itself.
+  */
+
+int PropellerProtocol::downloadSize(const QByteArray & image, Command::Command command)
+{
+    int size = requestSize(command);
+
+    if (command != Command::Shutdown)
+    {
+        size += encodedLongSize(image.size() / 4);
+        size += encodedSize(image);
+    }
+
+    return size;
+}
+
+/**
+  Write the complete download stream for image into out, which must hold
+  at least downloadSize(image, command) bytes.
+
+  \return A pointer to the byte following the stream.
+  */
+
+char * PropellerProtocol::buildDownload(const QByteArray & image, Command::Command command, char * out)
+{
+    out = buildRequest(command, out);
+
+    if (command != Command::Shutdown)
+    {
+        out = encodeLong(image.size() / 4, out);
+        out = encodeData(image, out);
+    }
+
+    return out;
+}
+
+/**
+  Build the complete download stream for image with a single allocation.
+  */
+
+QByteArray PropellerProtocol::buildDownload(const QByteArray & image, Command::Command command)
+{
+    QByteArray stream(downloadSize(image, command), Qt::Uninitialized);
+    char * end = buildDownload(image, command, stream.data());
+
+    Q_ASSERT(end == stream.constData() + stream.size());
+    Q_UNUSED(end);
+
+    return stream;
+}
+
+/**
+  Parse a complete download stream as the Propeller would receive it.
+
+  \return true if stream is a well-formed download; command and image
+  are set to the decoded command and image.
+  */
+
+bool PropellerProtocol::decodeDownload(const QByteArray & stream, Command::Command * command, QByteArray * image)
+{
+    const char * data = stream.constData();
+    int size = stream.size();
+    int calibration = Propeller::Prelude::calibration_size;
+
+    if (size < _request.size() + calibration)
+        return false;
+
+    if (memcmp(data, _request.constData(), _request.size()))
+        return false;
+
+    data += _request.size();
+    size -= _request.size();
+
+    for (int i = 0; i < calibration; i++)
+    {
+        if ((quint8) data[i] != Propeller::Prelude::calibration_byte)
+            return false;
+    }
+
+    data += calibration;
+    size -= calibration;
+
+    quint32 value = 0;
+    int consumed = decodeLong(data, size, &value);
+    if (consumed < 0 || value > Command::WriteRun)
+        return false;
+
+    data += consumed;
+    size -= consumed;
+    *command = (Command::Command) value;
+
+    image->clear();
+    if (*command == Command::Shutdown)
+        return size == 0;
+
+    consumed = decodeLong(data, size, &value);
+    if (consumed < 0 || value > 0x2000)
+        return false;
+
+    data += consumed;
+    size -= consumed;
+
+    image->resize(value * 4);
+    consumed = decodeData(data, size, image->data(), image->size());
+
+    return consumed == size;
 }
 
+/**
+  Encode image for command, decode the result and compare it with the
+  original.
+
+  \return true if the round trip reproduces image and command exactly.
+  If mismatches is given, it receives the offsets of all image bytes
+  that differ.
+  */
+
+bool PropellerProtocol::verifyDownload(const QByteArray & image, Command::Command command, QList<int> * mismatches)
+{
+    Command::Command decodedcommand = Command::Shutdown;
+    QByteArray decoded;
+
+    if (mismatches)
+        mismatches->clear();
+
+    bool ok = decodeDownload(buildDownload(image, command), &decodedcommand, &decoded);
+
+    if (ok && command == Command::Shutdown)
+        return decodedcommand == command;
+
+    if (!ok)
+        decoded.clear();
+
+    int size = qMax(image.size(), decoded.size());
+    bool match = ok && (decodedcommand == command);
+
+    for (int i = 0; i < size; i++)
+    {
+        if (i >= image.size() || i >= decoded.size() || image.at(i) != decoded.at(i))
+        {
+            match = false;
+            if (!mismatches)
+                break;
+            mismatches->append(i);
+        }
+    }
+
+    return match;
+}
 
 QByteArray PropellerProtocol::reply()
 {
@@ -96,3 +730,229 @@ QByteArray PropellerProtocol::request()
 {
     return _request;
 }
+
+
+PropellerEncoder::PropellerEncoder()
+{
+    _position = 0;
+    _offset = 0;
+    _carry = 0;
+    _size = 0;
+    _produced = 0;
+    _flushed = true;
+}
+
+/**
+  Prepare to stream the download for image and command. Only the
+  handshake request and image length are encoded up front; the image is
+  translated as read() is called.
+  */
+
+void PropellerEncoder::start(PropellerProtocol & protocol, const QByteArray & image, Command::Command command)
+{
+    _header = protocol.buildRequest(command);
+    _image.clear();
+
+    if (command != Command::Shutdown)
+    {
+        _header.append(protocol.encodeLong(image.size() / 4));
+        _image = image;
+    }
+
+    _position = 0;
+    _offset = 0;
+    _carry = 0;
+    _produced = 0;
+    _flushed = _image.isEmpty();
+    _size = _header.size() + PropellerProtocol::encodedSize(_image);
+}
+
+/**
+  Return the total size of the download stream.
+  */
+
+int PropellerEncoder::size()
+{
+    return _size;
+}
+
+/**
+  Return the number of bytes of the stream produced so far.
+  */
+
+int PropellerEncoder::produced()
+{
+    return _produced;
+}
+
+bool PropellerEncoder::atEnd()
+{
+    return _position >= _header.size() && _flushed;
+}
+
+/**
+  Produce the next chunk of the download stream, at most maxSize bytes.
+  maxSize must be at least 5 bytes for the stream to make progress.
+  */
+
+QByteArray PropellerEncoder::read(int maxSize)
+{
+    QByteArray chunk(maxSize, Qt::Uninitialized);
+    char * out = chunk.data();
+    char * limit = out + maxSize;
+
+    int header = qMin(_header.size() - _position, maxSize);
+    memcpy(out, _header.constData() + _position, header);
+    _position += header;
+    out += header;
+
+    if (_position >= _header.size() && !_flushed)
+    {
+        // each input byte yields at most 3 bytes, and the flush at most 2.
+        int count = qMin((int) (limit - out - 2) / 3, _image.size() - _offset);
+        if (count > 0)
+        {
+            const uchar * in = (const uchar *) _image.constData() + _offset;
+            out = translate(in, in + count, out, &_carry);
+            _offset += count;
+        }
+
+        if (_offset >= _image.size() && limit - out >= 2)
+        {
+            out = flush(_carry, out);
+            _flushed = true;
+        }
+    }
+
+    chunk.resize(out - chunk.constData());
+    _produced += chunk.size();
+    return chunk;
+}
+
+PropellerHandshake::PropellerHandshake(int maxNoise)
+{
+    _maxnoise = maxNoise;
+    reset();
+}
+
+void PropellerHandshake::reset()
+{
+    _received.clear();
+    _versiondata.clear();
+    _state = Waiting;
+    _start = 0;
+    _mismatch = -1;
+}
+
+/**
+  Consume newly received bytes, returning the resulting state. Once
+  the state is Matched or Mismatch, further bytes are ignored.
+  */
+
+PropellerHandshake::State PropellerHandshake::consume(const QByteArray & data)
+{
+    for (int i = 0; i < data.size(); i++)
+    {
+        if (_state == Matched || _state == Mismatch)
+            break;
+
+        if (_state == Version)
+        {
+            _versiondata.append(data[i]);
+            if (_versiondata.size() == 4)
+                _state = Matched;
+            continue;
+        }
+
+        _received.append(data[i]);
+
+        int pos = _received.size() - 1 - _start;
+        if ((quint8) data[i] != Propeller::reply[pos])
+        {
+            // treat leading bytes as noise if the rest still begins the reply
+            int start = _start + 1;
+            for (; start <= _maxnoise && start <= _received.size(); start++)
+            {
+                int length = _received.size() - start;
+                if (!memcmp(_received.constData() + start, Propeller::reply, length))
+                    break;
+            }
+
+            if (start > _maxnoise || start > _received.size())
+            {
+                _mismatch = _received.size() - 1;
+                _state = Mismatch;
+                break;
+            }
+
+            _start = start;
+        }
+
+        if (_received.size() - _start == Propeller::reply_size)
+            _state = Version;
+        else if (_received.size() > _start)
+            _state = Matching;
+        else
+            _state = Waiting;
+    }
+
+    return _state;
+}
+
+PropellerHandshake::State PropellerHandshake::state()
+{
+    return _state;
+}
+
+/**
+  Return the version reported by the Propeller, or 0 if the version
+  has not been received.
+  */
+
+int PropellerHandshake::version()
+{
+    if (_state != Matched)
+        return 0;
+
+    int version = 0;
+    for (int i = 0; i < 4; i++)
+    {
+        version += (_versiondata.at(i) & 1) +
+                   ((_versiondata.at(i) >> 5) & 1);
+    }
+    return version;
+}
+
+/**
+  Return the number of stray bytes skipped ahead of the reply.
+  */
+
+int PropellerHandshake::noise()
+{
+    return _start;
+}
+
+/**
+  Return the number of reply bytes matched so far.
+  */
+
+int PropellerHandshake::matched()
+{
+    return _received.size() - _start;
+}
+
+int PropellerHandshake::maxNoise()
+{
+    return _maxnoise;
+}
+
+/**
+  Return the offset of the first byte that could not belong to the
+  reply, counted from the first byte received, or -1 if none.
+  */
+
+int PropellerHandshake::mismatchOffset()
+{
+    return _mismatch;
+}
+
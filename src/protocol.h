@@ -25,7 +25,7 @@ namespace Propeller {
 const int _max_data_size = 1392;
 
 const int request_size = 69;
-const quint8 request[69] = {
+constexpr quint8 request[69] = {
     0x49,
     0xAA,0x52,0xA5,0xAA,0x25,0xAA,0xD2,0xCA,0x52,0x25,0xD2,0xD2,0xD2,0xAA,0x49,0x92,
     0xC9,0x2A,0xA5,0x25,0x4A,0x49,0x49,0x2A,0x25,0x49,0xA5,0x4A,0xAA,0x2A,0xA9,0xCA,
@@ -36,7 +36,7 @@ const quint8 request[69] = {
 
 
 const int reply_size = 125;
-const quint8 reply[reply_size] = {
+constexpr quint8 reply[reply_size] = {
     0xEE,0xCE,0xCE,0xCF,0xEF,0xCF,0xEE,0xEF,0xCF,0xCF,0xEF,0xEF,0xCF,0xCE,0xEF,0xCF,
     0xEE,0xEE,0xCE,0xEE,0xEF,0xCF,0xCE,0xEE,0xCE,0xCF,0xEE,0xEE,0xEF,0xCF,0xEE,0xCE,
     0xEE,0xCE,0xEE,0xCF,0xEF,0xEE,0xEF,0xCE,0xEE,0xEE,0xCF,0xEE,0xCF,0xEE,0xEE,0xCF,
@@ -64,7 +64,7 @@ remaining bits leads the next 5 bit translation unit input to the translation pr
 
 // Binary    Incoming    Translation
 // Value,    Bit Size,   or Bit Count
-const quint8 translator[32][5][2] = {
+constexpr quint8 translator[32][5][2] = {
     //  ***  1-BIT  ***        ***  2-BIT  ***        ***  3-BIT  ***        ***  4-BIT  ***        ***  5-BIT  ***
     { /*%00000*/ {0xFE, 1},  /*%00000*/ {0xF2, 2},  /*%00000*/ {0x92, 3},  /*%00000*/ {0x92, 3},  /*%00000*/ {0x92, 3} },
     { /*%00001*/ {0xFF, 1},  /*%00001*/ {0xF9, 2},  /*%00001*/ {0xC9, 3},  /*%00001*/ {0xC9, 3},  /*%00001*/ {0xC9, 3} },
@@ -73,7 +73,7 @@ const quint8 translator[32][5][2] = {
     {            {0,    0},             {0,    0},  /*%00100*/ {0xD2, 3},  /*%00100*/ {0xD2, 3},  /*%00100*/ {0xD2, 3} },
     {            {0,    0},             {0,    0},  /*%00101*/ {0xE9, 3},  /*%00101*/ {0x29, 4},  /*%00101*/ {0x29, 4} },
     {            {0,    0},             {0,    0},  /*%00110*/ {0xEA, 3},  /*%00110*/ {0x2A, 4},  /*%00110*/ {0x2A, 4} },
-    {            {0,    0},             {0,    0},  /*%00111*/ {0xFA, 3},  /*%00111*/ {0x95, 4},  /*%00111*/ {0x95, 4} },
+    {            {0,    0},             {0,    0},  /*%00111*/ {0xF5, 3},  /*%00111*/ {0x95, 4},  /*%00111*/ {0x95, 4} },
     {            {0,    0},             {0,    0},             {0,    0},  /*%01000*/ {0x92, 3},  /*%01000*/ {0x92, 3} },
     {            {0,    0},             {0,    0},             {0,    0},  /*%01001*/ {0x49, 4},  /*%01001*/ {0x49, 4} },
     {            {0,    0},             {0,    0},             {0,    0},  /*%01010*/ {0x4A, 4},  /*%01010*/ {0x4A, 4} },
@@ -119,10 +119,112 @@ public:
     PropellerProtocol();
     QByteArray buildRequest(Command::Command command = Command::Shutdown);
     static QByteArray encodeData(QByteArray image);
+    static QByteArray encodeDataReference(QByteArray image);
     static QByteArray encodeLong(quint32 value);
     static QByteArray packLong(quint32 value);
 
+    char * buildRequest(Command::Command command, char * out);
+    int requestSize(Command::Command command = Command::Shutdown);
+    static int handshakeSize();
+
+    QByteArray buildDownload(const QByteArray & image, Command::Command command);
+    char * buildDownload(const QByteArray & image, Command::Command command, char * out);
+    int downloadSize(const QByteArray & image, Command::Command command);
+
+    static char * encodeData(const QByteArray & image, char * out);
+    static int encodedSize(const QByteArray & image);
+    static char * encodeLong(quint32 value, char * out);
+    static int encodedLongSize(quint32 value);
+
+    static char * encodePartial(const char * data, int size, char * out, int * carry);
+    static char * encodeFinish(int carry, char * out);
+
+    static int decodeData(const char * data, int size, char * out, int outSize);
+    static QByteArray decodeData(const QByteArray & encoded, int size, bool * ok = 0);
+    static int decodeLong(const char * data, int size, quint32 * value);
+
+    bool decodeDownload(const QByteArray & stream, Command::Command * command, QByteArray * image);
+    bool verifyDownload(const QByteArray & image, Command::Command command, QList<int> * mismatches = 0);
+
     QByteArray reply();
     QByteArray request();
 
 };
+
+/**
+@class PropellerEncoder
+
+@brief The PropellerEncoder class produces a download stream in chunks.
+
+PropellerEncoder translates the image incrementally as each chunk is
+requested, so transmission can begin before the whole image is
+encoded while only one chunk is held in memory at a time.
+*/
+
+class PropellerEncoder
+{
+    QByteArray _header;
+    QByteArray _image;
+
+    int _position;
+    int _offset;
+    int _carry;
+    int _size;
+    int _produced;
+    bool _flushed;
+
+public:
+    PropellerEncoder();
+
+    void start(PropellerProtocol & protocol, const QByteArray & image, Command::Command command);
+    int size();
+    int produced();
+    bool atEnd();
+    QByteArray read(int maxSize);
+};
+
+/**
+@class PropellerHandshake
+
+@brief The PropellerHandshake class matches the handshake reply as it arrives.
+
+Bytes are compared against the expected LFSR reply as soon as they are
+received. Up to maxNoise() stray bytes ahead of the reply are skipped,
+and the first byte that cannot belong to the reply is reported as a
+mismatch immediately, rather than when the handshake times out.
+*/
+
+class PropellerHandshake
+{
+public:
+    enum State
+    {
+        Waiting,        ///< No reply bytes received yet
+        Matching,       ///< Reply partially received
+        Version,        ///< Reply received, waiting for version
+        Matched,        ///< Reply and version received
+        Mismatch        ///< Received data is not a valid reply
+    };
+
+private:
+    QByteArray _received;
+    QByteArray _versiondata;
+    State _state;
+    int _start;
+    int _maxnoise;
+    int _mismatch;
+
+public:
+    PropellerHandshake(int maxNoise = 16);
+
+    void reset();
+    State consume(const QByteArray & data);
+    State state();
+
+    int version();
+    int noise();
+    int matched();
+    int maxNoise();
+    int mismatchOffset();
+};
+
@@ -0,0 +1,122 @@
+#include "reservationqueue.h"
+
+namespace PM
+{
+    ReservationQueue::ReservationQueue()
+    {
+        _next_ticket = 1;
+        _maximum_depth = default_depth;
+    }
+
+    ReservationQueue::~ReservationQueue()
+    {
+    }
+
+    /**
+      Queue session for port. Once it has reserved the port, member is to
+      be invoked on receiver.
+
+      \return The ticket of the entry, or 0 if the port's queue is full.
+      */
+
+    int ReservationQueue::push(const QString & port, PropellerSession * session,
+                               QObject * receiver, const char * member, int priority)
+    {
+        QList<Entry> & entries = _ports[port];
+        if (entries.size() >= _maximum_depth)
+            return 0;
+
+        Entry e;
+        e.ticket = _next_ticket++;
+        e.priority = priority;
+        e.session = session;
+        e.receiver = receiver;
+        e.member = member;
+
+        if (_next_ticket <= 0)
+            _next_ticket = 1;
+
+        int i = 0;
+        while (i < entries.size() && entries[i].priority >= priority)
+            i++;
+
+        entries.insert(i, e);
+        return e.ticket;
+    }
+
+    /**
+      Remove the next entry for port into entry.
+
+      \return false if none is waiting.
+      */
+
+    bool ReservationQueue::take(const QString & port, Entry * entry)
+    {
+        if (!_ports.contains(port) || _ports[port].isEmpty())
+            return false;
+
+        *entry = _ports[port].takeFirst();
+        if (_ports[port].isEmpty())
+            _ports.remove(port);
+
+        return true;
+    }
+
+    bool ReservationQueue::cancel(int ticket)
+    {
+        foreach (QString port, _ports.keys())
+        {
+            QList<Entry> & entries = _ports[port];
+            for (int i = 0; i < entries.size(); i++)
+            {
+                if (entries[i].ticket == ticket)
+                {
+                    entries.removeAt(i);
+                    if (entries.isEmpty())
+                        _ports.remove(port);
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    /**
+      Remove every entry of session, such as when it ends.
+      */
+
+    void ReservationQueue::remove(PropellerSession * session)
+    {
+        foreach (QString port, _ports.keys())
+        {
+            QList<Entry> & entries = _ports[port];
+            for (int i = entries.size() - 1; i >= 0; i--)
+            {
+                if (entries[i].session == session)
+                    entries.removeAt(i);
+            }
+
+            if (entries.isEmpty())
+                _ports.remove(port);
+        }
+    }
+
+    int ReservationQueue::depth(const QString & port)
+    {
+        return _ports.value(port).size();
+    }
+
+    int ReservationQueue::maximumDepth()
+    {
+        return _maximum_depth;
+    }
+
+    /**
+      Set the most sessions that may wait for one port. The default is 16.
+      */
+
+    void ReservationQueue::setMaximumDepth(int depth)
+    {
+        _maximum_depth = qMax(0, depth);
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <QHash>
+#include <QList>
+#include <QObject>
+#include <QPointer>
+#include <QString>
+
+class PropellerSession;
+
+namespace PM
+{
+    /**
+      @class ReservationQueue
+
+      The ReservationQueue class orders the sessions waiting to reserve
+      each port.
+
+      Waiting sessions are served by priority, highest first, and in the
+      order they arrived within a priority. Each port holds at most
+      maximumDepth() waiting sessions. Every entry has a ticket that can
+      be used to cancel it.
+      */
+
+    class ReservationQueue
+    {
+    public:
+        struct Entry
+        {
+            int ticket;
+            int priority;
+            PropellerSession * session;
+            QPointer<QObject> receiver;
+            QByteArray member;
+        };
+
+        static const int default_depth = 16;
+
+    private:
+        QHash<QString, QList<Entry> > _ports;
+        int _next_ticket;
+        int _maximum_depth;
+
+    public:
+        ReservationQueue();
+        ~ReservationQueue();
+
+        int push(const QString & port, PropellerSession * session,
+                 QObject * receiver, const char * member, int priority = 0);
+        bool take(const QString & port, Entry * entry);
+
+        bool cancel(int ticket);
+        void remove(PropellerSession * session);
+
+        int depth(const QString & port);
+        int maximumDepth();
+        void setMaximumDepth(int depth);
+    };
+}
@@ -0,0 +1,74 @@
+#include "retrypolicy.h"
+
+#include <qmath.h>
+
+#include "propellerloader.h"
+
+namespace PM
+{
+    /**
+      Construct the default policy. Timeouts and handshake faults are
+      retried twice, and failed acknowledgements once. The first retry
+      waits 50 ms, doubling up to 1 s.
+      */
+
+    RetryPolicy::RetryPolicy()
+    {
+        _budgets[PropellerLoader::TimeoutError]             = 2;
+        _budgets[PropellerLoader::HandshakeError]           = 2;
+        _budgets[PropellerLoader::InvalidHandshakeError]    = 2;
+        _budgets[PropellerLoader::VerifyRamError]           = 1;
+        _budgets[PropellerLoader::WriteEepromError]         = 1;
+        _budgets[PropellerLoader::VerifyEepromError]        = 1;
+        _budgets[PropellerLoader::UnknownError]             = 1;
+
+        setBackoff(50, 2, 1000);
+    }
+
+    /**
+      Return a policy that never retries.
+      */
+
+    RetryPolicy RetryPolicy::none()
+    {
+        RetryPolicy policy;
+        policy._budgets.clear();
+        return policy;
+    }
+
+    /**
+      Return how many times an upload is retried after error.
+      */
+
+    int RetryPolicy::budget(int error) const
+    {
+        return _budgets.value(error, 0);
+    }
+
+    void RetryPolicy::setBudget(int error, int retries)
+    {
+        _budgets[error] = qMax(0, retries);
+    }
+
+    /**
+      Wait initial milliseconds before the first retry, and factor times
+      as long before each one after it, but never more than maximum.
+      */
+
+    void RetryPolicy::setBackoff(int initial, double factor, int maximum)
+    {
+        _initial_backoff = qMax(0, initial);
+        _backoff_factor = qMax(1.0, factor);
+        _maximum_backoff = qMax(_initial_backoff, maximum);
+    }
+
+    /**
+      Return the milliseconds to wait before retry, counting from 1.
+      */
+
+    int RetryPolicy::backoff(int retry) const
+    {
+        double wait = _initial_backoff * qPow(_backoff_factor, qMax(0, retry - 1));
+        return (int) qMin<double>(wait, _maximum_backoff);
+    }
+}
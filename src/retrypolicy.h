@@ -0,0 +1,40 @@
+#pragma once
+
+#include <QHash>
+
+namespace PM
+{
+    /**
+      @class RetryPolicy
+
+      The RetryPolicy class decides whether a failed upload is worth
+      another attempt, and how long to wait before it.
+
+      Each error has its own budget of retries per upload, so transient
+      faults such as handshake noise or a timeout on a busy USB hub are
+      retried while errors that cannot clear by themselves, such as an
+      invalid image, fail at once. The wait before each retry grows
+      geometrically up to a maximum.
+
+      Errors are PropellerLoader::LoaderError values.
+      */
+
+    class RetryPolicy
+    {
+        QHash<int, int> _budgets;
+        int _initial_backoff;
+        double _backoff_factor;
+        int _maximum_backoff;
+
+    public:
+        RetryPolicy();
+
+        static RetryPolicy none();
+
+        int budget(int error) const;
+        void setBudget(int error, int retries);
+
+        void setBackoff(int initial, double factor, int maximum);
+        int backoff(int retry) const;
+    };
+}
@@ -4,12 +4,12 @@
 
 #include "template/connector.h"
 #include "readbuffer.h"
-#include "propellerdevice.h"
+#include "template/device.h"
 
 namespace PM
 {
 
-    class SessionInterface : public Connector<PropellerDevice *>
+    class SessionInterface : public Connector<Device *>
     {
         Q_OBJECT
     
@@ -19,7 +19,7 @@ namespace PM
     
     public:
         SessionInterface ()
-            : Connector<PropellerDevice *>()
+            : Connector<Device *>()
         {
             _buffer = new ReadBuffer();
             _reserved = false;
@@ -35,7 +35,7 @@ namespace PM
         {
             if (!isActive()) return false;
             _buffer->clear();
-            Connector<PropellerDevice *>::clear();
+            Connector<Device *>::clear();
             return true;
         }
     
@@ -90,6 +90,7 @@ namespace PM
 
             connect(_target,    SIGNAL(deviceStateChanged(bool)),       this,   SIGNAL(deviceStateChanged(bool)));
             connect(_target,    SIGNAL(deviceAvailableChanged(bool)),   this,   SIGNAL(deviceAvailableChanged(bool)));
+            connect(_target,    SIGNAL(commandsFinished(bool)),         this,   SIGNAL(commandsFinished(bool)));
         }
     
         void detachSignals()
@@ -102,6 +103,7 @@ namespace PM
 
             disconnect(_target,    SIGNAL(deviceStateChanged(bool)),       this,   SIGNAL(deviceStateChanged(bool)));
             disconnect(_target,    SIGNAL(deviceAvailableChanged(bool)),   this,   SIGNAL(deviceAvailableChanged(bool)));
+            disconnect(_target,    SIGNAL(commandsFinished(bool)),         this,   SIGNAL(commandsFinished(bool)));
         }
     };
 
@@ -32,7 +32,7 @@ namespace PM
     
     void SessionManager::readyBuffer()
     {
-        PropellerDevice * device = (PropellerDevice *) sender();
+        Device * device = (Device *) sender();
         QByteArray newdata = device->readAll();
     
         foreach (SessionInterface * interface, _interfaces.values())
@@ -9,11 +9,22 @@ CONFIG += staticlib
 SOURCES += \
     logging.cpp \
     propellerdevice.cpp \
+    xbeedevice.cpp \
     gpio.cpp \
     propellerimage.cpp \
+    propellertemplate.cpp \
     propellerloader.cpp \
+    propellertask.cpp \
     protocol.cpp \
+    payloadcache.cpp \
+    payloadanalyzer.cpp \
+    transfermodel.cpp \
+    miniloader.cpp \
+    baudplanner.cpp \
+    loaderreport.cpp \
+    retrypolicy.cpp \
     propellermanager.cpp \
+    reservationqueue.cpp \
     portmonitor.cpp \
     readbuffer.cpp \
     sessionmanager.cpp \
@@ -22,17 +33,30 @@ SOURCES += \
 
 HEADERS += \
     template/connector.h \
+    template/device.h \
     template/interface.h \
     template/manager.h \
     logging.h \
     propellerdevice.h \
+    xbeedevice.h \
     gpio.h \
     propellerimage.h \
+    propellertemplate.h \
     propellerloader.h \
+    propellertask.h \
     protocol.h \
+    prelude.h \
+    payloadcache.h \
+    payloadanalyzer.h \
+    transfermodel.h \
+    miniloader.h \
+    baudplanner.h \
+    loaderreport.h \
+    retrypolicy.h \
     devicemanager.h \
     portmonitor.h \
     propellermanager.h \
+    reservationqueue.h \
     readbuffer.h \
     sessioninterface.h \
     sessionmanager.h \
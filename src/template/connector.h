@@ -22,6 +22,7 @@ protected:
 
         connect(_target,    SIGNAL(deviceStateChanged(bool)),       this,   SIGNAL(deviceStateChanged(bool)));
         connect(_target,    SIGNAL(deviceAvailableChanged(bool)),   this,   SIGNAL(deviceAvailableChanged(bool)));
+        connect(_target,    SIGNAL(commandsFinished(bool)),         this,   SIGNAL(commandsFinished(bool)));
     }
 
     virtual void detachSignals()
@@ -33,6 +34,7 @@ protected:
 
         disconnect(_target,    SIGNAL(deviceStateChanged(bool)),       this,   SIGNAL(deviceStateChanged(bool)));
         disconnect(_target,    SIGNAL(deviceAvailableChanged(bool)),   this,   SIGNAL(deviceAvailableChanged(bool)));
+        disconnect(_target,    SIGNAL(commandsFinished(bool)),         this,   SIGNAL(commandsFinished(bool)));
     }
 
 public:
@@ -219,6 +221,12 @@ public:
         return _target->resetPeriod();
     }
 
+    bool commandsPending()
+    {
+        if (!isActive()) return false;
+        return _target->commandsPending();
+    }
+
     int error()
     {
         if (!isActive()) return 0;
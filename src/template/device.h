@@ -0,0 +1,23 @@
+#pragma once
+
+#include "interface.h"
+
+/**
+  The Device class is the Interface of hardware that PropellerManager
+  opens and shares between sessions, such as a serial port or a
+  networked XBee.
+  */
+
+class Device : public Interface
+{
+public:
+    Device() : Interface()
+    {
+    }
+
+    virtual bool        open() = 0;
+    virtual void        close() = 0;
+
+    virtual void        setEnabled(bool enabled) = 0;
+    virtual bool        enabled() = 0;
+};
@@ -35,6 +35,8 @@ public:
     virtual bool        reset() = 0;
     virtual quint32     resetPeriod() = 0;
 
+    virtual bool        commandsPending() = 0;
+
 signals:
     void sendError(const QString & message);
     void bytesWritten(qint64 bytes);
@@ -42,5 +44,6 @@ signals:
     void readyRead();
     void deviceStateChanged(bool enabled);
     void deviceAvailableChanged(bool available);
+    void commandsFinished(bool ok);
 };
 
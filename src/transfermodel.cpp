@@ -0,0 +1,212 @@
+#include "transfermodel.h"
+
+#include <math.h>
+
+namespace PM
+{
+    // Initial adapter latency until one is observed; covers the 16 ms
+    // default latency timer of FTDI adapters with room to spare.
+    static const double default_latency = 40;
+
+    TransferModel::TransferModel()
+    {
+        // Work done by the Propeller after the payload, before the first
+        // observation. The ROM programs 32 kB of EEPROM a page at a time,
+        // which takes a few seconds; reading it back is faster.
+        _defaults[Handshake]    = 0;
+        _defaults[Payload]      = 0;
+        _defaults[VerifyRam]    = 100;
+        _defaults[WriteEeprom]  = 4000;
+        _defaults[VerifyEeprom] = 2000;
+
+        for (int i = 0; i < StageCount; i++)
+        {
+            _margins[i].factor = 1.5;
+            _margins[i].milliseconds = 100;
+        }
+
+        _probe_slack = 20;
+    }
+
+    TransferModel::~TransferModel()
+    {
+    }
+
+    TransferModel::PortTiming & TransferModel::port(const QString & portname)
+    {
+        if (!_ports.contains(portname))
+        {
+            PortTiming & t = _ports[portname];
+
+            t.latency.mean = default_latency;
+            t.latency.deviation = 0;
+            t.latency.samples = 0;
+
+            for (int i = 0; i < StageCount; i++)
+            {
+                t.work[i].mean = _defaults[i];
+                t.work[i].deviation = 0;
+                t.work[i].samples = 0;
+            }
+        }
+
+        return _ports[portname];
+    }
+
+    void TransferModel::update(Estimate & e, double sample)
+    {
+        if (!e.samples)
+        {
+            e.mean = sample;
+            e.deviation = sample / 2;
+        }
+        else
+        {
+            e.deviation += (fabs(sample - e.mean) - e.deviation) / 4;
+            e.mean += (sample - e.mean) / 8;
+        }
+
+        e.samples++;
+    }
+
+    double TransferModel::bound(const Estimate & e)
+    {
+        return e.mean + 4 * e.deviation;
+    }
+
+    /**
+      Return the time in milliseconds to shift bytes out at baudRate,
+      where each character is framed as bitsPerCharacter bits including
+      the start bit (10 for 8N1).
+      */
+
+    double TransferModel::transferTime(quint32 bytes, quint32 baudRate, int bitsPerCharacter)
+    {
+        if (!baudRate)
+            return 0;
+
+        return (double) bytes * bitsPerCharacter * 1000 / baudRate;
+    }
+
+    /**
+      Return the deadline in milliseconds for stage on portname, when
+      bytes are sent during the stage at baudRate.
+
+      deadline = (transfer + latency + work) * factor + milliseconds
+      */
+
+    int TransferModel::deadline(const QString & portname, Stage stage, quint32 bytes, quint32 baudRate)
+    {
+        PortTiming & t = port(portname);
+
+        double expected = transferTime(bytes, baudRate)
+                        + bound(t.latency)
+                        + bound(t.work[stage]);
+
+        return (int) ceil(expected * _margins[stage].factor) + _margins[stage].milliseconds;
+    }
+
+    /**
+      Return a tight deadline in milliseconds for the handshake of a
+      version query on portname, when bytes are sent at baudRate.
+
+      A Propeller answers while the request is still being clocked out,
+      so the reply is complete as soon as the request has been sent and
+      the adapter has passed it on. The deadline is that time plus
+      probeSlack(), without the stage margin, so a port with nothing
+      attached fails fast.
+      */
+
+    int TransferModel::probeDeadline(const QString & portname, quint32 bytes, quint32 baudRate)
+    {
+        double expected = transferTime(bytes, baudRate)
+                        + bound(port(portname).latency);
+
+        return (int) ceil(expected) + _probe_slack;
+    }
+
+    /**
+      Record the adapter latency observed on portname: the time beyond
+      the wire time that a reply took to arrive.
+      */
+
+    void TransferModel::observeLatency(const QString & portname, double milliseconds)
+    {
+        update(port(portname).latency, qMax(0.0, milliseconds));
+    }
+
+    /**
+      Record how long the Propeller took to complete stage on portname,
+      excluding transfer time.
+      */
+
+    void TransferModel::observeStage(const QString & portname, Stage stage, double milliseconds)
+    {
+        update(port(portname).work[stage], qMax(0.0, milliseconds));
+    }
+
+    double TransferModel::latency(const QString & portname)
+    {
+        return port(portname).latency.mean;
+    }
+
+    double TransferModel::stageTime(const QString & portname, Stage stage)
+    {
+        return port(portname).work[stage].mean;
+    }
+
+    int TransferModel::samples(const QString & portname, Stage stage)
+    {
+        return port(portname).work[stage].samples;
+    }
+
+    TransferModel::Margin TransferModel::margin(Stage stage)
+    {
+        return _margins[stage];
+    }
+
+    /**
+      Set the safety margin applied to deadlines of stage. The expected
+      time is multiplied by factor, then milliseconds is added.
+
+      The default margin is a factor of 1.5 plus 100 ms.
+      */
+
+    void TransferModel::setMargin(Stage stage, double factor, int milliseconds)
+    {
+        _margins[stage].factor = factor;
+        _margins[stage].milliseconds = milliseconds;
+    }
+
+    int TransferModel::probeSlack()
+    {
+        return _probe_slack;
+    }
+
+    /**
+      Set the time allowed beyond the expected handshake time of a
+      version query before the port is given up on.
+
+      The default value is 20 ms.
+      */
+
+    void TransferModel::setProbeSlack(int milliseconds)
+    {
+        _probe_slack = milliseconds;
+    }
+
+    /**
+      Discard everything learned about portname, e.g. when a different
+      board or adapter is attached.
+      */
+
+    void TransferModel::forget(const QString & portname)
+    {
+        _ports.remove(portname);
+    }
+
+    void TransferModel::clear()
+    {
+        _ports.clear();
+    }
+}
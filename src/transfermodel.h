@@ -0,0 +1,93 @@
+#pragma once
+
+#include <QHash>
+#include <QString>
+
+namespace PM
+{
+    /**
+      @class TransferModel
+
+      The TransferModel class derives download deadlines from the real
+      serial framing of the data being sent and from timings observed
+      on previous downloads to the same port.
+
+      Each stage deadline is built from three parts: the wire time of the
+      bytes sent during the stage, the learned adapter latency of the
+      port, and the learned time the Propeller spends working (RAM
+      checksum, EEPROM programming and EEPROM verification). Observations
+      are smoothed as in TCP retransmission timers, keeping both a mean
+      and a mean deviation, so a noisy port gets looser deadlines than a
+      steady one.
+
+      Until a port has been observed, conservative defaults are used.
+      */
+
+    class TransferModel
+    {
+    public:
+        enum Stage
+        {
+            Handshake,
+            Payload,
+            VerifyRam,
+            WriteEeprom,
+            VerifyEeprom,
+            StageCount
+        };
+
+        struct Margin
+        {
+            double factor;
+            int milliseconds;
+        };
+
+    private:
+        struct Estimate
+        {
+            double mean;
+            double deviation;
+            int samples;
+        };
+
+        struct PortTiming
+        {
+            Estimate latency;
+            Estimate work[StageCount];
+        };
+
+        QHash<QString, PortTiming> _ports;
+        Margin _margins[StageCount];
+        double _defaults[StageCount];
+        int _probe_slack;
+
+        PortTiming & port(const QString & portname);
+        static void update(Estimate & e, double sample);
+        static double bound(const Estimate & e);
+
+    public:
+        TransferModel();
+        ~TransferModel();
+
+        static double transferTime(quint32 bytes, quint32 baudRate, int bitsPerCharacter = 10);
+
+        int deadline(const QString & portname, Stage stage, quint32 bytes, quint32 baudRate);
+        int probeDeadline(const QString & portname, quint32 bytes, quint32 baudRate);
+
+        void observeLatency(const QString & portname, double milliseconds);
+        void observeStage(const QString & portname, Stage stage, double milliseconds);
+
+        double latency(const QString & portname);
+        double stageTime(const QString & portname, Stage stage);
+        int samples(const QString & portname, Stage stage);
+
+        Margin margin(Stage stage);
+        void setMargin(Stage stage, double factor, int milliseconds);
+
+        int probeSlack();
+        void setProbeSlack(int milliseconds);
+
+        void forget(const QString & portname);
+        void clear();
+    };
+}
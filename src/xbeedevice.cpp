@@ -0,0 +1,632 @@
+#include "xbeedevice.h"
+
+#include "logging.h"
+
+namespace PM
+{
+    /**
+      Remote AT commands are sent to the application service with this
+      header, followed by the frame ID, the configuration options, the
+      command name and its parameter.
+      */
+
+    namespace
+    {
+        enum
+        {
+            ApplicationHeaderSize   = 8,
+            RemoteCommand           = 0x02,
+            RemoteCommandResponse   = 0x82,
+            ApplyChanges            = 0x02,
+            StatusOk                = 0x00,
+
+            OutputLow               = 4,
+            OutputHigh              = 5
+        };
+
+        QByteArray packNumber(quint32 value)
+        {
+            QByteArray ba;
+            do
+            {
+                ba.prepend((char) (value & 0xff));
+                value >>= 8;
+            }
+            while (value);
+            return ba;
+        }
+    }
+
+    XBeeDevice::XBeeDevice(QString address)
+        : Device()
+    {
+        _address = QHostAddress(address);
+
+        _written = 0;
+        _uart_idle = 0;
+        _baud_rate = 115200;
+        _minimum_timeout = 400;
+        _command_timeout = 100;
+        _command_retries = 3;
+        _frame = 0;
+        _sequence = 0;
+        _commands_ok = true;
+
+        _enabled = true;
+        _open = false;
+
+        _pacer.setSingleShot(true);
+        _command_timer.setSingleShot(true);
+        _clock.start();
+
+        useDefaultReset();
+
+        connect(&_app,      SIGNAL(readyRead()),    this,   SLOT(readApplication()));
+        connect(&_command_timer, SIGNAL(timeout()), this,   SLOT(commandTimedOut()));
+        connect(&_serial,   SIGNAL(readyRead()),    this,   SLOT(readSerial()));
+        connect(&_pacer,    SIGNAL(timeout()),      this,   SLOT(transmit()));
+
+        open();
+    }
+
+    XBeeDevice::~XBeeDevice()
+    {
+        close();
+
+        disconnect(&_app,      SIGNAL(readyRead()),    this,   SLOT(readApplication()));
+        disconnect(&_command_timer, SIGNAL(timeout()), this,   SLOT(commandTimedOut()));
+        disconnect(&_serial,   SIGNAL(readyRead()),    this,   SLOT(readSerial()));
+        disconnect(&_pacer,    SIGNAL(timeout()),      this,   SLOT(transmit()));
+    }
+
+    /**
+      Return true if name is the address of an XBee device.
+      */
+
+    bool XBeeDevice::isXBee(const QString & name)
+    {
+        QHostAddress address;
+        return address.setAddress(name)
+            && address.protocol() == QAbstractSocket::IPv4Protocol;
+    }
+
+    /**
+      Return the address of the local interface that reaches the XBee,
+      which is where it must send serial data.
+      */
+
+    QHostAddress XBeeDevice::localAddress()
+    {
+        QUdpSocket probe;
+        probe.connectToHost(_address, application_port);
+        probe.waitForConnected(_command_timeout);
+        return probe.localAddress();
+    }
+
+    /**
+      Queue the AT command at with parameter for the XBee. Commands are
+      sent one at a time, each again if no response arrives within
+      commandTimeout().
+
+      If configure is set, the device closes should the XBee not apply
+      the command. If clear is set, data received up to the moment it
+      is applied is discarded.
+      */
+
+    void XBeeDevice::command(const QByteArray & at, const QByteArray & parameter,
+                             bool configure, bool clear)
+    {
+        Command c;
+        c.at = at;
+        c.parameter = parameter;
+        c.attempts = 0;
+        c.configure = configure;
+        c.clear = clear;
+
+        _commands.append(c);
+        if (_commands.size() == 1)
+            sendCommand();
+    }
+
+    void XBeeDevice::setValue(const QByteArray & at, quint32 value,
+                              bool configure, bool clear)
+    {
+        command(at, packNumber(value), configure, clear);
+    }
+
+    /**
+      Send the command at the head of the queue. The frame ID and the
+      packet number are chosen when it is first sent, and kept for its
+      retries.
+      */
+
+    void XBeeDevice::sendCommand()
+    {
+        Command & c = _commands.first();
+
+        if (c.request.isEmpty())
+        {
+            if (++_frame == 0)
+                _frame = 1;
+
+            quint16 number = ++_sequence;
+
+            c.request.append((char) (number >> 8));
+            c.request.append((char) number);
+            c.request.append((char) ((number ^ 0x4242) >> 8));
+            c.request.append((char) (number ^ 0x4242));
+            c.request.append((char) 0);               // packet ID
+            c.request.append((char) 0);               // encryption pad
+            c.request.append((char) RemoteCommand);
+            c.request.append((char) 0);               // command options
+            c.request.append((char) _frame);
+            c.request.append((char) ApplyChanges);
+            c.request.append(c.at);
+            c.request.append(c.parameter);
+        }
+
+        _app.writeDatagram(c.request, _address, application_port);
+        _command_timer.start(_command_timeout);
+    }
+
+    void XBeeDevice::readApplication()
+    {
+        while (_app.hasPendingDatagrams())
+        {
+            QByteArray response;
+            QHostAddress sender;
+            response.resize(_app.pendingDatagramSize());
+            _app.readDatagram(response.data(), response.size(), &sender);
+
+            if (_commands.isEmpty()
+                    || sender != _address
+                    || response.size() < ApplicationHeaderSize + 4
+                    || (quint8) response[6] != RemoteCommandResponse
+                    || (quint8) response[8] != _frame
+                    || response.mid(9, 2) != _commands.first().at)
+                continue;
+
+            bool ok = (response[11] == StatusOk);
+            if (!ok)
+                qCDebug(pxbee) << "AT" << _commands.first().at << "rejected by" << portName()
+                               << "with status" << (int) response[11];
+
+            _command_timer.stop();
+            finishCommand(ok);
+        }
+    }
+
+    void XBeeDevice::commandTimedOut()
+    {
+        if (_commands.isEmpty())
+            return;
+
+        if (_commands.first().attempts++ < _command_retries)
+        {
+            sendCommand();
+            return;
+        }
+
+        qCDebug(pxbee) << "AT" << _commands.first().at << "timed out on" << portName();
+        finishCommand(false);
+    }
+
+    /**
+      Retire the command at the head of the queue, and send the next.
+      commandsFinished() is emitted once the queue drains.
+      */
+
+    void XBeeDevice::finishCommand(bool ok)
+    {
+        Command c = _commands.takeFirst();
+
+        if (!ok && c.configure)
+        {
+            qCCritical(pxbee) << "Failed to open device:" << portName();
+            _commands.clear();
+            close();
+            _commands_ok = true;
+            emit commandsFinished(false);
+            return;
+        }
+
+        _commands_ok = _commands_ok && ok;
+
+        if (ok && c.clear)
+            clear();
+
+        if (!_commands.isEmpty())
+        {
+            sendCommand();
+            return;
+        }
+
+        ok = _commands_ok;
+        _commands_ok = true;
+        emit commandsFinished(ok);
+    }
+
+    /**
+      Return whether AT commands are still waiting to be applied.
+      */
+
+    bool XBeeDevice::commandsPending()
+    {
+        return !_commands.isEmpty();
+    }
+
+    /**
+      Open the XBeeDevice for use.
+
+      The XBee is configured to pass serial data to this host over UDP
+      in transparent mode, at the current baud rate. The configuration
+      is queued ahead of the reset that follows; if the XBee does not
+      apply it, the device closes again.
+      */
+
+    bool XBeeDevice::open()
+    {
+        if (_open) return true;
+
+        QHostAddress local;
+        if (!_address.isNull()
+                && _app.bind(QHostAddress::AnyIPv4, 0)
+                && _serial.bind(QHostAddress::AnyIPv4, 0))
+            local = localAddress();
+
+        if (local.isNull())
+        {
+            _app.close();
+            _serial.close();
+            qCCritical(pxbee) << "Failed to open device:" << portName();
+            return false;
+        }
+
+        _open = true;
+
+        setValue("AP", 0, true);
+        setValue("IP", 0, true);
+        setValue("DL", local.toIPv4Address(), true);
+        setValue("DE", _serial.localPort(), true);
+        setValue("BD", _baud_rate, true);
+
+        emit deviceStateChanged(true);
+        reset();
+
+        return true;
+    }
+
+    /**
+      Return whether the device is open.
+
+      Unlike a serial port, an XBee that could not be configured is not
+      retried here, as every attempt waits for the network. The device is
+      open while its configuration is still pending.
+      */
+
+    bool XBeeDevice::isOpen()
+    {
+        return _enabled && _open;
+    }
+
+    void XBeeDevice::close()
+    {
+        bool pending = !_commands.isEmpty();
+
+        _command_timer.stop();
+        _commands.clear();
+        _commands_ok = true;
+
+        _pacer.stop();
+        _queue.clear();
+        _buffer.clear();
+
+        _app.close();
+        _serial.close();
+
+        _open = false;
+        emit deviceStateChanged(false);
+
+        if (pending)
+            emit commandsFinished(false);
+    }
+
+    void XBeeDevice::setEnabled(bool enabled)
+    {
+        _enabled = enabled;
+
+        if (_enabled)
+            open();
+        else
+            close();
+    }
+
+    bool XBeeDevice::enabled()
+    {
+        return _enabled;
+    }
+
+    quint32 XBeeDevice::minimumTimeout()
+    {
+        return _minimum_timeout;
+    }
+
+    /**
+      Set the minimum timeout for downloading to the Propeller.
+
+      The default value is 400 ms.
+      */
+
+    void XBeeDevice::setMinimumTimeout(quint32 milliseconds)
+    {
+        _minimum_timeout = milliseconds;
+    }
+
+    /**
+      Return the time in milliseconds for the XBee to transmit bytes
+      on its UART, plus minimumTimeout().
+      */
+
+    quint32 XBeeDevice::calculateTimeout(quint32 bytes)
+    {
+        return (transmitTime(bytes) + 999) / 1000 + minimumTimeout();
+    }
+
+    /**
+      Return the time in microseconds for the XBee to transmit bytes
+      on its UART with 8N1 framing.
+      */
+
+    qint64 XBeeDevice::transmitTime(qint64 bytes)
+    {
+        return bytes * 10 * 1000000 / _baud_rate;
+    }
+
+    int XBeeDevice::commandTimeout()
+    {
+        return _command_timeout;
+    }
+
+    /**
+      Set how long to wait for the XBee to answer an AT command before
+      sending it again.
+
+      The default value is 100 ms.
+      */
+
+    void XBeeDevice::setCommandTimeout(int milliseconds)
+    {
+        _command_timeout = milliseconds;
+    }
+
+    int XBeeDevice::commandRetries()
+    {
+        return _command_retries;
+    }
+
+    /**
+      Set how many times an unanswered AT command is sent again.
+
+      The default value is 3.
+      */
+
+    void XBeeDevice::setCommandRetries(int retries)
+    {
+        _command_retries = retries;
+    }
+
+    /**
+      Set the reset strategy for your device.
+
+      The only strategy is "dio", which drives the given XBee DIO pin
+      low and high again.
+      */
+
+    void XBeeDevice::useReset(QString name, int pin)
+    {
+        if (name == "dio" && pin >= 0 && pin <= 9)
+            _reset_pin = pin;
+        else
+            qCDebug(pxbee) << "Invalid reset type:" << name << pin;
+    }
+
+    /**
+      Use the default reset strategy for your device, which is DIO4.
+      */
+
+    void XBeeDevice::useDefaultReset()
+    {
+        _reset_pin = default_reset_pin;
+    }
+
+    /**
+      Reset your attached Propeller hardware by pulsing the reset pin
+      with remote AT commands.
+
+      The commands are only queued here; the reset is complete when
+      commandsFinished() is emitted. Each command is only acknowledged
+      once applied, so the pulse is at least one round trip long.
+      */
+
+    bool XBeeDevice::reset()
+    {
+        if (!_open)
+            return false;
+
+        QByteArray pin = "D" + QByteArray::number(_reset_pin);
+
+        setValue(pin, OutputLow);
+        setValue(pin, OutputHigh, false, true);
+
+        return true;
+    }
+
+    /**
+      The Propeller is released from reset before the XBee acknowledges
+      it, so less of the boot loader's wait remains than over a serial
+      port.
+      */
+
+    quint32 XBeeDevice::resetPeriod()
+    {
+        return 60;
+    }
+
+    bool XBeeDevice::clear()
+    {
+        _queue.clear();
+        _buffer.clear();
+
+        while (_serial.hasPendingDatagrams())
+            _serial.readDatagram(0, 0);
+
+        return true;
+    }
+
+    /**
+      Set the baud rate of the XBee's UART. Non-standard rates are
+      passed to the XBee as is.
+
+      baudRate() returns the new rate at once, but the XBee only uses
+      it once commandsFinished() is emitted.
+      */
+
+    bool XBeeDevice::setBaudRate(quint32 baudRate)
+    {
+        if (!baudRate)
+            return false;
+
+        if (_open && baudRate != _baud_rate)
+            setValue("BD", baudRate);
+
+        if (baudRate != _baud_rate)
+        {
+            _baud_rate = baudRate;
+            emit baudRateChanged(_baud_rate);
+        }
+
+        return true;
+    }
+
+    QString XBeeDevice::portName()
+    {
+        return _address.toString();
+    }
+
+    quint32 XBeeDevice::baudRate()
+    {
+        return _baud_rate;
+    }
+
+    qint64 XBeeDevice::bytesToWrite()
+    {
+        return _queue.size();
+    }
+
+    qint64 XBeeDevice::bytesAvailable()
+    {
+        return _buffer.size();
+    }
+
+    QByteArray XBeeDevice::read(qint64 maxSize)
+    {
+        QByteArray ba = _buffer.left(maxSize);
+        _buffer.remove(0, ba.size());
+        return ba;
+    }
+
+    QByteArray XBeeDevice::readAll()
+    {
+        QByteArray ba = _buffer;
+        _buffer.clear();
+        return ba;
+    }
+
+    bool XBeeDevice::putChar(char c)
+    {
+        return write(QByteArray(1, c)) == 1;
+    }
+
+    qint64 XBeeDevice::write(QByteArray ba)
+    {
+        if (!isOpen())
+            return -1;
+
+        _queue.append(ba);
+
+        if (!_pacer.isActive())
+            transmit();
+
+        return ba.size();
+    }
+
+    void XBeeDevice::readSerial()
+    {
+        bool received = false;
+
+        while (_serial.hasPendingDatagrams())
+        {
+            QByteArray datagram;
+            QHostAddress sender;
+            datagram.resize(_serial.pendingDatagramSize());
+            _serial.readDatagram(datagram.data(), datagram.size(), &sender);
+
+            if (sender != _address)
+                continue;
+
+            _buffer.append(datagram);
+            received = true;
+        }
+
+        if (received)
+            emit readyRead();
+    }
+
+    /**
+      Send queued data while the XBee's UART has less than two full
+      datagrams left to transmit.
+      */
+
+    void XBeeDevice::transmit()
+    {
+        qint64 now = _clock.nsecsElapsed() / 1000;
+        qint64 lead = transmitTime(2 * max_datagram);
+        qint64 sent = 0;
+
+        _uart_idle = qMax(_uart_idle, now);
+
+        while (!_queue.isEmpty() && _uart_idle - now < lead)
+        {
+            QByteArray datagram = _queue.left(max_datagram);
+            _queue.remove(0, datagram.size());
+
+            if (_serial.writeDatagram(datagram, _address, serial_port) < 0)
+            {
+                emit sendError(_serial.errorString());
+                _queue.clear();
+                break;
+            }
+
+            _uart_idle += transmitTime(datagram.size());
+            sent += datagram.size();
+        }
+
+        if (!_queue.isEmpty())
+            _pacer.start(qMax<qint64>(1, (_uart_idle - now - lead) / 1000));
+
+        if (sent)
+        {
+            if (!_written)
+                QTimer::singleShot(0, this, SLOT(flushWritten()));
+            _written += sent;
+        }
+    }
+
+    void XBeeDevice::flushWritten()
+    {
+        qint64 written = _written;
+        _written = 0;
+        emit bytesWritten(written);
+    }
+
+}
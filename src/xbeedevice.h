@@ -0,0 +1,142 @@
+#pragma once
+
+#include "template/device.h"
+
+#include <QUdpSocket>
+#include <QHostAddress>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QList>
+
+/**
+    @class XBeeDevice device/xbeedevice.h XBeeDevice
+  
+    @brief The XBeeDevice class provides access to Propeller devices
+    attached to an XBee Wi-Fi module.
+
+    The port name of an XBee device is its IPv4 address. Serial data is
+    passed through the XBee's UART over UDP, while configuration and
+    reset use the XBee's application service, where remote AT commands
+    are acknowledged by the module and retried if lost.
+
+    AT commands are queued and sent one at a time without blocking.
+    commandsPending() is true until the queue drains, at which point
+    commandsFinished() reports whether the XBee applied all of them.
+
+    Datagrams are paced to the UART rate so the module's buffers are
+    never overrun, but kept far enough ahead that the UART does not
+    idle between them.
+
+    Downloads over Wi-Fi use the high-speed miniloader, which detects
+    and retransmits lost packets.
+  */
+
+namespace PM
+{
+
+class XBeeDevice : public Device
+{
+    Q_OBJECT
+
+    struct Command
+    {
+        QByteArray  at;
+        QByteArray  parameter;
+        QByteArray  request;
+        int         attempts;
+        bool        configure;
+        bool        clear;
+    };
+
+    QUdpSocket  _app;
+    QUdpSocket  _serial;
+    QHostAddress _address;
+
+    QByteArray  _buffer;
+    QByteArray  _queue;
+    qint64      _written;
+    QTimer      _pacer;
+    QElapsedTimer _clock;
+    qint64      _uart_idle;
+
+    quint32     _baud_rate;
+    quint32     _minimum_timeout;
+    int         _reset_pin;
+    int         _command_timeout;
+    int         _command_retries;
+    quint8      _frame;
+    quint16     _sequence;
+
+    QList<Command> _commands;
+    QTimer      _command_timer;
+    bool        _commands_ok;
+
+    bool        _enabled;
+    bool        _open;
+
+    QHostAddress localAddress();
+    qint64      transmitTime(qint64 bytes);
+
+    void        command(const QByteArray & at, const QByteArray & parameter,
+                        bool configure = false, bool clear = false);
+    void        setValue(const QByteArray & at, quint32 value,
+                         bool configure = false, bool clear = false);
+    void        sendCommand();
+    void        finishCommand(bool ok);
+
+private slots:
+    void        readApplication();
+    void        commandTimedOut();
+    void        readSerial();
+    void        transmit();
+    void        flushWritten();
+
+public:
+    static const quint16 application_port = 0x0BEE;
+    static const quint16 serial_port = 0x2616;
+    static const int max_datagram = 1392;
+    static const int default_reset_pin = 4;
+
+    XBeeDevice(QString address = QString());
+    ~XBeeDevice();
+
+    static      bool isXBee(const QString & name);
+
+    void        setEnabled(bool enabled);
+    bool        enabled();
+
+    bool        open();
+    void        close();
+    bool        isOpen();
+
+    bool        clear();
+    bool        setBaudRate(quint32 baudRate);
+
+    QString     portName();
+    quint32     baudRate();
+    qint64      bytesToWrite();
+    qint64      bytesAvailable();
+    QByteArray  read(qint64 maxSize);
+    QByteArray  readAll();
+    bool        putChar(char c);
+    qint64      write(QByteArray ba);
+
+    quint32     minimumTimeout();
+    void        setMinimumTimeout(quint32 milliseconds);
+    quint32     calculateTimeout(quint32 bytes);
+
+    int         commandTimeout();
+    void        setCommandTimeout(int milliseconds);
+    int         commandRetries();
+    void        setCommandRetries(int retries);
+
+    void        useReset(QString name, int pin = default_reset_pin);
+    void        useDefaultReset();
+    bool        reset();
+    quint32     resetPeriod();
+
+    bool        commandsPending();
+
+};
+
+}
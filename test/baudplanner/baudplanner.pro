@@ -0,0 +1,6 @@
+include(../test.pri)
+
+TARGET = tst_baudplanner
+
+SOURCES += \
+    tst_baudplanner.cpp
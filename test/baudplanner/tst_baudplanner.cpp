@@ -0,0 +1,133 @@
+#include <QtTest>
+
+#include "baudplanner.h"
+
+/*
+    Checks the rates the planner picks, the timing values it derives
+    for the miniloader, and how it falls back from a failing rate and
+    recovers it later.
+ */
+
+class TestBaudPlanner : public QObject
+{
+    Q_OBJECT
+
+    PM::BaudPlanner::Adapter ftdi()
+    {
+        return PM::BaudPlanner::adapter(0x0403);
+    }
+
+private slots:
+    void fastestRate_data()
+    {
+        QTest::addColumn<quint16>("vendor");
+        QTest::addColumn<quint32>("clock");
+        QTest::addColumn<quint32>("rate");
+
+        QTest::newRow("FTDI 80 MHz")        << (quint16) 0x0403 << (quint32) 80000000 << (quint32) 1000000;
+        QTest::newRow("FTDI 100 MHz")       << (quint16) 0x0403 << (quint32) 100000000 << (quint32) 1000000;
+        QTest::newRow("FTDI 20 MHz")        << (quint16) 0x0403 << (quint32) 20000000 << (quint32) 230400;
+        QTest::newRow("CP210x 80 MHz")      << (quint16) 0x10c4 << (quint32) 80000000 << (quint32) 921600;
+        QTest::newRow("Generic 12 MHz")     << (quint16) 0x0000 << (quint32) 12000000 << (quint32) 115200;
+        QTest::newRow("FTDI RCFAST")        << (quint16) 0x0403 << (quint32) 5000000 << (quint32) 0;
+    }
+
+    void fastestRate()
+    {
+        QFETCH(quint16, vendor);
+        QFETCH(quint32, clock);
+        QFETCH(quint32, rate);
+
+        PM::BaudPlanner planner;
+        PM::BaudPlanner::Plan p = planner.plan("port", clock, PM::BaudPlanner::adapter(vendor));
+
+        QCOMPARE(p.finalBaudRate, rate);
+        QCOMPARE(p.isValid(), rate != 0);
+        if (p.isValid())
+            QVERIFY(p.error <= planner.tolerance());
+    }
+
+    void timingValues()
+    {
+        PM::BaudPlanner planner;
+        PM::BaudPlanner::Plan p = planner.evaluate(80000000, 1000000, ftdi());
+
+        QVERIFY(p.isValid());
+        QCOMPARE(p.finalBitTime, (quint32) 80);
+        QCOMPARE(p.initialBitTime, (quint32) 694);
+        QCOMPARE(p.bitTime1_5, (quint32) (120 - PM::BaudPlanner::max_rx_sense_error));
+        QCOMPARE(p.failsafe, (quint32) (2 * 80000000 / PM::BaudPlanner::rxwait_cycles));
+
+        // two bytes worth of RxWait loop iterations
+        QCOMPARE(p.endOfPacket, (quint32) 134);
+        QVERIFY(p.endOfPacket * PM::BaudPlanner::rxwait_cycles >= 2 * 10 * p.finalBitTime);
+    }
+
+    void failureFallsBack()
+    {
+        PM::BaudPlanner planner;
+
+        // a single failure is not enough to give up on a rate
+        planner.recordFailure("port", 1000000);
+        QVERIFY(!planner.isExcluded("port", 1000000));
+        QCOMPARE(planner.plan("port", 80000000, ftdi()).finalBaudRate, (quint32) 1000000);
+
+        planner.recordFailure("port", 1000000);
+        QVERIFY(planner.isExcluded("port", 1000000));
+        QCOMPARE(planner.plan("port", 80000000, ftdi()).finalBaudRate, (quint32) 921600);
+
+        // other ports are unaffected
+        QCOMPARE(planner.plan("other", 80000000, ftdi()).finalBaudRate, (quint32) 1000000);
+    }
+
+    void successResetsFailures()
+    {
+        PM::BaudPlanner planner;
+
+        planner.recordFailure("port", 1000000);
+        planner.recordSuccess("port", 1000000);
+        QCOMPARE(planner.confirmedRate("port"), (quint32) 1000000);
+
+        planner.recordFailure("port", 1000000);
+        QVERIFY(!planner.isExcluded("port", 1000000));
+        QCOMPARE(planner.confirmedRate("port"), (quint32) 1000000);
+
+        planner.recordFailure("port", 1000000);
+        QVERIFY(planner.isExcluded("port", 1000000));
+        QCOMPARE(planner.confirmedRate("port"), (quint32) 0);
+    }
+
+    void exclusionExpires()
+    {
+        PM::BaudPlanner planner;
+        planner.setFailureTimeout(20);
+
+        planner.recordFailure("port", 1000000);
+        planner.recordFailure("port", 1000000);
+        QCOMPARE(planner.plan("port", 80000000, ftdi()).finalBaudRate, (quint32) 921600);
+
+        QTest::qSleep(40);
+        QVERIFY(!planner.isExcluded("port", 1000000));
+        QCOMPARE(planner.plan("port", 80000000, ftdi()).finalBaudRate, (quint32) 1000000);
+
+        // back on probation: the next failure excludes it again
+        planner.recordFailure("port", 1000000);
+        QVERIFY(planner.isExcluded("port", 1000000));
+    }
+
+    void forgetClearsHistory()
+    {
+        PM::BaudPlanner planner;
+
+        planner.recordSuccess("port", 921600);
+        planner.recordFailure("port", 1000000);
+        planner.recordFailure("port", 1000000);
+        planner.forget("port");
+
+        QCOMPARE(planner.confirmedRate("port"), (quint32) 0);
+        QCOMPARE(planner.plan("port", 80000000, ftdi()).finalBaudRate, (quint32) 1000000);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestBaudPlanner)
+#include "tst_baudplanner.moc"
@@ -0,0 +1,6 @@
+include(../test.pri)
+
+TARGET = tst_miniloader
+
+SOURCES += \
+    tst_miniloader.cpp
@@ -0,0 +1,187 @@
+#include <QtTest>
+#include <QFile>
+#include <QtEndian>
+
+#include <PropellerImage>
+
+#include "miniloader.h"
+
+/*
+    Checks where MiniLoader patches the host values into the core and
+    what it sends in each phase of a download.
+
+    The offsets and instruction words below were taken from the output
+    of src/firmware/miniloader.py, which cuts the arrays in
+    miniloader.cpp from openspin's image of miniloader.spin.
+ */
+
+namespace
+{
+    // IBitTime is register $67 of the core, after the 0x18 byte header
+    const int core_size = 472;
+    const int core_hostvalues = 0x18 + 4 * 0x67;
+
+    // PACKET4 fields, in longs from the start of the packet code
+    const int load_dest = 7;
+    const int load_longs = 8;
+    const int load_capacity = 21;
+    const quint32 driver_origin = 0x98;
+
+    const quint32 callframe_checksum = 2 * (0xff + 0xff + 0xf9 + 0xff);
+}
+
+class TestMiniLoader : public QObject
+{
+    Q_OBJECT
+
+    PropellerImage image;
+    PM::BaudPlanner::Plan plan;
+
+    static qint32 readLong(const QByteArray & data, int pos)
+    {
+        return qFromLittleEndian<qint32>((const uchar *) data.constData() + pos);
+    }
+
+    static QByteArray packLong(qint32 value)
+    {
+        QByteArray b(4, 0);
+        qToLittleEndian<qint32>(value, (uchar *) b.data());
+        return b;
+    }
+
+    quint32 checksum()
+    {
+        QByteArray data = image.data().left(image.startOfVariables());
+        quint32 sum = callframe_checksum;
+        for (int i = 0; i < data.size(); i++)
+            sum += (uchar) data[i];
+        return sum;
+    }
+
+    // run a download up to the packet that follows RAM verification
+    void verify(PM::MiniLoader & m)
+    {
+        m.consume(packLong(m.packetCount()));
+        m.packet();
+        m.consume(packLong(0));
+        QCOMPARE(m.phase(), PM::MiniLoader::VerifyRam);
+        m.consume(packLong(-(qint32) checksum()));
+    }
+
+private slots:
+    void initTestCase()
+    {
+        QFile file(QString(TEST_IMAGES) + "/TerminalDemo.binary");
+        QVERIFY(file.open(QIODevice::ReadOnly));
+        image = PropellerImage(file.readAll());
+
+        PM::BaudPlanner planner;
+        plan = planner.evaluate(image.clockFrequency(), 1000000,
+                                PM::BaudPlanner::adapter(0x0403));
+        QVERIFY(plan.isValid());
+    }
+
+    void hostValues()
+    {
+        PM::MiniLoader m;
+        PropellerImage l = m.start(image, plan);
+        QByteArray d = l.data();
+
+        QCOMPARE(d.size(), core_size);
+        QVERIFY(l.checksumIsValid());
+        QVERIFY(PM::MiniLoader::isLoader(l));
+        QVERIFY(!PM::MiniLoader::isLoader(image));
+        QCOMPARE(l.clockFrequency(), image.clockFrequency());
+
+        // LastLongs counts only the longs of the final, partial packet
+        QVERIFY(m.packetCount() > 1);
+        int size = (image.startOfVariables() + 3) & ~3;
+        int last = size - (m.packetCount() - 1) * (PM::MiniLoader::max_payload - 4);
+
+        QCOMPARE((quint32) readLong(d, core_hostvalues),      plan.initialBitTime);
+        QCOMPARE((quint32) readLong(d, core_hostvalues + 4),  plan.finalBitTime);
+        QCOMPARE((quint32) readLong(d, core_hostvalues + 8),  plan.bitTime1_5);
+        QCOMPARE((quint32) readLong(d, core_hostvalues + 12), plan.failsafe);
+        QCOMPARE((quint32) readLong(d, core_hostvalues + 16), plan.endOfPacket);
+        QCOMPARE(readLong(d, core_hostvalues + 20), (qint32) m.packetCount());
+        QCOMPARE(readLong(d, core_hostvalues + 24), (qint32) (last / 4));
+
+        QCOMPARE(PM::MiniLoader::hostValue(l, PM::MiniLoader::LastLongs), (quint32) (last / 4));
+        QCOMPARE(PM::MiniLoader::hostValue(l, PM::MiniLoader::EndOfPacket), plan.endOfPacket);
+    }
+
+    void packets_data()
+    {
+        QTest::addColumn<bool>("eeprom");
+        QTest::addColumn<int>("phase");
+        QTest::addColumn<int>("size");
+        QTest::addColumn<quint32>("code");
+
+        QTest::newRow("LaunchStart") << false << (int) PM::MiniLoader::LaunchStart << 28 << (quint32) 0x58FC72B8;
+        QTest::newRow("LoadDriver")  << true  << (int) PM::MiniLoader::LoadDriver  << 40 + 4 * load_capacity << (quint32) 0x54BCF880;
+    }
+
+    void packets()
+    {
+        QFETCH(bool, eeprom);
+        QFETCH(int, phase);
+        QFETCH(int, size);
+        QFETCH(quint32, code);
+
+        PM::MiniLoader m;
+        m.start(image, plan, eeprom);
+
+        m.consume(packLong(m.packetCount()));
+        QCOMPARE(m.phase(), PM::MiniLoader::Data);
+        QByteArray p = m.packet();
+        QCOMPARE(readLong(p, 0), (qint32) m.packetCount());
+
+        m.consume(packLong(0));
+        QCOMPARE(m.phase(), PM::MiniLoader::VerifyRam);
+        p = m.packet();
+        QCOMPARE(p.size(), 4 + 72);
+        QCOMPARE(readLong(p, 0), (qint32) 0);
+        QCOMPARE((quint32) readLong(p, 4), (quint32) 0xA0BCE462);
+
+        // packet IDs carry on from the negative checksum
+        m.consume(packLong(-(qint32) checksum()));
+        QCOMPARE((int) m.phase(), phase);
+        p = m.packet();
+        QCOMPARE(p.size(), 4 + size);
+        QCOMPARE(readLong(p, 0), -(qint32) checksum());
+        QCOMPARE((quint32) readLong(p, 4), code);
+    }
+
+    void loadDriver()
+    {
+        PM::MiniLoader m;
+        m.start(image, plan, true);
+        verify(m);
+
+        QByteArray p = m.packet();
+        QCOMPARE((quint32) readLong(p, 4 + 4 * load_dest), driver_origin);
+        QCOMPARE(readLong(p, 4 + 4 * load_longs), (qint32) load_capacity);
+
+        m.consume(packLong(-(qint32) checksum() - 1));
+        p = m.packet();
+        QCOMPARE(readLong(p, 0), -(qint32) checksum() - 1);
+        QCOMPARE((quint32) readLong(p, 4 + 4 * load_dest), driver_origin + load_capacity);
+    }
+
+    void launch()
+    {
+        PM::MiniLoader m;
+        m.start(image, plan);
+        verify(m);
+
+        m.consume(packLong(-(qint32) checksum() - 1));
+        QCOMPARE(m.phase(), PM::MiniLoader::LaunchFinal);
+        QByteArray p = m.packet();
+        QCOMPARE(p.size(), 4 + 16);
+        QCOMPARE(readLong(p, 0), -(qint32) checksum() - 1);
+        QCOMPARE((quint32) readLong(p, 4), (quint32) 0x04FCBE06);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestMiniLoader)
+#include "tst_miniloader.moc"
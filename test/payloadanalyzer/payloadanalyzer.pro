@@ -0,0 +1,6 @@
+include(../test.pri)
+
+TARGET = tst_payloadanalyzer
+
+SOURCES += \
+    tst_payloadanalyzer.cpp
@@ -0,0 +1,125 @@
+#include <QtTest>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QtEndian>
+
+#include <PropellerImage>
+#include <PayloadAnalyzer>
+
+/*
+    Checks that every image in test/images survives minimization: the
+    RAM the boot loader leaves behind after the reduced download must
+    match RAM built from the full image here, with the call frame placed
+    from DBase, and pass the boot loader's checksum.
+ */
+
+class TestPayloadAnalyzer : public QObject
+{
+    Q_OBJECT
+
+    static QByteArray readImage(const QString & path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            return QByteArray();
+        return file.readAll();
+    }
+
+    static QByteArray bootRam(const QByteArray & data)
+    {
+        QByteArray ram = data.left(0x8000);
+        ram.append(QByteArray(0x8000 - ram.size(), 0));
+
+        int dbase = qFromLittleEndian<quint16>((const uchar *) data.constData() + 0x0A);
+        for (int i = dbase - 8; i < dbase; i += 4)
+        {
+            ram[i]   = (char) 0xff;
+            ram[i+1] = (char) 0xff;
+            ram[i+2] = (char) 0xf9;
+            ram[i+3] = (char) 0xff;
+        }
+        return ram;
+    }
+
+private slots:
+    void roundTrip_data()
+    {
+        QTest::addColumn<QString>("path");
+
+        QDirIterator it(TEST_IMAGES, QStringList() << "*.binary" << "*.eeprom",
+                QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext())
+        {
+            QString path = it.next();
+            QTest::newRow(qPrintable(path.mid(QString(TEST_IMAGES).size() + 1))) << path;
+        }
+    }
+
+    void roundTrip()
+    {
+        QFETCH(QString, path);
+
+        QByteArray data = readImage(path);
+        QVERIFY(!data.isEmpty());
+
+        PropellerImage image(data, path);
+        QVERIFY(image.isValid());
+
+        QByteArray payload = PM::PayloadAnalyzer::minimize(image);
+        QVERIFY(payload.size() <= data.size());
+        QVERIFY(payload.size() % 4 == 0 || payload == data);
+        QCOMPARE(payload, data.left(payload.size()));
+
+        QByteArray expected = bootRam(data);
+        QCOMPARE(PM::PayloadAnalyzer::checksum(expected), (quint8) 0);
+        QCOMPARE(PM::PayloadAnalyzer::ram(payload, image.startOfStackSpace()), expected);
+    }
+
+    void eepromSendsProgramOnly()
+    {
+        QByteArray binary = readImage(TEST_IMAGES "/ls/Brettris.binary");
+        QByteArray eeprom = readImage(TEST_IMAGES "/ls/Brettris.eeprom");
+        QCOMPARE(eeprom.size(), 0x8000);
+
+        PropellerImage image(eeprom);
+        QByteArray payload = PM::PayloadAnalyzer::minimize(image);
+
+        QVERIFY(payload.size() <= binary.size());
+        QCOMPARE(bootRam(payload), bootRam(eeprom));
+    }
+
+    void keepsProgramBelowCallFrame()
+    {
+        // the last program longs sit just below DBase - 8 when there are
+        // no variables; they must not be mistaken for the call frame
+        QByteArray data = readImage(TEST_IMAGES "/ls/ImAlive.binary");
+        PropellerImage image(data);
+
+        QCOMPARE(PM::PayloadAnalyzer::minimize(image), data);
+    }
+
+    void callFrameAtStackSpace()
+    {
+        QByteArray data = readImage(TEST_IMAGES "/Blank.binary");
+        PropellerImage image(data);
+
+        QByteArray ram = PM::PayloadAnalyzer::ram(data, image.startOfStackSpace());
+        QCOMPARE(ram.size(), 0x8000);
+        QCOMPARE(ram.mid(image.startOfStackSpace(), 8),
+                QByteArray("\xff\xff\xf9\xff\xff\xff\xf9\xff", 8));
+        QCOMPARE(ram.left(data.size()), data);
+    }
+
+    void invalidChecksumSendsAll()
+    {
+        QByteArray data = readImage(TEST_IMAGES "/ls/FrappyBard.eeprom");
+        data[0x20] = data[0x20] + 1;
+
+        PropellerImage image(data);
+        QCOMPARE(PM::PayloadAnalyzer::minimize(image), data);
+    }
+};
+
+QTEST_APPLESS_MAIN(TestPayloadAnalyzer)
+#include "tst_payloadanalyzer.moc"
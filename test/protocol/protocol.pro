@@ -0,0 +1,6 @@
+include(../test.pri)
+
+TARGET = tst_protocol
+
+SOURCES += \
+    tst_protocol.cpp
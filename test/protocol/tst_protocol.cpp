@@ -0,0 +1,231 @@
+#include <QtTest>
+#include <QDirIterator>
+#include <QFile>
+
+#include <PropellerProtocol>
+
+/*
+    Checks that download streams decode back to what was encoded: the
+    translator table against the pulses each of its bytes puts on the
+    wire, image data and longs, complete downloads, and the chunked
+    encoder.
+ */
+
+class TestProtocol : public QObject
+{
+    Q_OBJECT
+
+    static QByteArray readImage(const QString & path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly))
+            return QByteArray();
+        return file.readAll();
+    }
+
+    // Measure the low pulses of byte as the Propeller does: one bit
+    // period is a 1, two bit periods a 0. Returns the bit count, or -1.
+    static int pulses(quint8 byte, quint8 * value)
+    {
+        int line = (byte << 1) | 0x200;
+        int count = 0;
+        *value = 0;
+
+        for (int bit = 0; bit < 10; bit++)
+        {
+            if ((line >> bit) & 1)
+                continue;
+
+            int length = 0;
+            while (!((line >> bit) & 1))
+            {
+                length++;
+                bit++;
+            }
+
+            if (length > 2)
+                return -1;
+
+            *value |= (length == 1) << count++;
+        }
+        return count;
+    }
+
+    static QByteArray pattern(int size, quint32 seed)
+    {
+        QByteArray data(size, 0);
+        for (int i = 0; i < size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            data[i] = (char) (seed >> 16);
+        }
+        return data;
+    }
+
+private slots:
+    void translator()
+    {
+        for (int width = 1; width <= 5; width++)
+        {
+            for (int value = 0; value < (1 << width); value++)
+            {
+                quint8 code = Propeller::translator[value][width - 1][0];
+                int bits = Propeller::translator[value][width - 1][1];
+
+                quint8 sent = 0;
+                QCOMPARE(pulses(code, &sent), bits);
+                QCOMPARE((int) sent, value & ((1 << bits) - 1));
+            }
+        }
+
+        // %111 with only three bits left is three short pulses; 0xFA
+        // would send the two bits 0,1
+        QCOMPARE(Propeller::translator[7][2][0], (quint8) 0xF5);
+    }
+
+    void finalBits()
+    {
+        // every value of the last byte, so each tail width meets every
+        // bit pattern
+        for (int size = 1; size <= 4; size++)
+        {
+            for (int last = 0; last < 256; last++)
+            {
+                QByteArray data = pattern(size, last);
+                data[size - 1] = (char) last;
+
+                bool ok = false;
+                QByteArray encoded = PropellerProtocol::encodeData(data);
+                QCOMPARE(encoded, PropellerProtocol::encodeDataReference(data));
+                QCOMPARE(PropellerProtocol::decodeData(encoded, data.size(), &ok), data);
+                QVERIFY(ok);
+            }
+        }
+    }
+
+    void imageData_data()
+    {
+        QTest::addColumn<QByteArray>("data");
+
+        QTest::newRow("zeros")  << QByteArray(1024, 0);
+        QTest::newRow("ones")   << QByteArray(1024, (char) 0xff);
+        QTest::newRow("random") << pattern(32768, 1);
+
+        QDirIterator it(TEST_IMAGES, QStringList() << "*.binary" << "*.eeprom",
+                QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext())
+        {
+            QString path = it.next();
+            QTest::newRow(qPrintable(path.mid(QString(TEST_IMAGES).size() + 1)))
+                << readImage(path);
+        }
+    }
+
+    void imageData()
+    {
+        QFETCH(QByteArray, data);
+
+        QByteArray encoded = PropellerProtocol::encodeData(data);
+        QCOMPARE(encoded.size(), PropellerProtocol::encodedSize(data));
+        QCOMPARE(encoded, PropellerProtocol::encodeDataReference(data));
+
+        bool ok = false;
+        QCOMPARE(PropellerProtocol::decodeData(encoded, data.size(), &ok), data);
+        QVERIFY(ok);
+
+        // a stream cut short does not decode
+        PropellerProtocol::decodeData(encoded.left(encoded.size() - 1), data.size(), &ok);
+        QVERIFY(!ok);
+    }
+
+    void longs_data()
+    {
+        QTest::addColumn<quint32>("value");
+
+        QTest::newRow("0")          << (quint32) 0;
+        QTest::newRow("1")          << (quint32) 1;
+        QTest::newRow("0x8000")     << (quint32) 0x8000;
+        QTest::newRow("0x80000000") << (quint32) 0x80000000;
+        QTest::newRow("0xFFFFFFFF") << (quint32) 0xFFFFFFFF;
+        QTest::newRow("0x12345678") << (quint32) 0x12345678;
+    }
+
+    void longs()
+    {
+        QFETCH(quint32, value);
+
+        QByteArray encoded = PropellerProtocol::encodeLong(value);
+        QCOMPARE(encoded.size(), PropellerProtocol::encodedLongSize(value));
+
+        quint32 decoded = ~value;
+        QCOMPARE(PropellerProtocol::decodeLong(encoded.constData(), encoded.size(), &decoded),
+                encoded.size());
+        QCOMPARE(decoded, value);
+    }
+
+    void download_data()
+    {
+        QTest::addColumn<int>("command");
+
+        QTest::newRow("Shutdown") << (int) Command::Shutdown;
+        QTest::newRow("Run")      << (int) Command::Run;
+        QTest::newRow("Write")    << (int) Command::Write;
+        QTest::newRow("WriteRun") << (int) Command::WriteRun;
+    }
+
+    void download()
+    {
+        QFETCH(int, command);
+
+        QByteArray image = readImage(TEST_IMAGES "/TerminalDemo.binary");
+        QVERIFY(!image.isEmpty());
+
+        PropellerProtocol protocol;
+        QByteArray stream = protocol.buildDownload(image, (Command::Command) command);
+        QCOMPARE(stream.size(), protocol.downloadSize(image, (Command::Command) command));
+
+        Command::Command decodedcommand = Command::Shutdown;
+        QByteArray decoded;
+        QVERIFY(protocol.decodeDownload(stream, &decodedcommand, &decoded));
+        QCOMPARE((int) decodedcommand, command);
+        QCOMPARE(decoded, command == Command::Shutdown ? QByteArray() : image);
+
+        QVERIFY(protocol.verifyDownload(image, (Command::Command) command));
+    }
+
+    void handshakeSize()
+    {
+        // the command long follows the part of the request the reply
+        // waits for
+        PropellerProtocol protocol;
+        for (int command = Command::Shutdown; command <= Command::WriteRun; command++)
+        {
+            QCOMPARE(PropellerProtocol::handshakeSize(),
+                    protocol.requestSize((Command::Command) command)
+                    - PropellerProtocol::encodedLongSize(command));
+        }
+    }
+
+    void encoder()
+    {
+        QByteArray image = readImage(TEST_IMAGES "/ls/Brettris.binary");
+        QVERIFY(!image.isEmpty());
+
+        PropellerProtocol protocol;
+        QByteArray expected = protocol.buildDownload(image, Command::WriteRun);
+
+        PropellerEncoder encoder;
+        encoder.start(protocol, image, Command::WriteRun);
+        QCOMPARE(encoder.size(), expected.size());
+
+        QByteArray stream;
+        while (!encoder.atEnd())
+            stream.append(encoder.read(1000));
+
+        QCOMPARE(stream, expected);
+        QCOMPARE(encoder.produced(), expected.size());
+    }
+};
+
+QTEST_APPLESS_MAIN(TestProtocol)
+#include "tst_protocol.moc"
@@ -0,0 +1,14 @@
+include(../common.pri)
+include(../include.pri)
+
+QT += testlib
+
+TEMPLATE = app
+DESTDIR = $$OUT_PWD
+
+CONFIG += console testcase
+
+# internal classes are tested through their headers in src/
+INCLUDEPATH += $$TOP_PWD/src/
+
+DEFINES += TEST_IMAGES=\\\"$$TOP_PWD/test/images\\\"
@@ -0,0 +1,9 @@
+include(../common.pri)
+
+TEMPLATE = subdirs
+SUBDIRS = \
+    baudplanner \
+    miniloader \
+    payloadanalyzer \
+    protocol \
+